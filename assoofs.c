@@ -7,6 +7,24 @@
 #include <linux/fs.h>           // Needed for libfs
 #include <linux/buffer_head.h>  // Needed for buffer_head
 #include <linux/slab.h>         // Needed for kmem_cache
+#include <linux/blkdev.h>       // Needed for blk_plug
+#include <linux/crypto.h>       // Needed for the compressors
+#include <linux/fs_context.h>   // Needed for the mount api
+#include <linux/fs_parser.h>    // Needed for the mount options
+#include <linux/fileattr.h>     // Needed for chattr
+#include <linux/uio.h>          // Needed for iov_iter
+#include <linux/splice.h>       // Needed for add_to_pipe
+#include <linux/pipe_fs_i.h>    // Needed for pipe_buffer
+#include <linux/rhashtable.h>   // Needed for the directory indexes
+#include <linux/jhash.h>        // Needed for jhash
+#include <linux/shrinker.h>     // Needed for the directory index shrinker
+#include <linux/bio.h>          // Needed for the batched reads
+#include <linux/sort.h>         // Needed for sort
+#include <linux/completion.h>   // Needed for completion
+#include <linux/version.h>      // Needed for LINUX_VERSION_CODE
+#include <linux/workqueue.h>    // Needed for the delayed discards
+#include <linux/uaccess.h>      // Needed for copy_from_user
+#include <linux/debugfs.h>      // Needed for the trace capture
 
 #include "assoofs.h"
 
@@ -24,6 +42,124 @@
 #define error2(fmt, arg1, arg2)         printk(KERN_ERR ASSOOFS_NAME ": " fmt, arg1, arg2)          // Print an error message with 2 arguments
 #define error3(fmt, arg1, arg2, arg3)   printk(KERN_ERR ASSOOFS_NAME ": " fmt, arg1, arg2, arg3)    // Print an error message with 3 arguments
 
+#define ASSOOFS_RANGE_CHUNK (ASSOOFS_BLOCK_SIZE / 64)  // The bytes of a file covered by each bit of its range lock
+#define ASSOOFS_TRACE_RECORDS 4096                      // The records kept by the trace ring of each mount (256 KiB)
+#define ASSOOFS_WRITE_BATCH 8                           // The max blocks collected by a batch of writes (the rest are written right away)
+
+
+/**
+ * The in-memory information of a mounted filesystem
+ */
+struct assoofs_sb_info {
+	struct buffer_head *sb_bh;              // The superblock buffer head (pinned while mounted)
+	struct assoofs_super_block *sb_disk;    // The superblock, including the free blocks summary
+	bool in_use;                            // Whether the superblock was marked in use (so it is marked clean on unmount)
+	struct buffer_head *inode_store_bh;     // The inode store buffer head (pinned while mounted)
+	struct assoofs_inode *inode_store;      // The inode store
+	bool blooms;                            // Whether the directory bloom filters (after the inodes) can be trusted
+	bool packed;                            // Whether the image uses the read-only packed layout (see ASSOOFS_FEATURE_INCOMPAT_PACKED)
+	char *packed_meta;                      // The packed metadata, read whole on mount (directories and long symlink targets)
+	struct buffer_head *times_bh;           // The timestamps buffer head (pinned while mounted, if present)
+	struct assoofs_times *times;            // The timestamps of the inodes (see assoofs_write_inode)
+
+	bool writeback;                         // Whether metadata writes are left to the flusher (metadata=writeback mount option)
+	unsigned int readahead;                 // The max number of directory blocks read ahead on mount (readahead= mount option)
+
+	int compress;                           // The compression algorithm for new data (compress= mount option)
+	struct mutex compress_lock;             // Protects the compressors and the cluster buffers
+	struct crypto_comp *tfm[ASSOOFS_COMPRESS_ALGORITHMS];   // The compressors (allocated on first use)
+	char *cluster;                          // The buffer for an uncompressed cluster
+	char *cluster_disk;                     // The buffer for a compressed cluster
+
+	bool dedup;                             // Whether to share identical data blocks (dedup mount option)
+	struct buffer_head *share_table_bh;     // The share table buffer head (pinned while mounted, if present)
+	struct assoofs_share_entry *share_table;    // The share table (reference counts and hashes of data blocks)
+
+	struct super_block *sb;                 // The vfs superblock (for the background work)
+	struct block_device *members[ASSOOFS_MAX_MEMBERS];  // The devices of the volume by position (the first one is the mounted device)
+	unsigned int members_count;             // The devices of a striped volume (0 if it is not striped)
+	fmode_t members_mode;                   // The mode the rest of the members were opened with
+	bool discard;                           // Whether to discard freed blocks (discard mount option)
+	uint64_t discard_pending;               // The freed blocks waiting to be discarded (protected by the superblock lock)
+	struct delayed_work discard_work;       // Discards the freed blocks in batches
+	atomic64_t discard_busy;                // The free blocks being discarded, kept from the allocator until it ends (see assoofs_claim_discard)
+	wait_queue_head_t discard_wait;         // Allocations waiting for a discard to end
+	struct task_struct *batch_owner;        // The task collecting its block writes (see assoofs_start_writes)
+	struct assoofs_write_batch *batch;      // The block writes it collected (only used by that task)
+
+	struct mutex index_lock;                // Protects the directory indexes against writers and reclaim (readers use rcu)
+	struct assoofs_dir_index __rcu *dir_index[ASSOOFS_FILESYSTEM_MAX_OBJECTS];  // The directory indexes by inode number (built on first lookup)
+	unsigned int index_count;               // The number of directory indexes built
+	unsigned int index_max;                 // The max number of directory indexes built (dir_index= mount option)
+	unsigned int index_hand;                // The next directory index to check for reclaim
+	struct shrinker index_shrinker;         // Reclaims the directory indexes under memory pressure
+
+	spinlock_t range_lock;                  // Protects the range locks
+	uint64_t range_locks[ASSOOFS_FILESYSTEM_MAX_OBJECTS];   // The chunks of each file being written in place, by inode number (see ASSOOFS_RANGE_CHUNK)
+	uint64_t range_shared[ASSOOFS_FILESYSTEM_MAX_OBJECTS];  // The chunks of each file being read, by inode number
+	u16 range_readers[ASSOOFS_FILESYSTEM_MAX_OBJECTS][64];  // The readers of each chunk of each file, by inode number
+	wait_queue_head_t range_wait;           // Readers and writers waiting for a chunk to be unlocked
+
+	struct dentry *debugfs;                 // The debugfs directory of the mount (with the trace files)
+	bool trace_on;                          // Whether the operations are being captured (capture debugfs file)
+	spinlock_t trace_lock;                  // Protects the trace ring
+	struct assoofs_trace_record *trace;     // The trace ring (allocated when the first capture starts)
+	uint64_t trace_head;                    // The records captured
+	uint64_t trace_tail;                    // The records read (or overwritten)
+	uint64_t trace_dropped;                 // The records overwritten before being read (dropped debugfs file)
+	u64 trace_start;                        // The time the capture started (in nanoseconds)
+};
+
+/**
+ * The mount options, parsed into the filesystem context and then applied to the mount
+ */
+struct assoofs_mount_opts {
+	bool writeback;                         // Whether metadata writes are left to the flusher
+	unsigned int readahead;                 // The max number of directory blocks read ahead on mount
+	unsigned int dir_index;                 // The max number of directory indexes built
+	int compress;                           // The compression algorithm for new data
+	bool dedup;                             // Whether to share identical data blocks
+	bool discard;                           // Whether to discard freed blocks
+	char *devices[ASSOOFS_MAX_MEMBERS - 1]; // The rest of the members of a striped volume (device= mount option)
+	unsigned int devices_count;             // The number of members given
+};
+
+/**
+ * A batch of block reads in flight
+ */
+struct assoofs_read_batch {
+	atomic_t pending;                       // The bios in flight (plus one while submitting)
+	blk_status_t status;                    // The status of the last failed bio (BLK_STS_OK if none failed)
+	struct completion done;                 // Completed when the last bio ends
+};
+
+/**
+ * A batch of block writes, collected while the locks are held and submitted together
+ */
+struct assoofs_write_batch {
+	struct buffer_head *bhs[ASSOOFS_WRITE_BATCH];   // The blocks to write (referenced until they are written)
+	unsigned int count;                     // The number of blocks collected
+};
+
+/**
+ * An entry of an in-memory directory index
+ */
+struct assoofs_dir_entry {
+	struct rhash_head node;                 // The hash table node
+	struct rcu_head rcu;                    // Frees the entry once the readers are done
+	uint64_t inode_no;                      // The inode number
+	char filename[];                        // The filename (the key)
+};
+
+/**
+ * The in-memory index of a directory (filename to inode number)
+ */
+struct assoofs_dir_index {
+	struct rhashtable table;                // The entries, hashed by filename
+	bool referenced;                        // Whether it was used since the last reclaim pass
+	struct rcu_work free_work;              // Destroys the index once the readers are done (see assoofs_retire_index)
+};
+
 
 /**
  * Function declarations (definitions are in this same order)
@@ -31,40 +167,194 @@
 static int __init assoofs_init(void);
 static void __exit assoofs_exit(void);
 
-static struct dentry *assoofs_mount(struct file_system_type *fs_type, int flags, const char *dev_name, void *data);
-int assoofs_fill_super(struct super_block *sb, void *data, int silent);
+static int assoofs_init_fs_context(struct fs_context *fc);
+static void assoofs_free_fc(struct fs_context *fc);
+static int assoofs_parse_param(struct fs_context *fc, struct fs_parameter *param);
+static int assoofs_get_tree(struct fs_context *fc);
+static int assoofs_reconfigure(struct fs_context *fc);
+int assoofs_fill_super(struct super_block *sb, struct fs_context *fc);
+static void assoofs_apply_options(struct super_block *sb, struct assoofs_mount_opts *opts);
+static int assoofs_readahead_metadata(struct super_block *sb);
+static void assoofs_load_counters(struct super_block *sb);
+static void assoofs_set_clean(struct super_block *sb, bool clean);
+static int assoofs_build_blooms(struct super_block *sb);
+static unsigned long assoofs_index_count(struct shrinker *shrinker, struct shrink_control *sc);
+static unsigned long assoofs_index_scan(struct shrinker *shrinker, struct shrink_control *sc);
+static void assoofs_put_super(struct super_block *sb);
 static void assoofs_kill_block_super(struct super_block *sb);
+static int assoofs_statfs(struct dentry *dentry, struct kstatfs *buf);
 
 int assoofs_delete_inode(struct inode *inode/*, struct dentry * dentry*/);
+static int assoofs_write_inode(struct inode *inode, struct writeback_control *wbc);
+static void assoofs_evict_inode(struct inode *inode);
 
 static int assoofs_create(struct user_namespace *mnt_userns, struct inode *dir, struct dentry *dentry, umode_t mode, bool excl);
+static int assoofs_create_inode(struct inode *dir, struct dentry *dentry, umode_t mode, const char *symname);
 static int assoofs_mkdir(struct user_namespace *mnt_userns, struct inode *dir , struct dentry *dentry, umode_t mode);
+static int assoofs_symlink(struct user_namespace *mnt_userns, struct inode *dir, struct dentry *dentry, const char *symname);
 struct dentry *assoofs_lookup(struct inode *parent_inode, struct dentry *child_dentry, unsigned int flags);
+static int assoofs_rename(struct user_namespace *mnt_userns, struct inode *old_dir, struct dentry *old_dentry, struct inode *new_dir, struct dentry *new_dentry, unsigned int flags);
+static int assoofs_fileattr_get(struct dentry *dentry, struct fileattr *fa);
+static int assoofs_fileattr_set(struct user_namespace *mnt_userns, struct dentry *dentry, struct fileattr *fa);
+static int assoofs_setattr(struct user_namespace *mnt_userns, struct dentry *dentry, struct iattr *attr);
+static const char *assoofs_get_link(struct dentry *dentry, struct inode *inode, struct delayed_call *done);
 
 static int assoofs_iterate(struct file *file, struct dir_context *ctx);
 
-ssize_t assoofs_read(struct file * file, char __user * buf, size_t len, loff_t * pos);
-ssize_t assoofs_write(struct file * file, const char __user * buf, size_t len, loff_t * pos);
+static int assoofs_file_open(struct inode *inode, struct file *file);
+static int assoofs_fsync(struct file *file, loff_t start, loff_t end, int datasync);
+ssize_t assoofs_read_iter(struct kiocb *iocb, struct iov_iter *to);
+ssize_t assoofs_write_iter(struct kiocb *iocb, struct iov_iter *from);
+static ssize_t assoofs_write_range(struct kiocb *iocb, struct iov_iter *from);
+static ssize_t assoofs_write_exclusive(struct kiocb *iocb, struct iov_iter *from);
+static ssize_t assoofs_write_cluster(struct kiocb *iocb, struct iov_iter *from);
+static uint64_t assoofs_range_mask(loff_t pos, size_t len);
+static bool assoofs_try_lock_range(struct assoofs_sb_info *sbi, uint64_t inode_no, uint64_t range, bool shared);
+static void assoofs_lock_range(struct assoofs_sb_info *sbi, uint64_t inode_no, uint64_t range, bool shared);
+static void assoofs_unlock_range(struct assoofs_sb_info *sbi, uint64_t inode_no, uint64_t range, bool shared);
+static ssize_t assoofs_copy_file_range(struct file *file_in, loff_t pos_in, struct file *file_out, loff_t pos_out, size_t len, unsigned int flags);
+static loff_t assoofs_remap_file_range(struct file *file_in, loff_t pos_in, struct file *file_out, loff_t pos_out, loff_t len, unsigned int remap_flags);
+static loff_t assoofs_llseek(struct file *file, loff_t offset, int whence);
+static long assoofs_ioctl(struct file *file, unsigned int cmd, unsigned long arg);
+static int assoofs_trim(struct super_block *sb, struct fstrim_range __user *argp);
+static int assoofs_defrag(struct file *file, struct assoofs_defrag __user *argp);
+static int assoofs_resize(struct super_block *sb, uint64_t __user *argp);
 
 void *read_block(struct super_block *sb, struct buffer_head **bh, uint64_t number);
+static void *assoofs_read_cached_block(struct super_block *sb, struct buffer_head **bh, uint64_t number);
+static int assoofs_read_blocks(struct super_block *sb, const uint64_t *numbers, unsigned int count, struct buffer_head **bhs);
+static int assoofs_cmp_bh(const void *a, const void *b);
+static struct bio *assoofs_alloc_bio(struct super_block *sb, struct assoofs_read_batch *batch, struct buffer_head *bh, unsigned int nr_vecs);
+static void assoofs_end_read(struct bio *bio);
+static uint64_t assoofs_device_blocks(struct super_block *sb);
+void assoofs_sync_super(struct super_block *sb);
+void assoofs_sync_inode_store(struct super_block *sb);
+static void assoofs_sync_metadata(struct super_block *sb, struct buffer_head *bh);
+static void assoofs_start_writes(struct super_block *sb, struct assoofs_write_batch *batch);
+static void assoofs_write_buffer(struct super_block *sb, struct buffer_head *bh);
+static void assoofs_submit_writes(struct super_block *sb);
+static int assoofs_wait_writes(struct assoofs_write_batch *batch);
 int assoofs_save_inode(struct super_block *sb, struct assoofs_inode *assoofs_inode);
 struct assoofs_inode *assoofs_get_inode(struct super_block *sb, uint64_t inode_num);
+static void assoofs_free_inode(struct super_block *sb, uint64_t inode_no);
+static void assoofs_load_times(struct inode *inode);
+static void assoofs_init_link(struct inode *inode);
+static int assoofs_find_record(struct assoofs_dir_record_entry *record, uint64_t count, const char *filename);
+static void assoofs_fill_bloom(struct super_block *sb, uint64_t inode_no, struct assoofs_dir_record_entry *record, uint64_t count);
+static u32 assoofs_dir_hash(const void *data, u32 len, u32 seed);
+static u32 assoofs_dir_obj_hash(const void *data, u32 len, u32 seed);
+static int assoofs_dir_cmp(struct rhashtable_compare_arg *arg, const void *obj);
+static struct assoofs_dir_entry *assoofs_new_dir_entry(const char *filename, uint64_t inode_no);
+static void assoofs_free_dir_entry(void *ptr, void *arg);
+static void assoofs_destroy_index(struct assoofs_dir_index *index);
+static void assoofs_retire_index(struct assoofs_dir_index *index);
+static void assoofs_free_index_work(struct work_struct *work);
+static void assoofs_build_index(struct super_block *sb, struct assoofs_inode *dir, struct assoofs_dir_record_entry *record);
+static uint64_t assoofs_index_lookup(struct super_block *sb, struct assoofs_inode *dir, const char *filename, bool *indexed);
+static void assoofs_update_index(struct super_block *sb, uint64_t dir_no, const char *filename, uint64_t inode_no);
+static struct crypto_comp *assoofs_get_compressor(struct super_block *sb, int algorithm);
+static int assoofs_compress(struct super_block *sb, const char *src, unsigned int len);
+static int assoofs_decompress(struct super_block *sb, const char *block);
+static uint64_t assoofs_find_free_block(struct super_block *sb, uint64_t goal);
+static uint64_t assoofs_alloc_block(struct super_block *sb, uint64_t goal);
+static void assoofs_free_block(struct super_block *sb, uint64_t block);
+static bool assoofs_can_discard(struct super_block *sb);
+static uint64_t assoofs_discard_blocks(struct super_block *sb, uint64_t blocks, uint64_t minlen);
+static void assoofs_discard_work(struct work_struct *work);
+static uint64_t assoofs_claim_discard(struct super_block *sb, uint64_t blocks);
+static void assoofs_release_discard(struct super_block *sb, uint64_t blocks);
+static bool assoofs_wait_discard(struct super_block *sb);
+static struct assoofs_share_entry *assoofs_get_share_table(struct super_block *sb, bool create);
+static struct assoofs_share_entry *assoofs_find_share(struct super_block *sb, uint64_t block);
+static void assoofs_release_block(struct super_block *sb, uint64_t block);
+static int assoofs_share_block(struct super_block *sb, uint64_t block);
+static struct buffer_head *assoofs_cow_block(struct super_block *sb, struct assoofs_inode *inode, struct buffer_head *bh);
+static struct buffer_head *assoofs_alloc_data_block(struct super_block *sb, struct assoofs_inode *inode);
+static struct buffer_head *assoofs_store_block(struct super_block *sb, struct assoofs_inode *inode, struct buffer_head *bh, unsigned int size);
+static void assoofs_trace_init(struct super_block *sb);
+static void assoofs_trace_exit(struct super_block *sb);
+static void assoofs_trace(struct super_block *sb, uint32_t op, uint64_t inode_no, uint64_t arg, uint64_t len, const char *name);
+static ssize_t assoofs_trace_read(struct file *file, char __user *buf, size_t len, loff_t *ppos);
+static ssize_t assoofs_capture_read(struct file *file, char __user *buf, size_t len, loff_t *ppos);
+static ssize_t assoofs_capture_write(struct file *file, const char __user *buf, size_t len, loff_t *ppos);
+static int assoofs_load_packed(struct super_block *sb);
+static bool assoofs_check_packed(struct super_block *sb);
+static struct inode *assoofs_packed_iget(struct super_block *sb, struct inode *dir, uint64_t inode_no);
+static struct dentry *assoofs_packed_lookup(struct inode *dir, struct dentry *dentry, unsigned int flags);
+static int assoofs_packed_iterate(struct file *file, struct dir_context *ctx);
+static ssize_t assoofs_packed_read_iter(struct kiocb *iocb, struct iov_iter *to);
+static ssize_t assoofs_packed_splice_read(struct file *in, loff_t *ppos, struct pipe_inode_info *pipe, size_t len, unsigned int flags);
+static int assoofs_open_members(struct super_block *sb, struct assoofs_mount_opts *opts);
+static void assoofs_close_members(struct super_block *sb);
+static int assoofs_sync_members(struct super_block *sb, bool wait);
+static int assoofs_sync_fs(struct super_block *sb, int wait);
+static struct block_device *assoofs_map_block(struct super_block *sb, uint64_t *block);
+static struct buffer_head *assoofs_getblk(struct super_block *sb, uint64_t block);
+static int assoofs_issue_discard(struct super_block *sb, uint64_t first, uint64_t count);
 
 
 /**
  * Some static structures
  */
+// Mount options (the generic ones, like ro, sync or lazytime, are handled by the vfs)
+enum {
+	ASSOOFS_OPT_METADATA,
+	ASSOOFS_OPT_READAHEAD,
+	ASSOOFS_OPT_DIR_INDEX,
+	ASSOOFS_OPT_COMPRESS,
+	ASSOOFS_OPT_DEDUP,
+	ASSOOFS_OPT_DISCARD,
+	ASSOOFS_OPT_DEVICE,
+};
+
+enum {
+	ASSOOFS_METADATA_SYNC,
+	ASSOOFS_METADATA_WRITEBACK,
+};
+
+static const struct constant_table assoofs_metadata_modes[] = {
+	{"sync", ASSOOFS_METADATA_SYNC},
+	{"writeback", ASSOOFS_METADATA_WRITEBACK},
+	{}
+};
+
+static const struct fs_parameter_spec assoofs_fs_parameters[] = {
+	fsparam_enum("metadata", ASSOOFS_OPT_METADATA, assoofs_metadata_modes),
+	fsparam_u32("readahead", ASSOOFS_OPT_READAHEAD),
+	fsparam_u32("dir_index", ASSOOFS_OPT_DIR_INDEX),
+	fsparam_string("compress", ASSOOFS_OPT_COMPRESS),
+	fsparam_flag_no("dedup", ASSOOFS_OPT_DEDUP),
+	fsparam_flag_no("discard", ASSOOFS_OPT_DISCARD),
+	fsparam_string("device", ASSOOFS_OPT_DEVICE),
+	{}
+};
+
 // Some filesystem metadata
 static struct file_system_type assoofs_type = {
 	.owner = THIS_MODULE,
 	.name = ASSOOFS_NAME,
-	.mount = assoofs_mount,
+	.init_fs_context = assoofs_init_fs_context,
+	.parameters = assoofs_fs_parameters,
 	.kill_sb = assoofs_kill_block_super,
+	.fs_flags = FS_REQUIRES_DEV,
+};
+
+// Operations on the filesystem context (mounting and remounting)
+static const struct fs_context_operations assoofs_context_ops = {
+	.free = assoofs_free_fc,
+	.parse_param = assoofs_parse_param,
+	.get_tree = assoofs_get_tree,
+	.reconfigure = assoofs_reconfigure,
 };
 
 // Operations supported on the superblock
 static struct super_operations assoofs_sb_ops = {
+	.put_super = assoofs_put_super,
+	.sync_fs = assoofs_sync_fs,
+	.statfs = assoofs_statfs,
 	.drop_inode = assoofs_delete_inode,
+	.write_inode = assoofs_write_inode,
+	.evict_inode = assoofs_evict_inode,
 };
 
 // Operations supported on inodes
@@ -72,25 +362,118 @@ static struct inode_operations assoofs_inode_ops = {
 	.create = assoofs_create,
 	.mkdir = assoofs_mkdir,
 	.lookup = assoofs_lookup,
+	.rename = assoofs_rename,
+	.fileattr_get = assoofs_fileattr_get,
+	.fileattr_set = assoofs_fileattr_set,
+	.setattr = assoofs_setattr,
+	.symlink = assoofs_symlink,
 	//.rmdir = assoofs_delete_inode,
 };
 
+// Operations supported on short symlinks (with the target in the inode store, so they are resolved without any read)
+static struct inode_operations assoofs_fast_symlink_ops = {
+	.get_link = simple_get_link,
+	.setattr = assoofs_setattr,
+};
+
+// Operations supported on long symlinks (with the target in a data block)
+static struct inode_operations assoofs_symlink_ops = {
+	.get_link = assoofs_get_link,
+	.setattr = assoofs_setattr,
+};
+
 // Operations supported on directories
 static struct file_operations assoofs_dir_ops = {
 	.owner = THIS_MODULE,
 	.iterate = assoofs_iterate,
+	.fsync = assoofs_fsync,
+	.unlocked_ioctl = assoofs_ioctl,
+	.compat_ioctl = compat_ptr_ioctl,
 };
 
 // Operations supported on regular files
 static struct file_operations assoofs_file_ops = {
-	.read = assoofs_read,
-	.write = assoofs_write,
+	.open = assoofs_file_open,
+	.llseek = assoofs_llseek,
+	.read_iter = assoofs_read_iter,
+	.write_iter = assoofs_write_iter,
+	.splice_read = generic_file_splice_read,
+	.splice_write = iter_file_splice_write,
+	.copy_file_range = assoofs_copy_file_range,
+	.remap_file_range = assoofs_remap_file_range,
+	.fsync = assoofs_fsync,
+	.unlocked_ioctl = assoofs_ioctl,
+	.compat_ioctl = compat_ptr_ioctl,
+};
+
+// Operations supported on the directories of packed images (which never change, so they dont take any lock)
+static struct inode_operations assoofs_packed_dir_iops = {
+	.lookup = assoofs_packed_lookup,
+};
+
+static struct file_operations assoofs_packed_dir_ops = {
+	.owner = THIS_MODULE,
+	.iterate_shared = assoofs_packed_iterate,
+	.llseek = generic_file_llseek,
+	.read = generic_read_dir,
+};
+
+// Operations supported on the regular files of packed images
+static struct file_operations assoofs_packed_file_ops = {
+	.open = assoofs_file_open,
+	.llseek = generic_file_llseek,
+	.read_iter = assoofs_packed_read_iter,
+	.splice_read = assoofs_packed_splice_read,
+};
+
+// Operations on the blocks of packed images spliced to pipes (referencing the buffer cache pages)
+static const struct pipe_buf_operations assoofs_pipe_buf_ops = {
+	.release = generic_pipe_buf_release,
+	.get = generic_pipe_buf_get,
+};
+
+// Directory index hash table parameters (keyed by the filename string)
+static const struct rhashtable_params assoofs_dir_params = {
+	.head_offset = offsetof(struct assoofs_dir_entry, node),
+	.hashfn = assoofs_dir_hash,
+	.obj_hashfn = assoofs_dir_obj_hash,
+	.obj_cmpfn = assoofs_dir_cmp,
+	.automatic_shrinking = true,
+};
+
+// Operations on the trace ring of a mount in debugfs (reading consumes whole records)
+static const struct file_operations assoofs_trace_fops = {
+	.owner = THIS_MODULE,
+	.open = simple_open,
+	.read = assoofs_trace_read,
+	.llseek = no_llseek,
+};
+
+// Operations on the capture switch of a mount in debugfs (1 starts a new capture, 0 stops it)
+static const struct file_operations assoofs_capture_fops = {
+	.owner = THIS_MODULE,
+	.open = simple_open,
+	.read = assoofs_capture_read,
+	.write = assoofs_capture_write,
+	.llseek = default_llseek,
+};
+
+// Compression algorithm names (as used by the mount option and the crypto api)
+static const char *assoofs_compress_names[ASSOOFS_COMPRESS_ALGORITHMS] = {
+	[ASSOOFS_COMPRESS_NONE] = "none",
+	[ASSOOFS_COMPRESS_LZ4] = "lz4",
+	[ASSOOFS_COMPRESS_ZSTD] = "zstd",
 };
 
 // Superblock mutex
 static DEFINE_MUTEX(assoofs_super_lock);
 // Inode store mutex
 static DEFINE_MUTEX(assoofs_inode_lock);
+// Debugfs directory (with one directory per mount)
+static struct dentry *assoofs_debugfs;
+
+// Destroys the directory indexes dropped while mounted, after a grace period (drained on unload)
+static struct workqueue_struct *assoofs_index_wq;
 
 
 
@@ -103,14 +486,26 @@ static int __init assoofs_init(void) {
 	
 	info("Registering filesystem\n");
 	
+	assoofs_index_wq = alloc_workqueue(ASSOOFS_NAME, 0, 0);
+	if (!assoofs_index_wq) return -ENOMEM;
+
+	// the trace files of each mount go below it (the filesystem works without them)
+	assoofs_debugfs = debugfs_create_dir(ASSOOFS_NAME, NULL);
+
 	// use the libfs function
 	code = register_filesystem(&assoofs_type);
 
 	// print the correct message
-	if (code)
+	if (code) {
+
 		error1("Error during filesystem register. Code=%d\n", code);
-	else
+		debugfs_remove_recursive(assoofs_debugfs);
+		destroy_workqueue(assoofs_index_wq);
+
+	} else {
+
 		info("Filesystem successfully registered\n");
+	}
 
 	// return the code
 	return code;
@@ -133,47 +528,261 @@ static void __exit assoofs_exit(void) {
 		error1("Error during filesystem unregister. Code=%d\n", code);
 	else
 		info("Successfully unregistered\n");
+
+	debugfs_remove_recursive(assoofs_debugfs);
+
+	// wait for the grace periods of the dropped indexes, and then for their destruction
+	rcu_barrier();
+	destroy_workqueue(assoofs_index_wq);
+}
+
+
+/**
+ * Set up the context of a mount (or a remount, starting from the current options)
+ */
+static int assoofs_init_fs_context(struct fs_context *fc) {
+
+	struct assoofs_mount_opts *opts;
+	struct assoofs_sb_info *sbi;
+
+	opts = kzalloc(sizeof(struct assoofs_mount_opts), GFP_KERNEL);
+	if (!opts) return -ENOMEM;
+
+	if (fc->purpose == FS_CONTEXT_FOR_RECONFIGURE) {
+
+		sbi = fc->root->d_sb->s_fs_info;
+
+		opts->writeback = sbi->writeback;
+		opts->readahead = sbi->readahead;
+		opts->dir_index = sbi->index_max;
+		opts->compress = sbi->compress;
+		opts->dedup = sbi->dedup;
+		opts->discard = sbi->discard;
+
+	} else {
+
+		// every directory block is read ahead and can be indexed by default
+		opts->readahead = ASSOOFS_FILESYSTEM_MAX_OBJECTS;
+		opts->dir_index = ASSOOFS_FILESYSTEM_MAX_OBJECTS;
+	}
+
+	fc->fs_private = opts;
+	fc->ops = &assoofs_context_ops;
+
+	return 0;
+}
+
+/**
+ * Release the context of a mount
+ */
+static void assoofs_free_fc(struct fs_context *fc) {
+
+	struct assoofs_mount_opts *opts = fc->fs_private;
+	unsigned int i;
+
+	if (!opts) return;
+
+	for (i = 0; i < opts->devices_count; i++)
+		kfree(opts->devices[i]);
+
+	kfree(opts);
 }
 
+/**
+ * Parse a mount option
+ */
+static int assoofs_parse_param(struct fs_context *fc, struct fs_parameter *param) {
+
+	struct assoofs_mount_opts *opts = fc->fs_private;
+	struct fs_parse_result result;
+	int option;
+	int i;
+
+	option = fs_parse(fc, assoofs_fs_parameters, param, &result);
+	if (option < 0) return option;
+
+	switch (option) {
+
+		case ASSOOFS_OPT_METADATA:
+
+			opts->writeback = result.uint_32 == ASSOOFS_METADATA_WRITEBACK;
+			break;
+
+		case ASSOOFS_OPT_READAHEAD:
+
+			opts->readahead = result.uint_32;
+			break;
+
+		case ASSOOFS_OPT_DIR_INDEX:
+
+			opts->dir_index = result.uint_32;
+			break;
+
+		case ASSOOFS_OPT_COMPRESS:
+
+			// find the requested algorithm
+			for (i = 0; i < ASSOOFS_COMPRESS_ALGORITHMS; i++)
+				if (!strcmp(param->string, assoofs_compress_names[i]))
+					break;
+
+			if (i >= ASSOOFS_COMPRESS_ALGORITHMS) {
+
+				error1("Unknown compression algorithm '%s'\n", param->string);
+				return -EINVAL;
+			}
+
+			opts->compress = i;
+			break;
+
+		case ASSOOFS_OPT_DEDUP:
+
+			opts->dedup = !result.negated;
+			break;
+
+		case ASSOOFS_OPT_DISCARD:
+
+			opts->discard = !result.negated;
+			break;
+
+		case ASSOOFS_OPT_DEVICE:
+
+			if (opts->devices_count >= ASSOOFS_MAX_MEMBERS - 1) {
+
+				error1("Too many devices (the max is %d)\n", ASSOOFS_MAX_MEMBERS);
+				return -EINVAL;
+			}
+
+			// keep the string (the context frees it)
+			opts->devices[opts->devices_count++] = param->string;
+			param->string = NULL;
+			break;
+	}
+
+	return 0;
+}
 
 /**
  * Mount an assoofs device
  */
-static struct dentry *assoofs_mount(struct file_system_type *fs_type, int flags, const char *dev_name, void *data) {
+static int assoofs_get_tree(struct fs_context *fc) {
 
-	struct dentry *entry;
+	int code;
 
 	info("Mounting filesystem\n");
 
 	// mount the device using assoofs_fill_super() to populate the superblock
-	entry = mount_bdev(fs_type, flags, dev_name, data, assoofs_fill_super);
+	code = get_tree_bdev(fc, assoofs_fill_super);
 
-	if (IS_ERR(entry))
+	if (code)
 		error("Error during mounting\n");
 	else
-		info1("Successfully mounted on '%s'\n", dev_name);
+		info1("Successfully mounted on '%s'\n", fc->source);
 
-	// return the directory entry
-	return entry;
+	return code;
+}
+
+/**
+ * Change the options of a mounted filesystem (and switch it between read-only and read-write)
+ */
+static int assoofs_reconfigure(struct fs_context *fc) {
+
+	struct super_block *sb = fc->root->d_sb;
+	struct assoofs_sb_info *sbi = sb->s_fs_info;
+	bool remount_ro = (fc->sb_flags & SB_RDONLY) && !sb_rdonly(sb);
+	bool remount_rw = !(fc->sb_flags & SB_RDONLY) && sb_rdonly(sb);
+
+	info("Reconfiguring filesystem\n");
+
+	if (((struct assoofs_mount_opts *) fc->fs_private)->devices_count) {
+
+		error("The devices of a volume cant be changed on remount\n");
+		return -EINVAL;
+	}
+
+	// the rest of the members of a striped volume were opened read-only
+	if (remount_rw && sbi->members_count && !(sbi->members_mode & FMODE_WRITE)) {
+
+		error("Striped volumes mounted read-only cant be remounted read-write\n");
+		return -EROFS;
+	}
+
+	if (remount_rw && sbi->packed) {
+
+		error("Packed images are read-only. Refusing to remount read-write\n");
+		return -EROFS;
+	}
+
+	// only the features this version understands can be written
+	if (remount_rw && assoofs_check_features(sbi->sb_disk)) {
+
+		error("Unsupported ro_compat features. Refusing to remount read-write\n");
+		return -EROFS;
+	}
+
+	// write the metadata left to the flusher before changing how it is written
+	sync_filesystem(sb);
+	assoofs_apply_options(sb, fc->fs_private);
+
+	if (remount_ro) {
+
+		// nothing changes the counters until the next remount, so they are valid again
+		flush_delayed_work(&sbi->discard_work);
+		assoofs_set_clean(sb, true);
+	}
+
+	if (remount_rw) {
+
+		// the bloom filters were only kept in memory
+		if (!assoofs_has_blooms(sbi->sb_disk)) {
+
+			assoofs_sync_inode_store(sb);
+			assoofs_set_blooms(sbi->sb_disk);
+			assoofs_sync_super(sb);
+		}
+
+		assoofs_set_clean(sb, false);
+	}
+
+	return 0;
 }
 
 /**
  * Populate the superblock for device mount
  */
-int assoofs_fill_super(struct super_block *sb, void *data, int silent) {
+int assoofs_fill_super(struct super_block *sb, struct fs_context *fc) {
 
-	struct buffer_head *bh;
+	struct assoofs_sb_info *sbi;
 	struct assoofs_super_block *sb_disk;
 	struct inode *root_inode;
 	struct dentry *root_dentry;
 
 	info("Reading superblock\n");
 
-	// get the superblock from disk
-	sb_disk = (struct assoofs_super_block *) read_block(sb, &bh, ASSOOFS_SUPERBLOCK_BLOCK_NUMBER);
+	// create the per-mount information
+	sbi = kzalloc(sizeof(struct assoofs_sb_info), GFP_KERNEL);
+	if (!sbi) return -ENOMEM;
+
+	// get the superblock from disk, keeping it pinned until unmount
+	sb_disk = (struct assoofs_super_block *) read_block(sb, &sbi->sb_bh, ASSOOFS_SUPERBLOCK_BLOCK_NUMBER);
 	
 	// return -1 if the block hasn't been read
-	if (!sb_disk) return -1;
+	if (!sb_disk) {
+
+		kfree(sbi);
+		return -1;
+	}
+
+	sbi->sb_disk = sb_disk;
+	sbi->sb = sb;
+	sbi->members[0] = sb->s_bdev;
+	mutex_init(&sbi->compress_lock);
+	mutex_init(&sbi->index_lock);
+	spin_lock_init(&sbi->range_lock);
+	init_waitqueue_head(&sbi->range_wait);
+	spin_lock_init(&sbi->trace_lock);
+	INIT_DELAYED_WORK(&sbi->discard_work, assoofs_discard_work);
+	init_waitqueue_head(&sbi->discard_wait);
+	sb->s_fs_info = sbi;
 
 	// print superblock info
 	info3("Superblock read: magic=%llu, version=%llu, block_size=%llu\n", sb_disk->magic, sb_disk->version, sb_disk->block_size);
@@ -182,27 +791,98 @@ int assoofs_fill_super(struct super_block *sb, void *data, int silent) {
 	if (sb_disk->magic != ASSOOFS_MAGIC) {
 
 		error1("Magic number mismatch (expected '%d'). Refusing to mount\n", ASSOOFS_MAGIC);
-		brelse(bh);
+		assoofs_put_super(sb);
 		return -2;
 	}
-	if (sb_disk->version != ASSOOFS_VERSION) {
+	if (sb_disk->version != ASSOOFS_VERSION && sb_disk->version != ASSOOFS_VERSION_1) {
 
 		error1("Version mismatch (expected '%d'). Refusing to mount\n", ASSOOFS_VERSION);
-		brelse(bh);
+		assoofs_put_super(sb);
+		return -3;
+	}
+	if (assoofs_check_features(sb_disk) < 0) {
+
+		error1("Unsupported incompat features (%llx). Refusing to mount\n", sb_disk->feature_incompat & ~(uint64_t) ASSOOFS_FEATURE_INCOMPAT_SUPP);
+		assoofs_put_super(sb);
+		return -3;
+	}
+	if (assoofs_check_features(sb_disk) > 0 && !sb_rdonly(sb)) {
+
+		error1("Unsupported ro_compat features (%llx). Refusing to mount read-write\n", sb_disk->feature_ro_compat & ~(uint64_t) ASSOOFS_FEATURE_RO_COMPAT_SUPP);
+		assoofs_put_super(sb);
+		return -3;
+	}
+	if (sb_disk->version == ASSOOFS_VERSION_1)
+		info("Mounting a version 1 filesystem (tune.assoofs upgrades it to the current layout)\n");
+
+	// packed images are never written, so their lookups and reads dont need any lock
+	sbi->packed = sb_disk->version != ASSOOFS_VERSION_1 && (sb_disk->feature_incompat & ASSOOFS_FEATURE_INCOMPAT_PACKED);
+
+	if (sbi->packed && !sb_rdonly(sb)) {
+
+		error("Packed images are read-only. Refusing to mount read-write\n");
+		assoofs_put_super(sb);
 		return -3;
 	}
 	if (sb_disk->block_size != ASSOOFS_BLOCK_SIZE) {
 
 		error1("Block size mismatch (expected '%d'). Refusing to mount\n", ASSOOFS_BLOCK_SIZE);
-		brelse(bh);
+		assoofs_put_super(sb);
+		return -4;
+	}
+
+	// open the rest of the members of a striped volume
+	if (assoofs_open_members(sb, fc->fs_private)) {
+
+		assoofs_put_super(sb);
+		return -4;
+	}
+
+	// apply the mount options (once every member is open, as they all must support discard)
+	assoofs_apply_options(sb, fc->fs_private);
+
+	if (assoofs_blocks_count(sb_disk) > assoofs_device_blocks(sb)) {
+
+		error1("The device is smaller than the volume (%llu blocks). Refusing to mount\n", assoofs_blocks_count(sb_disk));
+		assoofs_put_super(sb);
 		return -4;
 	}
 
+	// read the core metadata ahead and keep the inode store pinned
+	if (assoofs_readahead_metadata(sb)) {
+
+		error("Error reading the inode store. Aborting mount\n");
+		assoofs_put_super(sb);
+		return -5;
+	}
+
+	// get the free space summary (only counting it again after an unclean unmount)
+	assoofs_load_counters(sb);
+
+	// get the directory bloom filters ready (rebuilding them on images created before them), or the packed directories
+	if (sbi->packed ? assoofs_load_packed(sb) : assoofs_build_blooms(sb)) {
+
+		error("Error reading the directories. Aborting mount\n");
+		assoofs_put_super(sb);
+		return -5;
+	}
+
+	// let the directory indexes be reclaimed under memory pressure
+	sbi->index_shrinker.count_objects = assoofs_index_count;
+	sbi->index_shrinker.scan_objects = assoofs_index_scan;
+	sbi->index_shrinker.seeks = DEFAULT_SEEKS;
+
+	if (register_shrinker(&sbi->index_shrinker)) {
+
+		error("Error registering the directory index shrinker. Aborting mount\n");
+		assoofs_put_super(sb);
+		return -5;
+	}
+
 	// store the data on memory
 	sb->s_magic = ASSOOFS_MAGIC;
-	sb->s_maxbytes = ASSOOFS_BLOCK_SIZE;
+	sb->s_maxbytes = ASSOOFS_CLUSTER_SIZE;
 
-	sb->s_fs_info = sb_disk;
 	sb->s_op = &assoofs_sb_ops;
 
 	// create the root inode
@@ -210,7 +890,7 @@ int assoofs_fill_super(struct super_block *sb, void *data, int silent) {
 	if (!root_inode) {
 
 		error("Error creating inode. Aborting mount\n");
-		brelse(bh);
+		assoofs_put_super(sb);
 		return -5;
 	}
 	
@@ -223,72 +903,414 @@ int assoofs_fill_super(struct super_block *sb, void *data, int silent) {
 
 	root_inode->i_private = assoofs_get_inode(sb, ASSOOFS_ROOTDIR_INODE_NUMBER);
 
-	root_inode->i_atime = ((struct assoofs_inode *)root_inode->i_private)->time;
-	root_inode->i_mtime = ((struct assoofs_inode *)root_inode->i_private)->time;
-	root_inode->i_ctime = ((struct assoofs_inode *)root_inode->i_private)->time;
+	if (sbi->packed) {
+
+		root_inode->i_op = &assoofs_packed_dir_iops;
+		root_inode->i_fop = &assoofs_packed_dir_ops;
+	}
+
+	assoofs_load_times(root_inode);
+
+	// hashed inodes are found by the writeback of their lazy timestamps
+	insert_inode_hash(root_inode);
 
 	// add the root inode to the superblock, checking it
 	root_dentry = d_make_root(root_inode);
 	if (!root_dentry) {
 
 		error("Error creating root directory");
-		brelse(bh);
+		assoofs_put_super(sb);
 		return -5;
 	}
 
 	sb->s_root = root_dentry;
 
-	// release resources and return normally
-	brelse(bh);
+	// let the operations be captured
+	assoofs_trace_init(sb);
+
+	// return normally (the core metadata is released on unmount)
 	return 0;
 }
 
 /**
- * A wrapper for the device unmount
+ * Apply the mount options to a mounted filesystem
  */
-static void assoofs_kill_block_super(struct super_block *sb) {
-	
-	info("Destroying superblock\n");
+static void assoofs_apply_options(struct super_block *sb, struct assoofs_mount_opts *opts) {
 
-	// use the libfs function
-	kill_block_super(sb);
+	struct assoofs_sb_info *sbi = sb->s_fs_info;
 
-	info("Superblock destroyed. Filesystem unmounted\n");
-}
+	sbi->writeback = opts->writeback;
+	sbi->readahead = opts->readahead;
+	WRITE_ONCE(sbi->index_max, opts->dir_index);
+	sbi->compress = opts->compress;
+	sbi->dedup = opts->dedup;
+	sbi->discard = opts->discard;
+
+	if (sbi->writeback)
+		info("Leaving the metadata writes to the flusher\n");
+
+	if (sbi->compress)
+		info1("Compressing new data with %s\n", assoofs_compress_names[sbi->compress]);
+
+	if (sbi->dedup)
+		info("Deduplicating new data\n");
+
+	// devices without discard support just ignore the option
+	if (sbi->discard && !assoofs_can_discard(sb)) {
+
+		info("The device does not support discard, ignoring the option\n");
+		sbi->discard = false;
+
+	} else if (sbi->discard) {
 
+		info("Discarding freed blocks\n");
+	}
+}
 
 /**
- * A wrapper for inode deletion
+ * Read the core metadata ahead in a single batch, pinning the inode store
  */
-// TODO: implement something that DOES WORK
-int assoofs_delete_inode(struct inode *inode/*, struct dentry * dentry*/) {/*
-
-	// get the superblock (linux, assoofs and disk)
-	struct super_block *sb = inode->i_sb;
-	struct assoofs_super_block *assoofs_sb = (struct assoofs_super_block *) sb->s_fs_info;
-	struct assoofs_super_block *disk_sb;
+static int assoofs_readahead_metadata(struct super_block *sb) {
 
-	// declare the variables
-	struct buffer_head *bh;
-	struct assoofs_inode *assoofs_inode = inode->i_private;
+	struct assoofs_sb_info *sbi = sb->s_fs_info;
 	struct assoofs_inode *inode_iterator;
-
+	struct blk_plug plug;
+	uint64_t numbers[4] = { ASSOOFS_INODESTORE_BLOCK_NUMBER, ASSOOFS_ROOTDIR_BLOCK_NUMBER };
+	struct buffer_head *bhs[4];
+	struct block_device *bdev;
+	unsigned int count = 2;
+	uint64_t block;
 	uint64_t i;
-	uint64_t one = 1;
 
-	info1("Deleting inode %llu\n", assoofs_inode->inode_no);
+	info("Reading core metadata ahead\n");
 
-	// update the mask to the correct free block
-	one <<= assoofs_inode->data_block_number;
+	// read the inode store, the root directory, the share table and the timestamps (if present) together
+	if (sbi->sb_disk->share_table_block)
+		numbers[count++] = sbi->sb_disk->share_table_block;
+	if (assoofs_has_times(sbi->sb_disk))
+		numbers[count++] = sbi->sb_disk->times_block;
 
-	//if (mutex_lock_interruptible(&assoofs_sb_lock)) {
-	//	sfs_trace("Failed to acquire mutex lock\n");
-	//	return -EINTR;
-	//}
+	if (assoofs_read_blocks(sb, numbers, count, bhs)) return -1;
 
+	// keep the inode store pinned until unmount
+	sbi->inode_store_bh = bhs[0];
+	sbi->inode_store = (struct assoofs_inode *) bhs[0]->b_data;
 
-	// get the inode store
-	inode_iterator = (struct assoofs_inode *) read_block(sb, &bh, ASSOOFS_INODESTORE_BLOCK_NUMBER);
+	// the root directory stays cached for the first lookups
+	brelse(bhs[1]);
+
+	// keep the share table and the timestamps pinned until unmount
+	count = 2;
+
+	if (sbi->sb_disk->share_table_block) {
+
+		sbi->share_table_bh = bhs[count++];
+		sbi->share_table = (struct assoofs_share_entry *) sbi->share_table_bh->b_data;
+	}
+	if (assoofs_has_times(sbi->sb_disk)) {
+
+		sbi->times_bh = bhs[count++];
+		sbi->times = (struct assoofs_times *) sbi->times_bh->b_data;
+	}
+
+	// packed images read their directories whole (see assoofs_load_packed)
+	if (sbi->packed)
+		return 0;
+
+	// queue the blocks of the rest of the directories (as many as the readahead option allows), so the first lookups find them cached
+	inode_iterator = sbi->inode_store;
+	count = 0;
+
+	blk_start_plug(&plug);
+	for (i = 0; i < sbi->sb_disk->inodes_count && count < sbi->readahead; i++, inode_iterator++) {
+
+		if (S_ISDIR(inode_iterator->mode) && inode_iterator->inode_no != ASSOOFS_ROOTDIR_INODE_NUMBER) {
+
+			block = inode_iterator->data_block_number;
+			bdev = assoofs_map_block(sb, &block);
+			__breadahead(bdev, block, sb->s_blocksize);
+			count++;
+		}
+	}
+	blk_finish_plug(&plug);
+
+	return 0;
+}
+
+/**
+ * Load the summary counters of the superblock, counting them again if the filesystem was not cleanly unmounted
+ */
+static void assoofs_load_counters(struct super_block *sb) {
+
+	struct assoofs_sb_info *sbi = sb->s_fs_info;
+	struct assoofs_super_block *sb_disk = sbi->sb_disk;
+	uint64_t i;
+
+	if (sb_disk->state != ASSOOFS_STATE_CLEAN) {
+
+		info("The filesystem was not cleanly unmounted, counting the free space\n");
+
+		sb_disk->free_blocks_count = hweight64(sb_disk->free_blocks);
+		sb_disk->free_inodes_count = ASSOOFS_FILESYSTEM_MAX_OBJECTS - sb_disk->inodes_count;
+
+		// the freed slots before the last inode are free too
+		for (i = 0; i < sb_disk->inodes_count; i++)
+			if (!sbi->inode_store[i].inode_no)
+				sb_disk->free_inodes_count++;
+	}
+
+	// read-only mounts dont change them, so they are still valid after a crash (until the unmount marks them valid again)
+	if (!sb_rdonly(sb))
+		assoofs_set_clean(sb, false);
+}
+
+/**
+ * Mark the summary counters of the superblock as valid (on unmount) or in use, writing it right away
+ */
+static void assoofs_set_clean(struct super_block *sb, bool clean) {
+
+	struct assoofs_sb_info *sbi = sb->s_fs_info;
+
+	sbi->sb_disk->state = clean ? ASSOOFS_STATE_CLEAN : 0;
+	sbi->in_use = !clean;
+
+	mark_buffer_dirty(sbi->sb_bh);
+	sync_dirty_buffer(sbi->sb_bh);
+}
+
+/**
+ * Rebuild the bloom filters of all the directories if they are not up to date
+ */
+static int assoofs_build_blooms(struct super_block *sb) {
+
+	struct assoofs_sb_info *sbi = sb->s_fs_info;
+	struct assoofs_inode *inode_iterator;
+	uint64_t numbers[ASSOOFS_FILESYSTEM_MAX_OBJECTS];
+	struct buffer_head *bhs[ASSOOFS_FILESYSTEM_MAX_OBJECTS];
+	unsigned int count = 0;
+	uint64_t i;
+
+	if (assoofs_has_blooms(sbi->sb_disk)) {
+
+		sbi->blooms = true;
+		return 0;
+	}
+
+	info("Building the directory bloom filters\n");
+
+	// read all the directories together
+	inode_iterator = sbi->inode_store;
+
+	for (i = 0; i < sbi->sb_disk->inodes_count; i++, inode_iterator++)
+		if (S_ISDIR(inode_iterator->mode))
+			numbers[count++] = inode_iterator->data_block_number;
+
+	if (assoofs_read_blocks(sb, numbers, count, bhs)) return -1;
+
+	// and fill their filters in the same order
+	inode_iterator = sbi->inode_store;
+	count = 0;
+
+	for (i = 0; i < sbi->sb_disk->inodes_count; i++, inode_iterator++) {
+
+		if (!S_ISDIR(inode_iterator->mode))
+			continue;
+
+		assoofs_fill_bloom(sb, inode_iterator->inode_no, (struct assoofs_dir_record_entry *) bhs[count]->b_data, inode_iterator->dir_children_count);
+		brelse(bhs[count++]);
+	}
+
+	sbi->blooms = true;
+
+	// read-only mounts only use them in memory, so they are built again on the next mount
+	if (!sb_rdonly(sb)) {
+
+		assoofs_sync_inode_store(sb);
+
+		assoofs_set_blooms(sbi->sb_disk);
+		assoofs_sync_super(sb);
+	}
+
+	return 0;
+}
+
+/**
+ * Count the directory indexes that can be reclaimed
+ */
+static unsigned long assoofs_index_count(struct shrinker *shrinker, struct shrink_control *sc) {
+
+	struct assoofs_sb_info *sbi = container_of(shrinker, struct assoofs_sb_info, index_shrinker);
+
+	return READ_ONCE(sbi->index_count);
+}
+
+/**
+ * Reclaim directory indexes, giving the ones used since the last pass a second chance
+ */
+static unsigned long assoofs_index_scan(struct shrinker *shrinker, struct shrink_control *sc) {
+
+	struct assoofs_sb_info *sbi = container_of(shrinker, struct assoofs_sb_info, index_shrinker);
+	struct assoofs_dir_index *victims[ASSOOFS_FILESYSTEM_MAX_OBJECTS];
+	struct assoofs_dir_index *index;
+	unsigned long freed = 0;
+	unsigned int slot;
+	unsigned int i;
+
+	// never wait for the writers from reclaim
+	if (!mutex_trylock(&sbi->index_lock))
+		return SHRINK_STOP;
+
+	// sweep the slots like a clock, two rounds at most
+	for (i = 0; i < 2 * ASSOOFS_FILESYSTEM_MAX_OBJECTS && freed < sc->nr_to_scan && sbi->index_count; i++) {
+
+		slot = sbi->index_hand;
+		sbi->index_hand = (slot + 1) % ASSOOFS_FILESYSTEM_MAX_OBJECTS;
+
+		index = rcu_dereference_protected(sbi->dir_index[slot], lockdep_is_held(&sbi->index_lock));
+		if (!index) continue;
+
+		if (index->referenced) {
+
+			index->referenced = false;
+			continue;
+		}
+
+		RCU_INIT_POINTER(sbi->dir_index[slot], NULL);
+		sbi->index_count--;
+		victims[freed++] = index;
+	}
+
+	mutex_unlock(&sbi->index_lock);
+
+	if (!freed) return SHRINK_STOP;
+
+	// the lockless readers can still be using them, so they are destroyed after a grace period (reclaim never waits for it)
+	for (i = 0; i < freed; i++)
+		assoofs_retire_index(victims[i]);
+
+	info1("Reclaimed %lu directory indexes\n", freed);
+	return freed;
+}
+
+/**
+ * Release the core metadata of the filesystem
+ */
+static void assoofs_put_super(struct super_block *sb) {
+
+	struct assoofs_sb_info *sbi = sb->s_fs_info;
+	int i;
+
+	info("Releasing core metadata\n");
+
+	// remove the trace files before releasing the ring they read
+	assoofs_trace_exit(sb);
+
+	// issue the pending discards before releasing the superblock
+	flush_delayed_work(&sbi->discard_work);
+
+	// brelse() ignores NULL buffer heads (the timestamps of the evicted inodes are written first)
+	if (sbi->times_bh)
+		sync_dirty_buffer(sbi->times_bh);
+
+	brelse(sbi->times_bh);
+	brelse(sbi->share_table_bh);
+	brelse(sbi->inode_store_bh);
+
+	// the counters are up to date, so the next mount can trust them
+	if (sbi->in_use)
+		assoofs_set_clean(sb, true);
+
+	brelse(sbi->sb_bh);
+
+	// release the compressors and their buffers
+	for (i = 0; i < ASSOOFS_COMPRESS_ALGORITHMS; i++)
+		if (sbi->tfm[i])
+			crypto_free_comp(sbi->tfm[i]);
+
+	kvfree(sbi->cluster);
+	kfree(sbi->cluster_disk);
+	kvfree(sbi->packed_meta);
+
+	// release the directory indexes (there are no readers left, and unregistering ignores unregistered shrinkers)
+	unregister_shrinker(&sbi->index_shrinker);
+
+	for (i = 0; i < ASSOOFS_FILESYSTEM_MAX_OBJECTS; i++)
+		if (rcu_access_pointer(sbi->dir_index[i]))
+			assoofs_destroy_index(rcu_dereference_protected(sbi->dir_index[i], 1));
+
+	// every metadata block was written, so the members can be released
+	assoofs_close_members(sb);
+
+	kfree(sbi);
+	sb->s_fs_info = NULL;
+}
+
+/**
+ * A wrapper for the device unmount
+ */
+static void assoofs_kill_block_super(struct super_block *sb) {
+	
+	info("Destroying superblock\n");
+
+	// use the libfs function
+	kill_block_super(sb);
+
+	info("Superblock destroyed. Filesystem unmounted\n");
+}
+
+/**
+ * Get the usage of the filesystem (from the summary counters)
+ */
+static int assoofs_statfs(struct dentry *dentry, struct kstatfs *buf) {
+
+	struct super_block *sb = dentry->d_sb;
+	struct assoofs_super_block *sb_disk = ((struct assoofs_sb_info *) sb->s_fs_info)->sb_disk;
+
+	buf->f_type = ASSOOFS_MAGIC;
+	buf->f_bsize = ASSOOFS_BLOCK_SIZE;
+	buf->f_blocks = assoofs_blocks_count(sb_disk);
+	buf->f_bfree = sb_disk->free_blocks_count;
+	buf->f_bavail = sb_disk->free_blocks_count;
+	buf->f_files = ASSOOFS_FILESYSTEM_MAX_OBJECTS;
+	buf->f_ffree = sb_disk->free_inodes_count;
+	buf->f_namelen = ASSOOFS_FILENAME_MAX_LENGTH - 1;
+
+	return 0;
+}
+
+
+/**
+ * A wrapper for inode deletion
+ */
+// TODO: implement something that DOES WORK
+int assoofs_delete_inode(struct inode *inode/*, struct dentry * dentry*/) {/*
+
+	// get the superblock (linux, assoofs and disk)
+	struct super_block *sb = inode->i_sb;
+	struct assoofs_super_block *assoofs_sb = (struct assoofs_super_block *) sb->s_fs_info;
+	struct assoofs_super_block *disk_sb;
+
+	// declare the variables
+	struct buffer_head *bh;
+	struct assoofs_inode *assoofs_inode = inode->i_private;
+	struct assoofs_inode *inode_iterator;
+
+	uint64_t i;
+	uint64_t one = 1;
+
+	info1("Deleting inode %llu\n", assoofs_inode->inode_no);
+
+	// update the mask to the correct free block
+	one <<= assoofs_inode->data_block_number;
+
+	//if (mutex_lock_interruptible(&assoofs_sb_lock)) {
+	//	sfs_trace("Failed to acquire mutex lock\n");
+	//	return -EINTR;
+	//}
+
+
+	// get the inode store
+	inode_iterator = (struct assoofs_inode *) read_block(sb, &bh, ASSOOFS_INODESTORE_BLOCK_NUMBER);
 
 	// iterate over the whole inode store
 	for (i = 0; i < (ASSOOFS_FILESYSTEM_MAX_OBJECTS - 1); i++) {
@@ -358,15 +1380,82 @@ int assoofs_delete_inode(struct inode *inode/*, struct dentry * dentry*/) {/*
 
 }
 
+/**
+ * Copy the timestamps of a dirty inode to the timestamps block (written back with the buffer cache)
+ * NOTE: lazytime updates only get here when they expire, are synced or the inode is released, and the rest on the next writeback
+ */
+static int assoofs_write_inode(struct inode *inode, struct writeback_control *wbc) {
+
+	struct assoofs_sb_info *sbi = inode->i_sb->s_fs_info;
+	struct assoofs_times *times;
+
+	// images without the block keep the creation times (see assoofs_load_times)
+	if (!sbi->times || !inode->i_ino) return 0;
+
+	times = sbi->times + inode->i_ino - 1;
+
+	// keep the disk writes of the block from seeing half an update (writeback can sleep, unlike the paths marking the inode dirty)
+	lock_buffer(sbi->times_bh);
+
+	times->atime = inode->i_atime;
+	times->mtime = inode->i_mtime;
+	times->ctime = inode->i_ctime;
+
+	unlock_buffer(sbi->times_bh);
+	mark_buffer_dirty(sbi->times_bh);
+
+	// the flusher writes the block on its own, so only the callers waiting for the data need it now
+	if (wbc->sync_mode != WB_SYNC_ALL)
+		return 0;
+
+	return sync_dirty_buffer(sbi->times_bh);
+}
+
+/**
+ * Release an inode, freeing its slot and its data block once it is no longer linked (the last user of a replaced file gets here)
+ */
+static void assoofs_evict_inode(struct inode *inode) {
+
+	truncate_inode_pages_final(&inode->i_data);
+	clear_inode(inode);
+
+	if (inode->i_nlink || !inode->i_ino)
+		return;
+
+	// NOTE: unlinked inodes are never cached (see assoofs_delete_inode), so reclaim never gets here holding the locks
+	mutex_lock(&assoofs_super_lock);
+	mutex_lock(&assoofs_inode_lock);
+
+	assoofs_free_inode(inode->i_sb, inode->i_ino);
+
+	mutex_unlock(&assoofs_inode_lock);
+	mutex_unlock(&assoofs_super_lock);
+}
+
 
 /**
  * Create a file
  */
 static int assoofs_create(struct user_namespace *mnt_userns, struct inode *dir, struct dentry *dentry, umode_t mode, bool excl) {
 
+	int code = assoofs_create_inode(dir, dentry, mode, NULL);
+
+	// the free blocks being discarded are waited for without the superblock lock (see assoofs_find_free_block)
+	if (code == -ENOSPC && assoofs_wait_discard(dir->i_sb))
+		code = assoofs_create_inode(dir, dentry, mode, NULL);
+
+	return code;
+}
+
+/**
+ * Create a file, folder or symlink (with its target)
+ */
+static int assoofs_create_inode(struct inode *dir, struct dentry *dentry, umode_t mode, const char *symname) {
+
 	// get the superblock (linux and assoofs)
 	struct super_block *sb = dir->i_sb;
-	struct assoofs_super_block *assoofs_sb = (struct assoofs_super_block *) sb->s_fs_info;
+	struct assoofs_sb_info *sbi = sb->s_fs_info;
+	struct assoofs_super_block *assoofs_sb = sbi->sb_disk;
 
 	// declare other variables
 	struct buffer_head *bh;
@@ -378,8 +1467,8 @@ static int assoofs_create(struct user_namespace *mnt_userns, struct inode *dir,
 	struct assoofs_dir_record_entry *dir_record_iterator;
 
 	uint64_t count;
-	uint64_t i;
-	uint64_t one = 1;
+	uint64_t slot;
+	bool needs_block;
 
 	info("Creating file/folder\n");
 
@@ -392,16 +1481,19 @@ static int assoofs_create(struct user_namespace *mnt_userns, struct inode *dir,
 	// get the number of inodes
 	count = assoofs_sb->inodes_count;
 
+	// reuse the first slot of a freed inode, appending if there is none (inode numbers follow their slots)
+	for (slot = 0; slot < count && sbi->inode_store[slot].inode_no; slot++);
+
 	// verify it can be created
-	if (count >= ASSOOFS_FILESYSTEM_MAX_OBJECTS) {
+	if (slot >= ASSOOFS_FILESYSTEM_MAX_OBJECTS) {
 
 		error("Cant create file/folder: Reached maximum number of objects supported\n");		
 		mutex_unlock(&assoofs_super_lock);
 		return -2;
 	}
 
-	// verify it is a file or a folder
-	if (!S_ISDIR(mode) && !S_ISREG(mode)) {
+	// verify it is a file, a folder or a symlink
+	if (!S_ISDIR(mode) && !S_ISREG(mode) && !S_ISLNK(mode)) {
 		
 		error("Cant create file/folder: Trying to create an unrecognized inode type\n");
 		mutex_unlock(&assoofs_super_lock);
@@ -419,7 +1511,8 @@ static int assoofs_create(struct user_namespace *mnt_userns, struct inode *dir,
 
 	inode->i_sb = sb;
 	inode->i_op = &assoofs_inode_ops;
-	inode->i_ino = count + 1;
+	inode->i_ino = slot + 1;
+	insert_inode_hash(inode);
 
 
 	// create the assoofs inode and initialize it
@@ -448,42 +1541,53 @@ static int assoofs_create(struct user_namespace *mnt_userns, struct inode *dir,
 
 		assoofs_inode->dir_children_count = 0;
 		inode->i_fop = &assoofs_dir_ops;
-	}
 
-	// find a free block
-	info("Getting free block for file\n");
-	for (i = ASSOOFS_LAST_RESERVED_BLOCK + 1; i < ASSOOFS_FILESYSTEM_MAX_OBJECTS; i++) {
+	} else if (S_ISLNK(mode)) {
 
-		// NOTE: the kernel warns about undefined behaviour if the shift is performed on int (32 bits) (by default on all numeric variables)
-		if (assoofs_sb->free_blocks & (one << i)) 
-			break;
+		info("Populating symlink inode\n");
+
+		assoofs_inode->file_size = strlen(symname);
 	}
 
-	// exit if a free block cant be found
-	if (i >= ASSOOFS_FILESYSTEM_MAX_OBJECTS) {
+	// find a free block, removing it from the list (files start as a hole, getting their block on the first write, and short symlinks dont need one)
+	info("Getting free block for file\n");
+	needs_block = S_ISDIR(mode) || (S_ISLNK(mode) && assoofs_inode->file_size > ASSOOFS_INLINE_LINK_MAX);
+	assoofs_inode->data_block_number = needs_block ? assoofs_alloc_block(sb, 0) : 0;
+
+	// exit if a free block cant be found (releasing the inode, as the create can be retried)
+	if (needs_block && !assoofs_inode->data_block_number) {
 
 		error("Cant create file/folder: No more free blocks available\n");
 		mutex_unlock(&assoofs_super_lock);
-		return -5;
+
+		kfree(assoofs_inode);
+		inode->i_private = NULL;
+		iput(inode);
+		return -ENOSPC;
 	}
 
-	// save the free block found and remove it from the list
-	assoofs_inode->data_block_number = i;
-	assoofs_sb->free_blocks &= ~(one << i);
+	// long symlinks keep their target in the block, written before the inode points to it
+	if (S_ISLNK(mode) && assoofs_inode->data_block_number) {
 
-	// get the superblock buffer head
-	if (!read_block(sb, &bh, ASSOOFS_SUPERBLOCK_BLOCK_NUMBER)) {
+		bh = assoofs_getblk(sb, assoofs_inode->data_block_number);
 
-		mutex_unlock(&assoofs_super_lock);
-		return -6;
-	}
+		if (!bh) {
 
-	// update the data of the superblock and sync it with disk
-	bh->b_data = (char *) assoofs_sb;
+			assoofs_free_block(sb, assoofs_inode->data_block_number);
+			mutex_unlock(&assoofs_super_lock);
+			return -ENOMEM;
+		}
 
-	mark_buffer_dirty(bh);
-	sync_dirty_buffer(bh);
-	brelse(bh);
+		lock_buffer(bh);
+		memset(bh->b_data, 0, ASSOOFS_BLOCK_SIZE);
+		memcpy(bh->b_data, symname, assoofs_inode->file_size);
+		set_buffer_uptodate(bh);
+		unlock_buffer(bh);
+
+		mark_buffer_dirty(bh);
+		sync_dirty_buffer(bh);
+		brelse(bh);
+	}
 
 	info1("Saving inode %llu to disk\n", assoofs_inode->inode_no);
 
@@ -495,42 +1599,25 @@ static int assoofs_create(struct user_namespace *mnt_userns, struct inode *dir,
 	}
 
 
-	// get the inode store pointer
-	inode_iterator = (struct assoofs_inode *) read_block(sb, &bh, ASSOOFS_INODESTORE_BLOCK_NUMBER);
-
-	if (!inode_iterator) {
-
-		mutex_unlock(&assoofs_super_lock);
-		mutex_unlock(&assoofs_inode_lock);
-		return -8;
-	}
-	
-	// move to the end of the list
-	inode_iterator += assoofs_sb->inodes_count;
+	// move to its slot of the inode store
+	inode_iterator = sbi->inode_store + slot;
 
-	// copy the inode at the end of the list (append)
+	// copy the inode to it (appending it if it is past the last one)
 	memcpy(inode_iterator, assoofs_inode, sizeof(struct assoofs_inode));
-	assoofs_sb->inodes_count++;
-
-	// write the inode store to disk
-	mark_buffer_dirty(bh);
-	sync_dirty_buffer(bh);
-	brelse(bh);
+	if (slot == assoofs_sb->inodes_count)
+		assoofs_sb->inodes_count++;
+	assoofs_sb->free_inodes_count--;
 
-	// get the superblock buffer head
-	if (!read_block(sb, &bh, ASSOOFS_SUPERBLOCK_BLOCK_NUMBER)) {
+	// short symlinks keep their target in the inode store, in place of the bloom filter only directories use
+	if (S_ISLNK(mode) && !assoofs_inode->data_block_number) {
 
-		mutex_unlock(&assoofs_super_lock);
-		mutex_unlock(&assoofs_inode_lock);
-		return -9;
+		memset(assoofs_inline_link(sbi->inode_store, assoofs_inode->inode_no), 0, ASSOOFS_BLOOM_SIZE);
+		memcpy(assoofs_inline_link(sbi->inode_store, assoofs_inode->inode_no), symname, assoofs_inode->file_size);
 	}
 
-	// update the data of the superblock and sync it with disk
-	bh->b_data = (char *) assoofs_sb;
-
-	mark_buffer_dirty(bh);
-	sync_dirty_buffer(bh);
-	brelse(bh);
+	// write the inode store and the superblock to disk
+	assoofs_sync_inode_store(sb);
+	assoofs_sync_super(sb);
 
 
 	// get the parent directory data block
@@ -550,9 +1637,17 @@ static int assoofs_create(struct user_namespace *mnt_userns, struct inode *dir,
 	dir_record_iterator->inode_no = assoofs_inode->inode_no;
 	strcpy(dir_record_iterator->filename, dentry->d_name.name);
 
+	// add the name to the bloom filter of the parent (saved with it), new directories starting with an empty one
+	assoofs_bloom_add(assoofs_bloom(sbi->inode_store, parent_dir_inode->inode_no), dentry->d_name.name, dentry->d_name.len);
+
+	if (S_ISDIR(mode))
+		memset(assoofs_bloom(sbi->inode_store, assoofs_inode->inode_no), 0, ASSOOFS_BLOOM_SIZE);
+
+	// and to its in-memory index
+	assoofs_update_index(sb, parent_dir_inode->inode_no, dentry->d_name.name, assoofs_inode->inode_no);
+
 	// write the changes to disk
-	mark_buffer_dirty(bh);
-	sync_dirty_buffer(bh);
+	assoofs_sync_metadata(sb, bh);
 	brelse(bh);
 
 
@@ -570,9 +1665,20 @@ static int assoofs_create(struct user_namespace *mnt_userns, struct inode *dir,
 	mutex_unlock(&assoofs_super_lock);
 	mutex_unlock(&assoofs_inode_lock);
 
-	// initialize the owner of the inode, add it to the directory and exit normally
+	if (S_ISLNK(mode))
+		assoofs_init_link(inode);
+
+	// initialize the owner of the inode and store its timestamps (and the new ones of the parent)
 	inode_init_owner(sb->s_user_ns, inode, dir, mode);
-	d_add(dentry, inode);
+	mark_inode_dirty(inode);
+
+	dir->i_mtime = dir->i_ctime = assoofs_inode->time;
+
+	assoofs_trace(sb, S_ISDIR(mode) ? ASSOOFS_TRACE_MKDIR : S_ISLNK(mode) ? ASSOOFS_TRACE_SYMLINK : ASSOOFS_TRACE_CREATE, dir->i_ino, assoofs_inode->inode_no, S_ISLNK(mode) ? assoofs_inode->file_size : 0, dentry->d_name.name);
+	mark_inode_dirty(dir);
+
+	// attach it to the (already hashed) dentry and exit normally
+	d_instantiate(dentry, inode);
 
 	return 0;
 }
@@ -586,6 +1692,26 @@ static int assoofs_mkdir(struct user_namespace *mnt_userns, struct inode *dir ,
 	return assoofs_create(mnt_userns, dir, dentry, S_IFDIR | mode, false);
 }
 
+/**
+ * Create a symlink
+ */
+static int assoofs_symlink(struct user_namespace *mnt_userns, struct inode *dir, struct dentry *dentry, const char *symname) {
+
+	int code;
+
+	// the target must fit in a data block
+	if (strlen(symname) >= ASSOOFS_BLOCK_SIZE)
+		return -ENAMETOOLONG;
+
+	code = assoofs_create_inode(dir, dentry, S_IFLNK | 0777, symname);
+
+	// the free blocks being discarded are waited for without the superblock lock (see assoofs_find_free_block)
+	if (code == -ENOSPC && assoofs_wait_discard(dir->i_sb))
+		code = assoofs_create_inode(dir, dentry, S_IFLNK | 0777, symname);
+
+	return code;
+}
+
 /*
  * Find a children file inside a folder
  */
@@ -593,6 +1719,7 @@ struct dentry *assoofs_lookup(struct inode *parent_inode, struct dentry *child_d
 
 	// get the superblock and the parent inode
 	struct super_block *sb = parent_inode->i_sb;
+	struct assoofs_sb_info *sbi = sb->s_fs_info;
 	struct assoofs_inode *parent = parent_inode->i_private;
 
 	// declare some variables
@@ -601,419 +1728,3842 @@ struct dentry *assoofs_lookup(struct inode *parent_inode, struct dentry *child_d
 	struct assoofs_dir_record_entry *record;
 	struct inode *inode;
 	struct assoofs_inode *assoofs_inode;
+	uint64_t inode_no;
+	bool indexed;
 
 	info3("Looking up file '%s' inside inode %llu (data block %llu)\n", child_dentry->d_name.name, parent->inode_no, parent->data_block_number);
 
-	// get the parent directory record from disk
-	record = (struct assoofs_dir_record_entry *) read_block(sb, &bh, parent->data_block_number);
-	
-	// return NULL if the block hasn't been read
-	if (!record) return NULL;
-
-	// iterate over all the files in the directory
-	for (i = 0; i < parent->dir_children_count; i++) {
+	// names missing from the bloom filter of the directory are not in it, so its block is not needed
+	if (sbi->blooms && !assoofs_bloom_test(assoofs_bloom(sbi->inode_store, parent->inode_no), child_dentry->d_name.name, child_dentry->d_name.len)) {
 
-		// check if the file is the requested
-		if (!strcmp(record->filename, child_dentry->d_name.name)) {
+		info2("Filename '%s' rejected by the bloom filter of inode %llu\n", child_dentry->d_name.name, parent->inode_no);
+		assoofs_trace(sb, ASSOOFS_TRACE_LOOKUP, parent->inode_no, 0, 0, child_dentry->d_name.name);
 
-			info3("File '%s' (inode %llu) found in inode %llu\n", child_dentry->d_name.name, record->inode_no, parent->inode_no);
+		// cache the miss as a negative dentry
+		d_add(child_dentry, NULL);
+		return NULL;
+	}
+
+	// hot directories are looked up in their in-memory index, without touching the directory block
+	inode_no = assoofs_index_lookup(sb, parent, child_dentry->d_name.name, &indexed);
+
+	if (!indexed) {
+
+		// get the parent directory record from disk
+		record = (struct assoofs_dir_record_entry *) read_block(sb, &bh, parent->data_block_number);
+	
+		// fail if the block hasn't been read (without caching a miss)
+		if (!record) return ERR_PTR(-EIO);
+
+		// iterate over all the files in the directory
+		i = assoofs_find_record(record, parent->dir_children_count, child_dentry->d_name.name);
+		if (i >= 0)
+			inode_no = record[i].inode_no;
+
+		// index the directory for the next lookups
+		assoofs_build_index(sb, parent, record);
+		brelse(bh);
+	}
+
+	if (!inode_no) {
+
+		// cache the miss as a negative dentry, so repeated lookups dont scan the directory again
+		info2("Filename '%s' not found in inode %llu\n", child_dentry->d_name.name, parent->inode_no);
+		assoofs_trace(sb, ASSOOFS_TRACE_LOOKUP, parent->inode_no, 0, 0, child_dentry->d_name.name);
+		d_add(child_dentry, NULL);
+		return NULL;
+	}
+
+	info3("File '%s' (inode %llu) found in inode %llu\n", child_dentry->d_name.name, inode_no, parent->inode_no);
+			
+	// get the assoofs inode and create the linux one
+	if (mutex_lock_interruptible(&assoofs_super_lock)) {
+
+		error("Failed to acquire superblock mutex\n");
+		return ERR_PTR(-EINTR);
+	}
+	if (mutex_lock_interruptible(&assoofs_inode_lock)) {
+
+		error("Failed to acquire inode store mutex\n");
+		mutex_unlock(&assoofs_super_lock);
+		return ERR_PTR(-EINTR);
+	}
+
+	assoofs_inode = assoofs_get_inode(sb, inode_no);
+			
+	mutex_unlock(&assoofs_super_lock);
+	mutex_unlock(&assoofs_inode_lock);
+
+	if (!assoofs_inode) return ERR_PTR(-EIO);
+
+	inode = new_inode(sb);
+	if (!inode) {
+
+		error("Error on lookup: cant create inode\n");
+		kfree(assoofs_inode);
+		return ERR_PTR(-ENOMEM);
+	}
+
+	// initialize the linux inode
+	inode->i_ino = inode_no;
+	inode->i_sb = sb;
+	inode->i_op = &assoofs_inode_ops;
+	inode->i_private = assoofs_inode;
+
+	assoofs_load_times(inode);
+	insert_inode_hash(inode);
+
+	// use the correct type (directory or file)
+	if (S_ISDIR(assoofs_inode->mode)) {
+
+		inode->i_fop = &assoofs_dir_ops;
+
+	} else if (S_ISREG(assoofs_inode->mode)) {
+
+		inode->i_fop = &assoofs_file_ops;
+		inode->i_size = assoofs_inode->file_size;
+
+	} else if (S_ISLNK(assoofs_inode->mode)) {
+
+		assoofs_init_link(inode);
+
+	} else {
+
+		error("Error on lookup: unknown inode type.\n");
+	}
+
+	// initialize the owner of the inode
+	inode_init_owner(sb->s_user_ns, inode, parent_inode, assoofs_inode->mode);
+
+	assoofs_trace(sb, ASSOOFS_TRACE_LOOKUP, parent->inode_no, inode_no, assoofs_inode->mode, child_dentry->d_name.name);
 			
-			// get the assoofs inode and create the linux one
-			if (mutex_lock_interruptible(&assoofs_super_lock)) {
+	// add it to the child entry and exit
+	d_add(child_dentry, inode);
+	return NULL;
+}
+
+
+/*
+ * Rename a file or folder, only rewriting the records of the parent directories
+ */
+static int assoofs_rename(struct user_namespace *mnt_userns, struct inode *old_dir, struct dentry *old_dentry, struct inode *new_dir, struct dentry *new_dentry, unsigned int flags) {
+
+	// get the superblock and the parent inodes
+	struct super_block *sb = old_dir->i_sb;
+	struct assoofs_sb_info *sbi = sb->s_fs_info;
+	struct assoofs_inode *old_parent = old_dir->i_private;
+	struct assoofs_inode *new_parent = new_dir->i_private;
+
+	// declare some variables
+	struct inode *target = d_inode(new_dentry);
+	struct buffer_head *old_bh;
+	struct buffer_head *new_bh;
+	struct assoofs_dir_record_entry *old_record;
+	struct assoofs_dir_record_entry *new_record;
+	struct assoofs_dir_record_entry moved;
+	uint64_t old_count = old_parent->dir_children_count;
+	uint64_t new_count = new_parent->dir_children_count;
+	uint64_t inode_no;
+	int old_pos;
+	int new_pos = -1;
+	int code = 0;
+
+	info3("Renaming '%s' (inode %llu) to '%s'\n", old_dentry->d_name.name, old_parent->inode_no, new_dentry->d_name.name);
+
+	// only the no-replace and exchange modes are supported (the vfs already checks their preconditions)
+	if (flags & ~(RENAME_NOREPLACE | RENAME_EXCHANGE))
+		return -EINVAL;
+
+	// the new name must fit in a directory record
+	if (new_dentry->d_name.len >= ASSOOFS_FILENAME_MAX_LENGTH)
+		return -ENAMETOOLONG;
+
+	// a directory can only be replaced if it is empty
+	if (!(flags & RENAME_EXCHANGE) && target && S_ISDIR(target->i_mode) && ((struct assoofs_inode *) target->i_private)->dir_children_count)
+		return -ENOTEMPTY;
+
+	if (mutex_lock_interruptible(&assoofs_super_lock)) {
+
+		error("Failed to acquire superblock mutex\n");
+		return -EINTR;
+	}
+	if (mutex_lock_interruptible(&assoofs_inode_lock)) {
+
+		error("Failed to acquire inode store mutex\n");
+		mutex_unlock(&assoofs_super_lock);
+		return -EINTR;
+	}
+
+	// get the records of the source directory
+	old_record = (struct assoofs_dir_record_entry *) read_block(sb, &old_bh, old_parent->data_block_number);
+
+	if (!old_record) {
+
+		code = -EIO;
+		goto out;
+	}
+
+	// get the records of the target directory (sharing the buffer head on the same directory)
+	if (old_parent->inode_no == new_parent->inode_no) {
+
+		new_bh = old_bh;
+		new_record = old_record;
+
+	} else {
+
+		new_record = (struct assoofs_dir_record_entry *) read_block(sb, &new_bh, new_parent->data_block_number);
+
+		if (!new_record) {
+
+			brelse(old_bh);
+			code = -EIO;
+			goto out;
+		}
+	}
+
+	// find the records involved
+	old_pos = assoofs_find_record(old_record, old_parent->dir_children_count, old_dentry->d_name.name);
+
+	if (target)
+		new_pos = assoofs_find_record(new_record, new_parent->dir_children_count, new_dentry->d_name.name);
+
+	if (old_pos < 0 || (target && new_pos < 0)) {
+
+		error("Cant rename file/folder: Directory record not found\n");
+		code = -ENOENT;
+		goto release;
+	}
+
+	inode_no = old_record[old_pos].inode_no;
+	moved = old_record[old_pos];
+
+	if (flags & RENAME_EXCHANGE) {
+
+		// swap the inodes of both records, keeping the names
+		old_record[old_pos].inode_no = new_record[new_pos].inode_no;
+		new_record[new_pos].inode_no = inode_no;
+
+	} else if (new_bh == old_bh && !target) {
+
+		// rename in place
+		strcpy(old_record[old_pos].filename, new_dentry->d_name.name);
+
+	} else {
+
+		if (target) {
+
+			// point the replaced record to the moved inode (the replaced one is freed once it is released, see assoofs_evict_inode)
+			new_record[new_pos].inode_no = inode_no;
+
+		} else {
+
+			// verify there is room for one more record in the target directory
+			if (new_parent->dir_children_count >= ASSOOFS_DIR_MAX_RECORDS) {
+
+				error("Cant rename file/folder: Target directory is full\n");
+				code = -ENOSPC;
+				goto release;
+			}
+
+			// append the record to the target directory
+			new_record += new_parent->dir_children_count;
+			new_record->inode_no = inode_no;
+			strcpy(new_record->filename, new_dentry->d_name.name);
+			new_parent->dir_children_count++;
+		}
+
+		// remove the source record moving the last one to its place
+		old_parent->dir_children_count--;
+		if (old_pos != old_parent->dir_children_count)
+			memcpy(&old_record[old_pos], &old_record[old_parent->dir_children_count], sizeof(*old_record));
+	}
+
+	// update the children count of the parent directories if they changed (before anything else is written, so a failure can be undone)
+	if (!(flags & RENAME_EXCHANGE) && (old_parent->inode_no != new_parent->inode_no || target)) {
+
+		if (assoofs_save_inode(sb, old_parent) || (old_parent->inode_no != new_parent->inode_no && assoofs_save_inode(sb, new_parent))) {
+
+			error("Cant rename file/folder: Error updating parent folder data\n");
+
+			// put the records and the counts back as they were (the removal first, as it can have moved the replaced record)
+			old_parent->dir_children_count = old_count;
+			if (old_pos != old_count - 1)
+				memcpy(&old_record[old_count - 1], &old_record[old_pos], sizeof(*old_record));
+			memcpy(&old_record[old_pos], &moved, sizeof(*old_record));
+
+			if (target)
+				new_record[new_pos].inode_no = target->i_ino;
+
+			new_parent->dir_children_count = new_count;
+			assoofs_save_inode(sb, old_parent);
+
+			code = -EIO;
+			goto release;
+		}
+	}
+
+	// keep the bloom filters up to date (names cant be removed from them, so the source one is rebuilt)
+	if (!(flags & RENAME_EXCHANGE)) {
+
+		assoofs_fill_bloom(sb, old_parent->inode_no, old_record, old_parent->dir_children_count);
+		assoofs_bloom_add(assoofs_bloom(sbi->inode_store, new_parent->inode_no), new_dentry->d_name.name, new_dentry->d_name.len);
+		assoofs_sync_inode_store(sb);
+	}
+
+	// and the in-memory indexes
+	if (flags & RENAME_EXCHANGE) {
+
+		assoofs_update_index(sb, old_parent->inode_no, old_dentry->d_name.name, old_record[old_pos].inode_no);
+		assoofs_update_index(sb, new_parent->inode_no, new_dentry->d_name.name, inode_no);
+
+	} else {
+
+		assoofs_update_index(sb, old_parent->inode_no, old_dentry->d_name.name, 0);
+		assoofs_update_index(sb, new_parent->inode_no, new_dentry->d_name.name, inode_no);
+	}
+
+	// write the changes to disk
+	assoofs_sync_metadata(sb, old_bh);
+
+	if (new_bh != old_bh)
+		assoofs_sync_metadata(sb, new_bh);
+
+	// the replaced inode is no longer linked (an empty directory loses its own link from "." too)
+	if (target && !(flags & RENAME_EXCHANGE)) {
+
+		if (S_ISDIR(target->i_mode))
+			clear_nlink(target);
+		else
+			drop_nlink(target);
+	}
+
+	old_dir->i_ctime = old_dir->i_mtime = current_time(old_dir);
+	new_dir->i_ctime = new_dir->i_mtime = old_dir->i_mtime;
+	d_inode(old_dentry)->i_ctime = old_dir->i_mtime;
+
+	mark_inode_dirty(old_dir);
+	mark_inode_dirty(new_dir);
+	mark_inode_dirty(d_inode(old_dentry));
+
+	info2("Renamed to '%s' (inode %llu)\n", new_dentry->d_name.name, new_parent->inode_no);
+
+release:
+	if (new_bh != old_bh)
+		brelse(new_bh);
+	brelse(old_bh);
+
+out:
+	mutex_unlock(&assoofs_super_lock);
+	mutex_unlock(&assoofs_inode_lock);
+	return code;
+}
+
+
+/*
+ * Get the attributes of an inode (only the compression flag is supported)
+ */
+static int assoofs_fileattr_get(struct dentry *dentry, struct fileattr *fa) {
+
+	struct assoofs_inode *assoofs_inode = d_inode(dentry)->i_private;
+
+	fileattr_fill_flags(fa, (assoofs_inode->mode & ASSOOFS_INODE_COMPRESS) ? FS_COMPR_FL : 0);
+	return 0;
+}
+
+/*
+ * Set the attributes of an inode (only the compression flag is supported)
+ */
+static int assoofs_fileattr_set(struct user_namespace *mnt_userns, struct dentry *dentry, struct fileattr *fa) {
+
+	struct super_block *sb = dentry->d_sb;
+	struct assoofs_inode *assoofs_inode = d_inode(dentry)->i_private;
+	int code;
+
+	if (fileattr_has_fsx(fa) || (fa->flags & ~FS_COMPR_FL))
+		return -EOPNOTSUPP;
+
+	// only files have data to compress
+	if ((fa->flags & FS_COMPR_FL) && !S_ISREG(assoofs_inode->mode))
+		return -EINVAL;
+
+	if (mutex_lock_interruptible(&assoofs_super_lock)) {
+
+		error("Failed to acquire superblock mutex\n");
+		return -EINTR;
+	}
+	if (mutex_lock_interruptible(&assoofs_inode_lock)) {
+
+		error("Failed to acquire inode store mutex\n");
+		mutex_unlock(&assoofs_super_lock);
+		return -EINTR;
+	}
+
+	// the data already written is (de)compressed on the next write
+	if (fa->flags & FS_COMPR_FL)
+		assoofs_inode->mode = (assoofs_inode->mode | ASSOOFS_INODE_COMPRESS) & ~ASSOOFS_INODE_NOCOMPRESS;
+	else
+		assoofs_inode->mode &= ~ASSOOFS_INODE_COMPRESS;
+
+	code = assoofs_save_inode(sb, assoofs_inode) ? -EIO : 0;
+
+	mutex_unlock(&assoofs_super_lock);
+	mutex_unlock(&assoofs_inode_lock);
+
+	return code;
+}
+
+
+/**
+ * Change the attributes of an inode, truncating regular files (or extending them with a hole)
+ */
+static int assoofs_setattr(struct user_namespace *mnt_userns, struct dentry *dentry, struct iattr *attr) {
+
+	// declare and get the inodes (linux and assoofs) and the superblock
+	struct inode *inode = d_inode(dentry);
+	struct assoofs_inode *assoofs_inode = inode->i_private;
+	struct super_block *sb = inode->i_sb;
+
+	// declare some variables
+	struct assoofs_write_batch batch;
+	struct buffer_head *bh;
+	int code;
+
+	code = setattr_prepare(mnt_userns, dentry, attr);
+	if (code) return code;
+
+	// the inode store keeps no owner, and the mode only as it was created, so only the requests that leave them as they are succeed (as through FUSE)
+	if ((attr->ia_valid & ATTR_MODE) && (attr->ia_mode & 07777) != (inode->i_mode & 07777))
+		return -EPERM;
+	if ((attr->ia_valid & ATTR_UID) && !uid_eq(attr->ia_uid, inode->i_uid))
+		return -EPERM;
+	if ((attr->ia_valid & ATTR_GID) && !gid_eq(attr->ia_gid, inode->i_gid))
+		return -EPERM;
+
+	if ((attr->ia_valid & ATTR_SIZE) && S_ISREG(inode->i_mode) && attr->ia_size != assoofs_inode->file_size) {
+
+		info3("Resizing inode %llu from %llu to %llu bytes\n", assoofs_inode->inode_no, assoofs_inode->file_size, attr->ia_size);
+
+		// resizing a compressed cluster would mean recompressing it, so they can only be emptied
+		if (attr->ia_size && (assoofs_inode->mode & ASSOOFS_INODE_COMPRESSED))
+			return -EOPNOTSUPP;
+
+		if (attr->ia_size > ASSOOFS_BLOCK_SIZE)
+			return -EFBIG;
+
+retry:
+		if (mutex_lock_interruptible(&assoofs_super_lock)) {
+
+			error("Failed to acquire superblock mutex\n");
+			return -EINTR;
+		}
+		if (mutex_lock_interruptible(&assoofs_inode_lock)) {
 
-				error("Failed to acquire superblock mutex\n");
-				brelse(bh);
-				return NULL;
+			error("Failed to acquire inode store mutex\n");
+			mutex_unlock(&assoofs_super_lock);
+			return -EINTR;
+		}
+
+		// the data block and the metadata are written together, and waited for without the locks
+		assoofs_start_writes(sb, &batch);
+
+		if (!attr->ia_size) {
+
+			// empty files give their block back, becoming a hole
+			assoofs_release_block(sb, assoofs_inode->data_block_number);
+			assoofs_inode->data_block_number = 0;
+			assoofs_inode->mode &= ~(ASSOOFS_INODE_COMPRESSED | ASSOOFS_INODE_NOCOMPRESS);
+
+		} else if (assoofs_inode->data_block_number && attr->ia_size > assoofs_inode->file_size) {
+
+			// the bytes after the old end of the file must read as zeros
+			if (!read_block(sb, &bh, assoofs_inode->data_block_number)) {
+
+				code = -EIO;
+				goto out;
 			}
-			if (mutex_lock_interruptible(&assoofs_inode_lock)) {
 
-				error("Failed to acquire inode store mutex\n");
-				mutex_unlock(&assoofs_super_lock);
-				brelse(bh);
-				return NULL;
-			}
+			// never modify a block shared with other files
+			bh = assoofs_cow_block(sb, assoofs_inode, bh);
+
+			if (!bh) {
+
+				code = -ENOSPC;
+				goto out;
+			}
+
+			memset(bh->b_data + assoofs_inode->file_size, 0, attr->ia_size - assoofs_inode->file_size);
+			brelse(assoofs_store_block(sb, assoofs_inode, bh, attr->ia_size));
+		}
+
+		// holes (and shrunk blocks) only need the new size
+		assoofs_inode->file_size = attr->ia_size;
+
+		if (assoofs_save_inode(sb, assoofs_inode)) {
+
+			code = -EIO;
+			goto out;
+		}
+
+		i_size_write(inode, attr->ia_size);
+		inode->i_mtime = inode->i_ctime = current_time(inode);
+
+out:
+		assoofs_submit_writes(sb);
+
+		mutex_unlock(&assoofs_super_lock);
+		mutex_unlock(&assoofs_inode_lock);
+
+		if (assoofs_wait_writes(&batch) && !code)
+			code = -EIO;
+
+		// the free blocks being discarded are waited for without the superblock lock (see assoofs_find_free_block)
+		if (code == -ENOSPC && assoofs_wait_discard(sb)) {
+
+			code = 0;
+			goto retry;
+		}
+
+		if (code) return code;
+	}
+
+	setattr_copy(mnt_userns, inode, attr);
+	mark_inode_dirty(inode);
+	return 0;
+}
+
+/**
+ * Get the target of a long symlink from its data block
+ */
+static const char *assoofs_get_link(struct dentry *dentry, struct inode *inode, struct delayed_call *done) {
+
+	struct assoofs_inode *assoofs_inode = inode->i_private;
+	struct buffer_head *bh;
+	char *link;
+
+	// reading the block may sleep, so rcu path walks must retry
+	if (!dentry) return ERR_PTR(-ECHILD);
+
+	if (!read_block(inode->i_sb, &bh, assoofs_inode->data_block_number))
+		return ERR_PTR(-EIO);
+
+	link = kmemdup_nul(bh->b_data, assoofs_inode->file_size, GFP_KERNEL);
+	brelse(bh);
+
+	if (!link) return ERR_PTR(-ENOMEM);
+
+	set_delayed_call(done, kfree_link, link);
+	return link;
+}
+
+/*
+ * Read a whole directory
+ */
+// TODO: USE FILE MUTEXES FOR CONCURRENT READ-WRITE? (they are struct mutex as well)
+static int assoofs_iterate(struct file *file, struct dir_context *ctx) {
+
+	// declare and get the inodes (linux and assoofs) the superblock
+	struct inode *inode = file->f_path.dentry->d_inode;
+	struct assoofs_inode *assoofs_inode = inode->i_private;
+	struct super_block *sb = inode->i_sb;
+
+	// declare the rest of the variables
+	int i;
+	struct buffer_head *bh;
+	struct assoofs_dir_record_entry *record;
+
+	info1("Reading directory '%s' contents\n", file->f_path.dentry->d_name.name);
+
+	// check if the context is already created, exiting if it is not
+	if (ctx->pos) {
+
+		error("Directory context is not initialized\n");
+		return -1;
+	}
+
+	// check if the inode is a directory, exiting if its not
+	if (!S_ISDIR(assoofs_inode->mode)) {
+		
+		error3("Inode (%llu, %lu) for file '%s' is not a directory\n", assoofs_inode->inode_no, inode->i_ino, file->f_path.dentry->d_name.name);
+		return -2;
+	}
+
+	assoofs_trace(sb, ASSOOFS_TRACE_ITERATE, assoofs_inode->inode_no, 0, 0, NULL);
+
+	// read the directory record from disk
+	record = (struct assoofs_dir_record_entry *) read_block(sb, &bh, assoofs_inode->data_block_number);
+
+	if (!record) return -3;
+
+	// iterate over all files in directory
+	for (i = 0; i < assoofs_inode->dir_children_count; i++) {
+
+		// add the file to the context
+		dir_emit(ctx, record->filename, ASSOOFS_FILENAME_MAX_LENGTH, record->inode_no, DT_UNKNOWN);
+		ctx->pos += sizeof(struct assoofs_dir_record_entry);
+		
+		// prepare the next record
+		record++;
+	}
+
+	info2("Directory '%s' read. Found %d inodes\n", file->f_path.dentry->d_name.name, i);
+
+	file_accessed(file);
+
+	// release resources and return
+	brelse(bh);
+	return 0;
+}
+
+
+/*
+ * Open a file, letting io_uring try reads without a worker thread (see IOCB_NOWAIT)
+ */
+static int assoofs_file_open(struct inode *inode, struct file *file) {
+
+	file->f_mode |= FMODE_NOWAIT;
+	return generic_file_open(inode, file);
+}
+
+
+/*
+ * Write a file (or directory) and the metadata to disk
+ */
+static int assoofs_fsync(struct file *file, loff_t start, loff_t end, int datasync) {
+
+	// the timestamps only reach their block on writeback (fdatasync can leave them behind)
+	if (!datasync)
+		sync_inode_metadata(file_inode(file), 0);
+
+	// the whole volume lives in the buffer cache of its devices, so it is written at once (including the metadata left to the flusher)
+	return assoofs_sync_members(file_inode(file)->i_sb, true);
+}
+
+
+/*
+ * Read from a file
+ */
+ssize_t assoofs_read_iter(struct kiocb *iocb, struct iov_iter *to) {
+
+	// declare and get the file, the assoofs inode and the superblock
+	struct file *file = iocb->ki_filp;
+	struct assoofs_inode *inode = file->f_path.dentry->d_inode->i_private;
+	struct super_block *sb = file->f_path.dentry->d_inode->i_sb;
+	struct assoofs_sb_info *sbi = sb->s_fs_info;
+
+	// declare other variables
+	struct buffer_head *bh;
+	char *buffer;
+
+	loff_t *pos = &iocb->ki_pos;
+	size_t len = iov_iter_count(to);
+	size_t left;
+	uint64_t range = 0;
+	int nbytes;
+	bool compressed;
+	bool nowait = iocb->ki_flags & IOCB_NOWAIT;
+
+	info3("Trying to read %lu bytes from file '%s', starting from byte %llu\n", len, file->f_path.dentry->d_name.name, *pos);
+
+	// readers share the inode, so the block and the size dont change under them (writers in place only lock the chunks they touch, which readers lock shared)
+	if (nowait) {
+
+		if (!inode_trylock_shared(file_inode(file)))
+			return -EAGAIN;
+
+	} else {
+
+		inode_lock_shared(file_inode(file));
+	}
+
+	assoofs_trace(sb, ASSOOFS_TRACE_READ, inode->inode_no, *pos, len, NULL);
+
+	// prevent reading data outside the file
+	if (*pos >= inode->file_size) {
+	
+		error("Cant read from disk: Trying to read outside the file\n");
+		inode_unlock_shared(file_inode(file));
+		return 0;
+	}
+
+	// files without a data block are a hole, which reads as zeros without touching the disk
+	if (!inode->data_block_number) {
+
+		nbytes = iov_iter_zero(min_t(size_t, inode->file_size - *pos, len), to);
+		*pos += nbytes;
+		inode_unlock_shared(file_inode(file));
+		file_accessed(file);
+
+		info2("Read %d bytes from hole in file '%s'\n", nbytes, file->f_path.dentry->d_name.name);
+		return nbytes;
+	}
+
+	// get the file block (only from the cache if the caller cant wait for the disk)
+	if (nowait) {
+
+		buffer = (char *) assoofs_read_cached_block(sb, &bh, inode->data_block_number);
+
+		if (!buffer) {
+
+			inode_unlock_shared(file_inode(file));
+			return -EAGAIN;
+		}
+
+	} else {
+
+		buffer = (char *) read_block(sb, &bh, inode->data_block_number);
+	}
+	
+	// return 0 if the block hasn't been read
+	if (!buffer) {
+
+		inode_unlock_shared(file_inode(file));
+		return 0;
+	}
+
+	// compressed files are read from their uncompressed cluster
+	compressed = inode->mode & ASSOOFS_INODE_COMPRESSED;
+
+	if (compressed) {
+
+		if (!nowait) {
+
+			mutex_lock(&sbi->compress_lock);
+
+		} else if (!mutex_trylock(&sbi->compress_lock)) {
+
+			inode_unlock_shared(file_inode(file));
+			brelse(bh);
+			return -EAGAIN;
+		}
+
+		if (assoofs_decompress(sb, buffer) != inode->file_size) {
+
+			error1("Cant read from disk: Corrupted compressed cluster on block %llu\n", inode->data_block_number);
+
+			// release resources and return
+			mutex_unlock(&sbi->compress_lock);
+			inode_unlock_shared(file_inode(file));
+			brelse(bh);
+			return -EIO;
+		}
+
+		buffer = sbi->cluster;
+	}
+
+	// move the buffer to the current position
+	buffer += *pos;
+
+	// find the amount of bytes to read
+	left = (size_t) inode->file_size - (size_t) *pos;
+	nbytes = min(left, len);
+
+	// keep writers in place out of the chunks being copied, so no half written chunk is seen (compressed files are never written in place)
+	if (!compressed && nbytes) {
+
+		range = assoofs_range_mask(*pos, nbytes);
+
+		if (!nowait) {
+
+			assoofs_lock_range(sbi, inode->inode_no, range, true);
+
+		} else if (!assoofs_try_lock_range(sbi, inode->inode_no, range, true)) {
+
+			inode_unlock_shared(file_inode(file));
+			brelse(bh);
+			return -EAGAIN;
+		}
+	}
+
+	// copy the data from the block buffer to the userspace buffer, checking for errors
+	nbytes = copy_to_iter(buffer, nbytes, to);
+
+	if (compressed)
+		mutex_unlock(&sbi->compress_lock);
+	else if (range)
+		assoofs_unlock_range(sbi, inode->inode_no, range, true);
+
+	inode_unlock_shared(file_inode(file));
+
+	if (!nbytes) {
+
+		error("Error copying file contents to the userspace buffer\n");
+		
+		// release resources and return
+		brelse(bh);
+		return -EFAULT;
+	}
+
+	// update the current position (and the access time, as relatime or lazytime allow)
+	*pos += nbytes;
+	file_accessed(file);
+
+	info2("Read %d bytes from file '%s'\n", nbytes, file->f_path.dentry->d_name.name);
+
+	// release resources and return the amount of bytes read
+	brelse(bh);
+	return nbytes;
+}
+
+/*
+ * Write to a file
+ */
+ssize_t assoofs_write_iter(struct kiocb *iocb, struct iov_iter *from) {
+
+	// declare and get the linux inode
+	struct inode *inode = file_inode(iocb->ki_filp);
+	size_t count;
+	ssize_t code;
+
+	info3("Trying to write %lu bytes from file '%s', starting from byte %llu\n", iov_iter_count(from), iocb->ki_filp->f_path.dentry->d_name.name, iocb->ki_pos);
+
+	// writes are synchronous (they always wait for the disk), so they are retried from a context that can block
+	if (iocb->ki_flags & IOCB_NOWAIT)
+		return -EAGAIN;
+
+	assoofs_trace(inode->i_sb, ASSOOFS_TRACE_WRITE, inode->i_ino, iocb->ki_pos, iov_iter_count(from), NULL);
+
+	// writes inside the file only lock the bytes they touch, so writers of different ranges dont wait for each other
+	inode_lock_shared(inode);
+
+	// apply O_APPEND and the size limits first (the size only changes with the inode locked exclusive)
+	code = generic_write_checks(iocb, from);
+	if (code > 0)
+		code = assoofs_write_range(iocb, from);
+
+	// the modification time is stored lazily, by assoofs_write_inode
+	if (code > 0)
+		file_update_time(iocb->ki_filp);
+
+	inode_unlock_shared(inode);
+
+	if (code != -EAGAIN)
+		return code;
+
+	// the rest change the block or the size of the file, so they are exclusive (and checked again, as the size may have changed meanwhile)
+	inode_lock(inode);
+
+	code = generic_write_checks(iocb, from);
+	count = iov_iter_count(from);
+
+	if (code > 0)
+		code = assoofs_write_exclusive(iocb, from);
+
+	// the free blocks being discarded are waited for without the superblock lock (see assoofs_find_free_block)
+	if (code == -ENOSPC && assoofs_wait_discard(inode->i_sb)) {
+
+		iov_iter_revert(from, count - iov_iter_count(from));
+		code = assoofs_write_exclusive(iocb, from);
+	}
+
+	if (code > 0)
+		file_update_time(iocb->ki_filp);
+
+	inode_unlock(inode);
+
+	return code;
+}
+
+/*
+ * Write inside a file that owns its block alone, only locking the chunks written (returns -EAGAIN if the write must be exclusive)
+ * NOTE: the inode must be locked (shared)
+ */
+static ssize_t assoofs_write_range(struct kiocb *iocb, struct iov_iter *from) {
+
+	// declare and get the file, the assoofs inode and the superblock
+	struct file *file = iocb->ki_filp;
+	struct assoofs_inode *inode = file_inode(file)->i_private;
+	struct super_block *sb = file_inode(file)->i_sb;
+	struct assoofs_sb_info *sbi = sb->s_fs_info;
+
+	// declare some variables
+	struct buffer_head *bh;
+	loff_t *pos = &iocb->ki_pos;
+	size_t len = iov_iter_count(from);
+	uint64_t range;
+	bool listed;
+	char *data;
+
+	// holes, writes past the end of the file and compressed (or deduplicated) files change the block or the size
+	if (!len || sbi->dedup || sbi->compress || (inode->mode & (ASSOOFS_INODE_COMPRESS | ASSOOFS_INODE_COMPRESSED)))
+		return -EAGAIN;
+
+	if (!inode->data_block_number || *pos + len > inode->file_size)
+		return -EAGAIN;
+
+	// blocks in the share table are shared (or have a hash that would go stale)
+	// NOTE: blocks are only added to it with the inode locked (exclusive), or on deduplicated mounts
+	if (mutex_lock_interruptible(&assoofs_super_lock)) {
+
+		error("Failed to acquire superblock mutex\n");
+		return -EINTR;
+	}
+
+	listed = assoofs_find_share(sb, inode->data_block_number) != NULL;
+
+	mutex_unlock(&assoofs_super_lock);
+
+	if (listed)
+		return -EAGAIN;
+
+	// copy the userspace buffer first, checking for errors (so a failed copy never leaves the block half written)
+	data = kmalloc(len, GFP_KERNEL);
+	if (!data) return -ENOMEM;
+
+	if (!copy_from_iter_full(data, len, from)) {
+
+		error("Error copying userspace buffer to the file buffer\n");
+		kfree(data);
+		return -EFAULT;
+	}
+
+	// get the file block
+	if (!read_block(sb, &bh, inode->data_block_number)) {
+
+		kfree(data);
+		return -EIO;
+	}
+
+	range = assoofs_range_mask(*pos, len);
+	assoofs_lock_range(sbi, inode->inode_no, range, false);
+
+	memcpy(bh->b_data + *pos, data, len);
+	mark_buffer_dirty(bh);
+	*pos += len;
+
+	assoofs_unlock_range(sbi, inode->inode_no, range, false);
+
+	// write the changes to disk (together with the ones of other writers of the block)
+	sync_dirty_buffer(bh);
+	brelse(bh);
+	kfree(data);
+
+	info2("Written %lu bytes in place to file '%s'\n", len, file->f_path.dentry->d_name.name);
+
+	return len;
+}
+
+/*
+ * Write to a file, changing its block or its size
+ * NOTE: the inode must be locked (exclusive)
+ */
+static ssize_t assoofs_write_exclusive(struct kiocb *iocb, struct iov_iter *from) {
+
+	// declare and get the file, the assoofs inode and the superblock
+	struct file *file = iocb->ki_filp;
+	struct assoofs_inode *inode = file->f_path.dentry->d_inode->i_private;
+	struct super_block *sb = file->f_path.dentry->d_inode->i_sb;
+
+	// declare some variables
+	struct assoofs_sb_info *sbi = sb->s_fs_info;
+	struct assoofs_write_batch batch;
+	struct buffer_head *bh;
+	char *buffer;
+	char *data;
+	loff_t *pos = &iocb->ki_pos;
+	size_t len = iov_iter_count(from);
+	ssize_t code = len;
+
+	// compressed (or to be compressed) files are written as a whole cluster
+	if (sbi->compress || (inode->mode & (ASSOOFS_INODE_COMPRESS | ASSOOFS_INODE_COMPRESSED)))
+		return assoofs_write_cluster(iocb, from);
+	
+	// verify the file still fits in its block (s_maxbytes is the size of a cluster, as compressed files can be larger)
+	if (*pos + len > ASSOOFS_BLOCK_SIZE) {
+
+		error("Cant write to disk: File size after write exceeds block size\n");
+		return -EFBIG;
+	}
+
+	// copy the userspace buffer first, checking for errors (so a failed copy never leaves the block half written)
+	data = kmalloc(len, GFP_KERNEL);
+	if (!data) return -ENOMEM;
+
+	if (!copy_from_iter_full(data, len, from)) {
+
+		error("Error copying userspace buffer to the file buffer\n");
+		kfree(data);
+		return -EFAULT;
+	}
+
+	// get the file block (holes get one once the locks are held)
+	bh = NULL;
+
+	if (inode->data_block_number) {
+
+		buffer = (char *) read_block(sb, &bh, inode->data_block_number);
+	
+		// fail if the block hasn't been read
+		if (!buffer) {
+
+			kfree(data);
+			return -EIO;
+		}
+	}
+
+	if (mutex_lock_interruptible(&assoofs_super_lock)) {
+
+		error("Failed to acquire superblock mutex\n");
+		kfree(data);
+		brelse(bh);
+		return -EINTR;
+	}
+	if (mutex_lock_interruptible(&assoofs_inode_lock)) {
+
+		error("Failed to acquire inode store mutex\n");
+		mutex_unlock(&assoofs_super_lock);
+		kfree(data);
+		brelse(bh);
+		return -EINTR;
+	}
+
+	// the data block and the metadata are written together, and waited for without the locks (so writes to other members go on meanwhile)
+	assoofs_start_writes(sb, &batch);
+
+	// never modify a block shared with other files, and fill holes with a new block
+	bh = bh ? assoofs_cow_block(sb, inode, bh) : assoofs_alloc_data_block(sb, inode);
+
+	if (!bh) {
+
+		assoofs_submit_writes(sb);
+		mutex_unlock(&assoofs_super_lock);
+		mutex_unlock(&assoofs_inode_lock);
+		assoofs_wait_writes(&batch);
+		kfree(data);
+		return -ENOSPC;
+	}
+
+	// fill the gap after the end of the file with zeros
+	if (*pos > inode->file_size)
+		memset(bh->b_data + inode->file_size, 0, *pos - inode->file_size);
+
+	memcpy(bh->b_data + *pos, data, len);
+	kfree(data);
+
+	// update the current position
+	*pos += len;
+
+	// update the inode information (writing inside the file keeps its size, truncating goes through setattr)
+	inode->file_size = max_t(uint64_t, inode->file_size, *pos);
+	i_size_write(file_inode(file), inode->file_size);
+
+	// write changes to disk (or share an identical block)
+	bh = assoofs_store_block(sb, inode, bh, inode->file_size);
+
+	if (assoofs_save_inode(sb, inode)) {
+
+		error("Cant write to disk: Error saving the inode\n");
+		code = -EIO;
+	}
+
+	assoofs_submit_writes(sb);
+
+	mutex_unlock(&assoofs_super_lock);
+	mutex_unlock(&assoofs_inode_lock);
+
+	if (assoofs_wait_writes(&batch) && code > 0)
+		code = -EIO;
+
+	if (code > 0)
+		info2("Written %lu bytes to file '%s'\n", len, file->f_path.dentry->d_name.name);
+
+	// release resources and return the amount of bytes written
+	brelse(bh);
+	return code;
+}
+
+
+/*
+ * Write to a compressed file, rewriting its whole cluster
+ */
+static ssize_t assoofs_write_cluster(struct kiocb *iocb, struct iov_iter *from) {
+
+	// declare and get the file, the assoofs inode and the superblock
+	struct file *file = iocb->ki_filp;
+	struct assoofs_inode *inode = file->f_path.dentry->d_inode->i_private;
+	struct super_block *sb = file->f_path.dentry->d_inode->i_sb;
+	struct assoofs_sb_info *sbi = sb->s_fs_info;
+
+	// declare some variables
+	struct assoofs_write_batch batch;
+	struct buffer_head *bh;
+	char *buffer;
+	loff_t *pos = &iocb->ki_pos;
+	size_t len = iov_iter_count(from);
+	uint64_t size;
+	int stored = 0;
+	ssize_t code = len;
+
+	// verify the file still fits in a cluster
+	if (*pos + len > ASSOOFS_CLUSTER_SIZE) {
+
+		error("Cant write to disk: File size after write exceeds cluster size\n");
+		return -EFBIG;
+	}
+
+	// get the file block (if it is not a hole)
+	bh = NULL;
+	buffer = NULL;
+
+	if (inode->data_block_number && !(buffer = (char *) read_block(sb, &bh, inode->data_block_number)))
+		return -EIO;
+
+	mutex_lock(&sbi->compress_lock);
+
+	if (!assoofs_get_compressor(sb, sbi->compress ? sbi->compress : ASSOOFS_COMPRESS_LZ4)) {
+
+		code = -ENOMEM;
+		goto out;
+	}
+
+	// load the current contents of the cluster
+	if (inode->mode & ASSOOFS_INODE_COMPRESSED) {
+
+		if (assoofs_decompress(sb, buffer) != inode->file_size) {
+
+			error1("Cant write to disk: Corrupted compressed cluster on block %llu\n", inode->data_block_number);
+			code = -EIO;
+			goto out;
+		}
+
+	} else if (buffer) {
+
+		memcpy(sbi->cluster, buffer, inode->file_size);
+
+	} else {
+
+		memset(sbi->cluster, 0, inode->file_size);
+	}
+
+	// fill the gap after the end of the file with zeros
+	if (*pos > inode->file_size)
+		memset(sbi->cluster + inode->file_size, 0, *pos - inode->file_size);
+
+	// copy the userspace buffer to the cluster
+	if (!copy_from_iter_full(sbi->cluster + *pos, len, from)) {
+
+		error("Error copying userspace buffer to the file buffer\n");
+		code = -EFAULT;
+		goto out;
+	}
+
+	size = max_t(uint64_t, inode->file_size, *pos + len);
+
+	// try to compress it, unless it was found to be incompressible and still fits in a block
+	if (!(inode->mode & ASSOOFS_INODE_NOCOMPRESS) || size > ASSOOFS_BLOCK_SIZE)
+		stored = assoofs_compress(sb, sbi->cluster, size);
+
+	if (stored <= 0 && size > ASSOOFS_BLOCK_SIZE) {
+
+		error("Cant write to disk: File does not compress into a block\n");
+		code = -EFBIG;
+		goto out;
+	}
+
+	if (mutex_lock_interruptible(&assoofs_super_lock)) {
+
+		error("Failed to acquire superblock mutex\n");
+		code = -EINTR;
+		goto out;
+	}
+	if (mutex_lock_interruptible(&assoofs_inode_lock)) {
+
+		error("Failed to acquire inode store mutex\n");
+		mutex_unlock(&assoofs_super_lock);
+		code = -EINTR;
+		goto out;
+	}
+
+	// the data block and the metadata are written together, and waited for without the locks (so writes to other members go on meanwhile)
+	assoofs_start_writes(sb, &batch);
+
+	// never modify a block shared with other files, and fill holes with a new block
+	bh = bh ? assoofs_cow_block(sb, inode, bh) : assoofs_alloc_data_block(sb, inode);
+
+	if (!bh) {
+
+		assoofs_submit_writes(sb);
+		mutex_unlock(&assoofs_super_lock);
+		mutex_unlock(&assoofs_inode_lock);
+		assoofs_wait_writes(&batch);
+		code = -ENOSPC;
+		goto out;
+	}
+
+	if (stored > 0) {
+
+		memcpy(bh->b_data, sbi->cluster_disk, stored);
+		inode->mode = (inode->mode | ASSOOFS_INODE_COMPRESSED) & ~ASSOOFS_INODE_NOCOMPRESS;
+
+	} else {
+
+		// store it as is, remembering the compression failed
+		stored = size;
+		memcpy(bh->b_data, sbi->cluster, size);
+		inode->mode = (inode->mode | ASSOOFS_INODE_NOCOMPRESS) & ~ASSOOFS_INODE_COMPRESSED;
+	}
+
+	// update the current position and the inode information
+	*pos += len;
+	inode->file_size = size;
+	i_size_write(file_inode(file), size);
+
+	// write changes to disk (or share an identical block)
+	bh = assoofs_store_block(sb, inode, bh, stored);
+
+	if (assoofs_save_inode(sb, inode)) {
+
+		error("Cant write to disk: Error saving the inode\n");
+		code = -EIO;
+	}
+
+	assoofs_submit_writes(sb);
+
+	mutex_unlock(&assoofs_super_lock);
+	mutex_unlock(&assoofs_inode_lock);
+
+	if (assoofs_wait_writes(&batch) && code > 0)
+		code = -EIO;
+
+	info3("Written %lu bytes to file '%s' (%s)\n", len, file->f_path.dentry->d_name.name, (inode->mode & ASSOOFS_INODE_COMPRESSED) ? "compressed" : "uncompressed");
+
+out:
+	// release resources and return the amount of bytes written
+	mutex_unlock(&sbi->compress_lock);
+	brelse(bh);
+	return code;
+}
+
+/**
+ * Get the range lock chunks covering some bytes of a file
+ */
+static uint64_t assoofs_range_mask(loff_t pos, size_t len) {
+
+	uint64_t first = pos / ASSOOFS_RANGE_CHUNK;
+	uint64_t last = (pos + len - 1) / ASSOOFS_RANGE_CHUNK;
+
+	return (~0ULL >> (63 - last)) & (~0ULL << first);
+}
+
+/**
+ * Lock some chunks of a file for reading (shared) or writing, returning whether they were locked
+ */
+static bool assoofs_try_lock_range(struct assoofs_sb_info *sbi, uint64_t inode_no, uint64_t range, bool shared) {
+
+	uint64_t *locked = &sbi->range_locks[inode_no - 1];
+	uint64_t *read = &sbi->range_shared[inode_no - 1];
+	u16 *readers = sbi->range_readers[inode_no - 1];
+	uint64_t chunks;
+	bool free;
+
+	spin_lock(&sbi->range_lock);
+
+	// readers only wait for writers, and writers wait for both
+	free = !(*locked & range) && (shared || !(*read & range));
+
+	for (chunks = range; free && shared && chunks; chunks &= chunks - 1)
+		free = readers[__ffs64(chunks)] != U16_MAX;
+
+	if (free && shared) {
+
+		for (chunks = range; chunks; chunks &= chunks - 1)
+			readers[__ffs64(chunks)]++;
+
+		*read |= range;
+
+	} else if (free) {
+
+		*locked |= range;
+	}
+
+	spin_unlock(&sbi->range_lock);
+
+	return free;
+}
+
+/**
+ * Lock some chunks of a file for reading (shared) or writing, waiting for the writers (or readers) using any of them
+ */
+static void assoofs_lock_range(struct assoofs_sb_info *sbi, uint64_t inode_no, uint64_t range, bool shared) {
+
+	wait_event(sbi->range_wait, assoofs_try_lock_range(sbi, inode_no, range, shared));
+}
+
+/**
+ * Unlock some chunks of a file, waking up the readers and writers waiting for them
+ */
+static void assoofs_unlock_range(struct assoofs_sb_info *sbi, uint64_t inode_no, uint64_t range, bool shared) {
+
+	u16 *readers = sbi->range_readers[inode_no - 1];
+	uint64_t chunks;
+
+	spin_lock(&sbi->range_lock);
+
+	if (shared) {
+
+		// a chunk stays shared until its last reader leaves
+		for (chunks = range; chunks; chunks &= chunks - 1)
+			if (!--readers[__ffs64(chunks)])
+				sbi->range_shared[inode_no - 1] &= ~(1ULL << __ffs64(chunks));
+
+	} else {
+
+		sbi->range_locks[inode_no - 1] &= ~range;
+	}
+
+	spin_unlock(&sbi->range_lock);
+
+	wake_up_all(&sbi->range_wait);
+}
+
+/*
+ * Copy a range between files without going through userspace, sharing the data block if the whole file is copied
+ */
+static ssize_t assoofs_copy_file_range(struct file *file_in, loff_t pos_in, struct file *file_out, loff_t pos_out, size_t len, unsigned int flags) {
+
+	// declare and get the assoofs inodes
+	struct assoofs_inode *src = file_inode(file_in)->i_private;
+	struct assoofs_inode *dst = file_inode(file_out)->i_private;
+
+	// declare some variables
+	struct kiocb kiocb;
+	struct kvec kvec;
+	struct iov_iter iter;
+	char *buffer;
+	ssize_t code;
+
+	if (file_inode(file_in)->i_sb != file_inode(file_out)->i_sb)
+		return -EXDEV;
+
+	// whole files are cloned
+	if (!pos_in && !pos_out && len == src->file_size && dst->file_size <= src->file_size)
+		return assoofs_remap_file_range(file_in, pos_in, file_out, pos_out, len, 0);
+
+	// the rest go through a kernel buffer
+	len = min_t(size_t, len, ASSOOFS_CLUSTER_SIZE);
+	buffer = kvmalloc(len, GFP_KERNEL);
+	if (!buffer) return -ENOMEM;
+
+	kvec.iov_base = buffer;
+	kvec.iov_len = len;
+
+	init_sync_kiocb(&kiocb, file_in);
+	kiocb.ki_pos = pos_in;
+	iov_iter_kvec(&iter, READ, &kvec, 1, len);
+
+	code = assoofs_read_iter(&kiocb, &iter);
+
+	if (code > 0) {
+
+		kvec.iov_len = code;
+
+		init_sync_kiocb(&kiocb, file_out);
+		kiocb.ki_pos = pos_out;
+		iov_iter_kvec(&iter, WRITE, &kvec, 1, code);
+
+		code = assoofs_write_iter(&kiocb, &iter);
+	}
+
+	kvfree(buffer);
+	return code;
+}
+
+/*
+ * Clone (or deduplicate) a whole file, sharing its data block instead of copying it
+ */
+static loff_t assoofs_remap_file_range(struct file *file_in, loff_t pos_in, struct file *file_out, loff_t pos_out, loff_t len, unsigned int remap_flags) {
+
+	// declare and get the inodes (linux and assoofs) and the superblock
+	struct inode *inode_in = file_inode(file_in);
+	struct inode *inode_out = file_inode(file_out);
+	struct assoofs_inode *src = inode_in->i_private;
+	struct assoofs_inode *dst = inode_out->i_private;
+	struct super_block *sb = inode_in->i_sb;
+
+	// declare some variables
+	uint64_t numbers[2];
+	struct buffer_head *bhs[2];
+	char *src_block;
+	char *dst_block;
+	loff_t code;
+
+	info3("Remapping inode %llu to inode %llu (flags %u)\n", src->inode_no, dst->inode_no, remap_flags);
+
+	if (remap_flags & ~(REMAP_FILE_DEDUP | REMAP_FILE_CAN_SHORTEN))
+		return -EINVAL;
+
+	// sharing the source block stops its writers from writing in place, and the target gets a new block
+	lock_two_nondirectories(inode_in, inode_out);
+
+	// the generic checks (immutable and append-only files, swapfiles, offset limits, a length of zero going up to the end of the source)
+	// NOTE: the generic preparation compares the contents to deduplicate through the page cache, which assoofs files dont use, so dedup only gets its checks here (the blocks are compared below)
+	if (remap_flags & REMAP_FILE_DEDUP)
+		code = IS_IMMUTABLE(inode_out) ? -EPERM : (IS_SWAPFILE(inode_in) || IS_SWAPFILE(inode_out)) ? -ETXTBSY : 0;
+	else
+		code = generic_remap_file_range_prep(file_in, pos_in, file_out, pos_out, &len, remap_flags);
+
+	if (code || (!len && (remap_flags & REMAP_FILE_DEDUP))) {
+
+		unlock_two_nondirectories(inode_in, inode_out);
+		return code;
+	}
+
+	// files live in a single block, so only whole files can be shared (a shorter remap can only be empty)
+	if (pos_in || pos_out || len != src->file_size || dst->file_size > src->file_size) {
+
+		unlock_two_nondirectories(inode_in, inode_out);
+
+		if (remap_flags & REMAP_FILE_CAN_SHORTEN)
+			return 0;
+
+		error("Cant remap file: Only whole files can be cloned\n");
+		return -EINVAL;
+	}
+
+	if (src->inode_no == dst->inode_no || (src->data_block_number && src->data_block_number == dst->data_block_number)) {
+
+		unlock_two_nondirectories(inode_in, inode_out);
+		return len;
+	}
+
+	if (mutex_lock_interruptible(&assoofs_super_lock)) {
+
+		error("Failed to acquire superblock mutex\n");
+		unlock_two_nondirectories(inode_in, inode_out);
+		return -EINTR;
+	}
+	if (mutex_lock_interruptible(&assoofs_inode_lock)) {
+
+		error("Failed to acquire inode store mutex\n");
+		mutex_unlock(&assoofs_super_lock);
+		unlock_two_nondirectories(inode_in, inode_out);
+		return -EINTR;
+	}
+
+	// deduplication only shares blocks with the same contents (holes only match holes of the same size)
+	if ((remap_flags & REMAP_FILE_DEDUP) && (!src->data_block_number || !dst->data_block_number)) {
+
+		code = (src->data_block_number || dst->data_block_number || src->file_size != dst->file_size) ? -EBADE : 0;
+		if (code) goto out;
+
+	} else if (remap_flags & REMAP_FILE_DEDUP) {
+
+		// read both blocks together
+		numbers[0] = src->data_block_number;
+		numbers[1] = dst->data_block_number;
+
+		if (assoofs_read_blocks(sb, numbers, 2, bhs)) {
+
+			code = -EIO;
+			goto out;
+		}
+
+		src_block = bhs[0]->b_data;
+		dst_block = bhs[1]->b_data;
+
+		code = 0;
+		if (src->file_size != dst->file_size || (src->mode & ASSOOFS_INODE_COMPRESSED) != (dst->mode & ASSOOFS_INODE_COMPRESSED))
+			code = -EBADE;
+		else if (src->mode & ASSOOFS_INODE_COMPRESSED)
+			code = memcmp(src_block, dst_block, ASSOOFS_BLOCK_SIZE) ? -EBADE : 0;
+		else
+			code = memcmp(src_block, dst_block, src->file_size) ? -EBADE : 0;
+
+		brelse(bhs[1]);
+		brelse(bhs[0]);
+
+		if (code) goto out;
+	}
+
+	// take a reference to the source block (if it is not a hole) before dropping the old one
+	if (src->data_block_number && assoofs_share_block(sb, src->data_block_number)) {
+
+		error("Cant remap file: The share table is full\n");
+		code = -ENOSPC;
+		goto out;
+	}
+
+	assoofs_release_block(sb, dst->data_block_number);
+
+	// the data block stores the data in the format of the source
+	dst->data_block_number = src->data_block_number;
+	dst->file_size = src->file_size;
+	dst->mode = (dst->mode & ~(ASSOOFS_INODE_COMPRESSED | ASSOOFS_INODE_NOCOMPRESS)) | (src->mode & (ASSOOFS_INODE_COMPRESSED | ASSOOFS_INODE_NOCOMPRESS));
+
+	if (assoofs_save_inode(sb, dst)) {
+
+		code = -EIO;
+		goto out;
+	}
+
+	i_size_write(inode_out, dst->file_size);
+	inode_out->i_mtime = inode_out->i_ctime = current_time(inode_out);
+	mark_inode_dirty(inode_out);
+
+	info2("Inode %llu now shares block %llu\n", dst->inode_no, dst->data_block_number);
+	code = len;
+
+out:
+	mutex_unlock(&assoofs_super_lock);
+	mutex_unlock(&assoofs_inode_lock);
+	unlock_two_nondirectories(inode_in, inode_out);
+	return code;
+}
+
+/*
+ * Move the position of a file, finding its data and holes
+ */
+static loff_t assoofs_llseek(struct file *file, loff_t offset, int whence) {
+
+	// declare and get the assoofs inode
+	struct assoofs_inode *inode = file_inode(file)->i_private;
+
+	switch (whence) {
+
+		// files are either a single hole (without data block) or data up to their end
+		case SEEK_DATA:
+			if (offset < 0 || offset >= inode->file_size || !inode->data_block_number)
+				return -ENXIO;
+			break;
+
+		// so there is always a hole at the end of the file
+		case SEEK_HOLE:
+			if (offset < 0 || offset >= inode->file_size)
+				return -ENXIO;
+			if (inode->data_block_number)
+				offset = inode->file_size;
+			break;
+
+		default:
+			return generic_file_llseek(file, offset, whence);
+	}
+
+	return vfs_setpos(file, offset, file_inode(file)->i_sb->s_maxbytes);
+}
+
+/*
+ * Handle the ioctls of the filesystem
+ */
+static long assoofs_ioctl(struct file *file, unsigned int cmd, unsigned long arg) {
+
+	struct super_block *sb = file_inode(file)->i_sb;
+
+	switch (cmd) {
+
+		case FITRIM:
+			return assoofs_trim(sb, (struct fstrim_range __user *) arg);
+
+		case ASSOOFS_IOC_DEFRAG:
+			return assoofs_defrag(file, (struct assoofs_defrag __user *) arg);
+
+		case ASSOOFS_IOC_RESIZE:
+			return assoofs_resize(sb, (uint64_t __user *) arg);
+
+		default:
+			return -ENOTTY;
+	}
+}
+
+/*
+ * Discard the runs of free blocks in a range (FITRIM), returning the number of bytes discarded in the range length
+ */
+static int assoofs_trim(struct super_block *sb, struct fstrim_range __user *argp) {
+
+	struct fstrim_range range;
+	uint64_t first, last, minlen;
+	uint64_t blocks = 0;
+	uint64_t claimed;
+	uint64_t one = 1;
+	uint64_t i;
+
+	if (!capable(CAP_SYS_ADMIN))
+		return -EPERM;
+
+	if (!assoofs_can_discard(sb))
+		return -EOPNOTSUPP;
+
+	if (copy_from_user(&range, argp, sizeof(range)))
+		return -EFAULT;
+
+	// only whole blocks inside the range are discarded
+	first = DIV_ROUND_UP(range.start, ASSOOFS_BLOCK_SIZE);
+	last = min_t(uint64_t, (range.start + range.len) / ASSOOFS_BLOCK_SIZE, ASSOOFS_FILESYSTEM_MAX_OBJECTS);
+	if (range.start + range.len < range.start)
+		last = ASSOOFS_FILESYSTEM_MAX_OBJECTS;
+
+	minlen = max_t(uint64_t, DIV_ROUND_UP(range.minlen, ASSOOFS_BLOCK_SIZE), 1);
+
+	for (i = first; i < last; i++)
+		blocks |= one << i;
+
+	if (mutex_lock_interruptible(&assoofs_super_lock)) {
+
+		error("Failed to acquire superblock mutex\n");
+		return -EINTR;
+	}
+
+	// the reserved blocks are never marked as free, and the blocks being discarded already are
+	claimed = assoofs_claim_discard(sb, blocks);
+
+	mutex_unlock(&assoofs_super_lock);
+
+	// the rest of the filesystem keeps working while the device discards them
+	blocks = assoofs_discard_blocks(sb, claimed, minlen);
+	assoofs_release_discard(sb, claimed);
+
+	info1("Trimmed %llu free blocks\n", blocks);
+
+	range.len = blocks * ASSOOFS_BLOCK_SIZE;
+
+	if (copy_to_user(argp, &range, sizeof(range)))
+		return -EFAULT;
+
+	return 0;
+}
+
+/**
+ * Move the data block of a file (or directory) to the first free block from a goal, so files read together can be placed next to each other
+ */
+static int assoofs_defrag(struct file *file, struct assoofs_defrag __user *argp) {
+
+	// declare and get the inodes (linux and assoofs) and the superblock
+	struct inode *inode = file_inode(file);
+	struct assoofs_inode *assoofs_inode = inode->i_private;
+	struct super_block *sb = inode->i_sb;
+	struct assoofs_sb_info *sbi = sb->s_fs_info;
+
+	// declare some variables
+	struct assoofs_share_entry *entry;
+	struct assoofs_defrag defrag;
+	struct buffer_head *old_bh;
+	struct buffer_head *new_bh;
+	uint64_t old_block;
+	uint64_t block;
+	int code = 0;
+
+	if (!capable(CAP_SYS_ADMIN))
+		return -EPERM;
+
+	if (sb_rdonly(sb))
+		return -EROFS;
+
+	if (copy_from_user(&defrag, argp, sizeof(defrag)))
+		return -EFAULT;
+
+	// no reader or writer can use the block while it moves
+	inode_lock(inode);
+
+	if (mutex_lock_interruptible(&assoofs_super_lock)) {
+
+		error("Failed to acquire superblock mutex\n");
+		inode_unlock(inode);
+		return -EINTR;
+	}
+	if (mutex_lock_interruptible(&assoofs_inode_lock)) {
+
+		error("Failed to acquire inode store mutex\n");
+		mutex_unlock(&assoofs_super_lock);
+		inode_unlock(inode);
+		return -EINTR;
+	}
+
+	old_block = assoofs_inode->data_block_number;
+	defrag.block = old_block;
+
+	// holes have no block to move
+	if (!old_block) goto out;
+
+	// moving a shared block would unshare it
+	entry = assoofs_find_share(sb, old_block);
+
+	if (entry && entry->refcount > 1) {
+
+		code = -EBUSY;
+		goto out;
+	}
+
+	// keep the block if there is no free block closer to the goal
+	block = assoofs_find_free_block(sb, defrag.goal);
+
+	if (!block || (old_block >= defrag.goal && old_block < block))
+		goto out;
+
+	info3("Moving inode %llu from block %llu to block %llu\n", assoofs_inode->inode_no, old_block, block);
+
+	// copy the data to the new block through the buffer cache
+	if (!read_block(sb, &old_bh, old_block)) {
+
+		code = -EIO;
+		goto out;
+	}
+
+	block = assoofs_alloc_block(sb, block);
+	new_bh = assoofs_getblk(sb, block);
+
+	if (!new_bh) {
+
+		assoofs_free_block(sb, block);
+		brelse(old_bh);
+		code = -ENOMEM;
+		goto out;
+	}
+
+	lock_buffer(new_bh);
+	memcpy(new_bh->b_data, old_bh->b_data, ASSOOFS_BLOCK_SIZE);
+	set_buffer_uptodate(new_bh);
+	unlock_buffer(new_bh);
+
+	mark_buffer_dirty(new_bh);
+	sync_dirty_buffer(new_bh);
+
+	brelse(new_bh);
+	brelse(old_bh);
+
+	// switch the inode to the new block with a single write of the inode store
+	assoofs_inode->data_block_number = block;
+
+	if (assoofs_save_inode(sb, assoofs_inode)) {
+
+		assoofs_inode->data_block_number = old_block;
+		assoofs_free_block(sb, block);
+		code = -EIO;
+		goto out;
+	}
+
+	// the hash of the data moves with it
+	if (entry) {
+
+		entry->block = block;
+
+		assoofs_sync_metadata(sb, sbi->share_table_bh);
+	}
+
+	assoofs_free_block(sb, old_block);
+	defrag.block = block;
+
+out:
+	mutex_unlock(&assoofs_super_lock);
+	mutex_unlock(&assoofs_inode_lock);
+	inode_unlock(inode);
+
+	if (!code && copy_to_user(argp, &defrag, sizeof(defrag)))
+		code = -EFAULT;
+
+	return code;
+}
+
+/**
+ * Grow the volume into the space added at the end of the device (the inode store already holds every inode)
+ */
+static int assoofs_resize(struct super_block *sb, uint64_t __user *argp) {
+
+	struct assoofs_sb_info *sbi = sb->s_fs_info;
+	uint64_t device = min_t(uint64_t, assoofs_device_blocks(sb), ASSOOFS_FILESYSTEM_MAX_OBJECTS);
+	uint64_t blocks, old_blocks;
+	uint64_t one = 1;
+	uint64_t i;
+
+	if (!capable(CAP_SYS_ADMIN))
+		return -EPERM;
+
+	if (sb_rdonly(sb))
+		return -EROFS;
+
+	if (get_user(blocks, argp))
+		return -EFAULT;
+
+	// use the whole device (up to the size of the free blocks bitmap) by default
+	if (!blocks)
+		blocks = device;
+
+	if (blocks > ASSOOFS_FILESYSTEM_MAX_OBJECTS)
+		return -EFBIG;
+
+	if (blocks > device)
+		return -ENOSPC;
+
+	if (mutex_lock_interruptible(&assoofs_super_lock)) {
+
+		error("Failed to acquire superblock mutex\n");
+		return -EINTR;
+	}
+
+	old_blocks = assoofs_blocks_count(sbi->sb_disk);
+
+	// shrinking would need to move the data out of the removed blocks first
+	if (blocks < old_blocks) {
+
+		mutex_unlock(&assoofs_super_lock);
+		return -EINVAL;
+	}
+
+	// add the new blocks to the list of free blocks and sync the superblock with disk
+	for (i = old_blocks; i < blocks; i++)
+		sbi->sb_disk->free_blocks |= one << i;
+
+	sbi->sb_disk->free_blocks_count += blocks - old_blocks;
+
+	sbi->sb_disk->blocks_count = blocks;
+	assoofs_sync_super(sb);
+
+	mutex_unlock(&assoofs_super_lock);
+
+	if (blocks != old_blocks)
+		info2("Resized from %llu to %llu blocks\n", old_blocks, blocks);
+
+	return put_user(blocks, argp);
+}
+
+/**
+ * Read a block data from disk printing a message if it can't be read
+ * NOTE: on successful read, it is necessary to release the buffer head after use
+ */
+void *read_block(struct super_block *sb, struct buffer_head **bh, uint64_t number) {
+
+	// read the buffer head (from the member holding the block) and store it
+	struct buffer_head *tmp;
+	uint64_t block = number;
+	struct block_device *bdev = assoofs_map_block(sb, &block);
+
+	tmp = __bread_gfp(bdev, block, sb->s_blocksize, __GFP_MOVABLE);
+
+	// verify the buffer head
+	if (!tmp) {
+
+		// print a message and release the buffer head
+		error1("Error reading block %llu\n", number);
+		brelse(tmp);
+
+		// return NULL to signal the error
+		return NULL;
+	}
+
+	// save the buffer head
+	*bh = tmp;
+
+	// return the requested data
+	return tmp->b_data;
+}
+
+/**
+ * Get a block only if it is already in the buffer cache, without waiting for the disk (NULL if it is not)
+ * NOTE: on success, it is necessary to release the buffer head after use
+ */
+static void *assoofs_read_cached_block(struct super_block *sb, struct buffer_head **bh, uint64_t number) {
+
+	uint64_t block = number;
+	struct block_device *bdev = assoofs_map_block(sb, &block);
+	struct buffer_head *tmp = __find_get_block(bdev, block, sb->s_blocksize);
+
+	if (!tmp) return NULL;
+
+	if (!buffer_uptodate(tmp)) {
+
+		brelse(tmp);
+		return NULL;
+	}
+
+	*bh = tmp;
+	return tmp->b_data;
+}
+
+/**
+ * Read several blocks at once, merging adjacent ones into multi-block bios submitted together and waiting once for all of them
+ * (the bios for different members of a striped volume are in flight at the same time)
+ * NOTE: on success, it is necessary to release the buffer heads after use (on failure they are already released)
+ */
+static int assoofs_read_blocks(struct super_block *sb, const uint64_t *numbers, unsigned int count, struct buffer_head **bhs) {
+
+	struct assoofs_read_batch batch;
+	struct buffer_head **order;
+	struct buffer_head *bh;
+	struct bio *bio = NULL;
+	struct blk_plug plug;
+	unsigned int queued = 0;
+	unsigned int i;
+
+	order = kmalloc_array(count, sizeof(*order), GFP_NOFS);
+	if (!order) return -ENOMEM;
+
+	// get the buffer heads, keeping the ones not cached
+	for (i = 0; i < count; i++) {
+
+		bhs[i] = assoofs_getblk(sb, numbers[i]);
+
+		if (!bhs[i]) {
+
+			while (i--)
+				brelse(bhs[i]);
+
+			kfree(order);
+			return -ENOMEM;
+		}
+
+		if (!buffer_uptodate(bhs[i]))
+			order[queued++] = bhs[i];
+	}
+
+	// sort them by member and block number, so adjacent blocks end up next to each other
+	sort(order, queued, sizeof(*order), assoofs_cmp_bh, NULL);
+
+	atomic_set(&batch.pending, 1);
+	batch.status = BLK_STS_OK;
+	init_completion(&batch.done);
+
+	blk_start_plug(&plug);
+
+	for (i = 0; i < queued; i++) {
+
+		bh = order[i];
+
+		// skip repeated blocks, and the ones read by someone else meanwhile
+		if (i && bh == order[i - 1]) {
+
+			order[i] = NULL;
+			continue;
+		}
+
+		lock_buffer(bh);
+
+		if (buffer_uptodate(bh)) {
+
+			unlock_buffer(bh);
+			order[i] = NULL;
+			continue;
+		}
+
+		// start a new bio unless the block follows the last one (on the same member)
+		if (bio && (bh->b_bdev != bio->bi_bdev || bh->b_blocknr != bio_end_sector(bio) / (bh->b_size >> 9) || !bio_add_page(bio, bh->b_page, bh->b_size, bh_offset(bh)))) {
+
+			submit_bio(bio);
+			bio = NULL;
+		}
+
+		if (!bio) {
+
+			bio = assoofs_alloc_bio(sb, &batch, bh, min_t(unsigned int, queued - i, BIO_MAX_VECS));
+			bio_add_page(bio, bh->b_page, bh->b_size, bh_offset(bh));
+		}
+	}
+
+	if (bio)
+		submit_bio(bio);
+
+	blk_finish_plug(&plug);
+
+	// wait once for all of them
+	if (!atomic_dec_and_test(&batch.pending))
+		wait_for_completion(&batch.done);
+
+	for (i = 0; i < queued; i++) {
+
+		if (!order[i]) continue;
+
+		if (batch.status == BLK_STS_OK)
+			set_buffer_uptodate(order[i]);
+
+		unlock_buffer(order[i]);
+	}
+
+	kfree(order);
+
+	if (batch.status != BLK_STS_OK) {
+
+		error1("Error reading %u blocks\n", count);
+
+		for (i = 0; i < count; i++)
+			brelse(bhs[i]);
+
+		return -EIO;
+	}
+
+	return 0;
+}
+
+/**
+ * Compare two buffer heads by member and block number (for sort)
+ */
+static int assoofs_cmp_bh(const void *a, const void *b) {
+
+	struct block_device *bdev_a = (*(struct buffer_head * const *) a)->b_bdev;
+	struct block_device *bdev_b = (*(struct buffer_head * const *) b)->b_bdev;
+	sector_t block_a = (*(struct buffer_head * const *) a)->b_blocknr;
+	sector_t block_b = (*(struct buffer_head * const *) b)->b_blocknr;
+
+	if (bdev_a != bdev_b)
+		return (bdev_a > bdev_b) - (bdev_a < bdev_b);
+
+	return (block_a > block_b) - (block_a < block_b);
+}
+
+/**
+ * Create a bio of a batch of reads, starting at the block of a buffer head
+ */
+static struct bio *assoofs_alloc_bio(struct super_block *sb, struct assoofs_read_batch *batch, struct buffer_head *bh, unsigned int nr_vecs) {
+
+	struct bio *bio;
+
+	// bio allocations with GFP_NOIO never fail
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 18, 0)
+	bio = bio_alloc(bh->b_bdev, nr_vecs, REQ_OP_READ, GFP_NOIO);
+#else
+	bio = bio_alloc(GFP_NOIO, nr_vecs);
+	bio_set_dev(bio, bh->b_bdev);
+	bio->bi_opf = REQ_OP_READ;
+#endif
+
+	bio->bi_iter.bi_sector = bh->b_blocknr * (bh->b_size >> 9);
+	bio->bi_end_io = assoofs_end_read;
+	bio->bi_private = batch;
+
+	atomic_inc(&batch->pending);
+	return bio;
+}
+
+/**
+ * End a bio of a batch of reads, waking up the reader after the last one
+ */
+static void assoofs_end_read(struct bio *bio) {
+
+	struct assoofs_read_batch *batch = bio->bi_private;
+
+	if (bio->bi_status)
+		WRITE_ONCE(batch->status, bio->bi_status);
+
+	if (atomic_dec_and_test(&batch->pending))
+		complete(&batch->done);
+
+	bio_put(bio);
+}
+
+/**
+ * Get the number of blocks the device (or the members of a striped volume) can hold
+ */
+static uint64_t assoofs_device_blocks(struct super_block *sb) {
+
+	struct assoofs_sb_info *sbi = sb->s_fs_info;
+	uint64_t blocks = i_size_read(sb->s_bdev->bd_inode) / ASSOOFS_BLOCK_SIZE;
+	unsigned int i;
+
+	if (!sbi->members_count)
+		return blocks;
+
+	// the smallest member limits every row of stripes
+	for (i = 1; i < sbi->members_count; i++)
+		blocks = min_t(uint64_t, blocks, i_size_read(sbi->members[i]->bd_inode) / ASSOOFS_BLOCK_SIZE);
+
+	return assoofs_stripe_capacity(sbi->sb_disk, blocks);
+}
+
+/**
+ * Write the pinned superblock to disk
+ */
+void assoofs_sync_super(struct super_block *sb) {
+
+	struct assoofs_sb_info *sbi = sb->s_fs_info;
+
+	assoofs_sync_metadata(sb, sbi->sb_bh);
+}
+
+/**
+ * Write the pinned inode store to disk
+ */
+void assoofs_sync_inode_store(struct super_block *sb) {
+
+	struct assoofs_sb_info *sbi = sb->s_fs_info;
+
+	assoofs_sync_metadata(sb, sbi->inode_store_bh);
+}
+
+/**
+ * Write a metadata block to disk (only marking it dirty if the flusher writes the metadata, see metadata=writeback)
+ */
+static void assoofs_sync_metadata(struct super_block *sb, struct buffer_head *bh) {
+
+	struct assoofs_sb_info *sbi = sb->s_fs_info;
+
+	mark_buffer_dirty(bh);
+
+	if (!sbi->writeback)
+		assoofs_write_buffer(sb, bh);
+}
+
+/**
+ * Start collecting the block writes of the current task, so they are submitted together (see assoofs_submit_writes)
+ * NOTE: the superblock lock must be held until they are submitted
+ */
+static void assoofs_start_writes(struct super_block *sb, struct assoofs_write_batch *batch) {
+
+	struct assoofs_sb_info *sbi = sb->s_fs_info;
+
+	batch->count = 0;
+	sbi->batch = batch;
+	sbi->batch_owner = current;
+}
+
+/**
+ * Write a block to disk, or add it to the batch of the current task if it is collecting its writes
+ */
+static void assoofs_write_buffer(struct super_block *sb, struct buffer_head *bh) {
+
+	struct assoofs_sb_info *sbi = sb->s_fs_info;
+	struct assoofs_write_batch *batch;
+	unsigned int i;
+
+	mark_buffer_dirty(bh);
+
+	// the rest of the tasks never see their own batch here, so they write right away
+	if (sbi->batch_owner != current) {
+
+		sync_dirty_buffer(bh);
+		return;
+	}
+
+	batch = sbi->batch;
+
+	for (i = 0; i < batch->count; i++)
+		if (batch->bhs[i] == bh)
+			return;
+
+	if (batch->count == ASSOOFS_WRITE_BATCH) {
+
+		sync_dirty_buffer(bh);
+		return;
+	}
+
+	get_bh(bh);
+	batch->bhs[batch->count++] = bh;
+}
+
+/**
+ * Submit the block writes collected by the current task, all of them under the same plug (the bios for different members of a striped volume are in flight at the same time)
+ * NOTE: the superblock lock must still be held (so the blocks are written as the task left them), and the writes must be waited for afterwards (see assoofs_wait_writes)
+ */
+static void assoofs_submit_writes(struct super_block *sb) {
+
+	struct assoofs_sb_info *sbi = sb->s_fs_info;
+	struct assoofs_write_batch *batch = sbi->batch;
+	struct blk_plug plug;
+	unsigned int i;
+
+	sbi->batch_owner = NULL;
+	sbi->batch = NULL;
+
+	blk_start_plug(&plug);
+
+	for (i = 0; i < batch->count; i++)
+		write_dirty_buffer(batch->bhs[i], REQ_SYNC);
+
+	blk_finish_plug(&plug);
+}
+
+/**
+ * Wait once for all the block writes of a batch, releasing them (returns -EIO if any of them failed)
+ * NOTE: it is meant to be called without the locks, so other tasks can submit their writes meanwhile
+ */
+static int assoofs_wait_writes(struct assoofs_write_batch *batch) {
+
+	struct buffer_head *bh;
+	unsigned int i;
+	int code = 0;
+
+	for (i = 0; i < batch->count; i++) {
+
+		bh = batch->bhs[i];
+		wait_on_buffer(bh);
+
+		if (!buffer_uptodate(bh))
+			code = -EIO;
+
+		brelse(bh);
+	}
+
+	return code;
+}
+
+/**
+ * Update an inode on disk
+ */
+int assoofs_save_inode(struct super_block *sb, struct assoofs_inode *assoofs_inode) {
+
+	// declare the variables
+	struct assoofs_sb_info *sbi = sb->s_fs_info;
+	struct assoofs_inode *inode_iterator;
+	uint64_t count = 0;
+	uint64_t inode_num;
+
+	info1("Updating inode %llu\n", assoofs_inode->inode_no);
+
+	// get the number of inodes
+	inode_num = sbi->sb_disk->inodes_count;
+
+	// get the pinned inode store
+	inode_iterator = sbi->inode_store;
+
+	// search for the inode to update
+	info2("Searching inode %llu, starting from inode %llu\n", assoofs_inode->inode_no, inode_iterator->inode_no);
+
+	// iterate until its found or there are no more inodes
+	while ((inode_iterator->inode_no != assoofs_inode->inode_no) && (count < inode_num)) {
+		
+		count++;
+
+		// move to the next inode
+		inode_iterator++;
+	}
+
+	// exit if the inode is not found
+	if (inode_iterator->inode_no != assoofs_inode->inode_no) {
+
+		error1("Cant update inode to disk: Inode %llu not found\n", assoofs_inode->inode_no);
+		return -2;
+	}
+
+	info1("Inode %llu found\n", assoofs_inode->inode_no);
+
+	// store the inode and save to disk
+	memcpy(inode_iterator, assoofs_inode, sizeof(*inode_iterator));
+	assoofs_sync_inode_store(sb);
+
+	info1("Inode %llu updated\n", assoofs_inode->inode_no);
+
+	return 0;
+}
+
+/**
+ * Get an inode from the store with the specified number (if exists)
+ */
+struct assoofs_inode *assoofs_get_inode(struct super_block *sb, uint64_t inode_num) {
+
+	// declare get the superblock
+	struct assoofs_sb_info *sbi = sb->s_fs_info;
+	struct assoofs_super_block *assoofs_sb = sbi->sb_disk;
+
+	// prepare a default value to return
+	struct assoofs_inode *inode_buffer = NULL;
+
+	// declare some variables
+	struct assoofs_inode *assoofs_inode;
+	int i;
+
+	info1("Getting inode number %llu\n", inode_num);
+
+	// get the pinned inode store
+	assoofs_inode = sbi->inode_store;
+
+	// iterate over all inodes until the requested inode is found
+	for (i = 0; i < assoofs_sb->inodes_count; i++) {
+
+		// when found, copy it to the buffer, and exit the loop
+		if (assoofs_inode->inode_no == inode_num) {
+
+			info1("Inode %llu found\n", inode_num);
+
+			inode_buffer = kmalloc(sizeof(struct assoofs_inode), GFP_KERNEL);
+			memcpy(inode_buffer, assoofs_inode, sizeof(*inode_buffer));
+
+			break;
+		}
+
+		// change to the next inode
+		assoofs_inode++;
+	}
+
+
+	if (inode_buffer == NULL) 
+		error1("Inode %llu not found\n", inode_num);
+
+	// return the requested inode
+	return inode_buffer;
+}
+
+/**
+ * Free an inode that is no longer linked, releasing its data block and clearing its slot for the next create
+ * NOTE: the superblock and the inode store locks must be held
+ */
+static void assoofs_free_inode(struct super_block *sb, uint64_t inode_no) {
+
+	struct assoofs_sb_info *sbi = sb->s_fs_info;
+	struct assoofs_inode *slot = sbi->inode_store;
+	struct assoofs_dir_index *index;
+	uint64_t i;
+
+	for (i = 0; i < sbi->sb_disk->inodes_count && slot->inode_no != inode_no; i++, slot++);
+
+	if (i == sbi->sb_disk->inodes_count) {
+
+		error1("Cant free inode %llu: Inode not found\n", inode_no);
+		return;
+	}
+
+	info1("Freeing inode %llu\n", inode_no);
+
+	// drop the reference to its block (shared blocks stay with their other users), the slot is written after it
+	assoofs_release_block(sb, slot->data_block_number);
+
+	// a replaced directory is empty, but it can still have an index
+	mutex_lock(&sbi->index_lock);
+
+	index = rcu_dereference_protected(sbi->dir_index[inode_no - 1], lockdep_is_held(&sbi->index_lock));
+	if (index) {
+
+		RCU_INIT_POINTER(sbi->dir_index[inode_no - 1], NULL);
+		sbi->index_count--;
+	}
+
+	mutex_unlock(&sbi->index_lock);
+
+	if (index)
+		assoofs_retire_index(index);
+
+	// clear the slot, with its bloom filter or inline symlink target
+	memset(assoofs_bloom(sbi->inode_store, inode_no), 0, ASSOOFS_BLOOM_SIZE);
+	memset(slot, 0, sizeof(*slot));
+	sbi->sb_disk->free_inodes_count++;
+
+	assoofs_sync_inode_store(sb);
+	assoofs_sync_super(sb);
+}
+
+/**
+ * Set the timestamps of a linux inode from the timestamps block (or from the creation time if there is none)
+ */
+static void assoofs_load_times(struct inode *inode) {
+
+	struct assoofs_sb_info *sbi = inode->i_sb->s_fs_info;
+	struct assoofs_inode *assoofs_inode = inode->i_private;
+	struct assoofs_times *times;
+
+	if (!sbi->times) {
+
+		inode->i_atime = assoofs_inode->time;
+		inode->i_mtime = assoofs_inode->time;
+		inode->i_ctime = assoofs_inode->time;
+		return;
+	}
+
+	times = sbi->times + assoofs_inode->inode_no - 1;
+
+	lock_buffer(sbi->times_bh);
+
+	inode->i_atime = times->atime;
+	inode->i_mtime = times->mtime;
+	inode->i_ctime = times->ctime;
+
+	unlock_buffer(sbi->times_bh);
+}
+
+
+/**
+ * Set up the linux inode of a symlink, pointing short ones to their target in the (pinned) inode store
+ */
+static void assoofs_init_link(struct inode *inode) {
+
+	struct assoofs_sb_info *sbi = inode->i_sb->s_fs_info;
+	struct assoofs_inode *assoofs_inode = inode->i_private;
+
+	inode->i_size = assoofs_inode->file_size;
+
+	if (assoofs_inode->data_block_number) {
+
+		inode->i_op = &assoofs_symlink_ops;
+		return;
+	}
+
+	inode->i_op = &assoofs_fast_symlink_ops;
+	inode->i_link = assoofs_inline_link(sbi->inode_store, assoofs_inode->inode_no);
+}
+
+/**
+ * Find the position of a filename inside the records of a directory (or -1 if it is not present)
+ */
+static int assoofs_find_record(struct assoofs_dir_record_entry *record, uint64_t count, const char *filename) {
+
+	int i;
+
+	for (i = 0; i < count; i++)
+		if (!strcmp(record[i].filename, filename))
+			return i;
+
+	return -1;
+}
+
+/**
+ * Rebuild the bloom filter of a directory from its records
+ * NOTE: the inode store lock must be held (or the filesystem being mounted)
+ */
+static void assoofs_fill_bloom(struct super_block *sb, uint64_t inode_no, struct assoofs_dir_record_entry *record, uint64_t count) {
+
+	uint8_t *bloom = assoofs_bloom(((struct assoofs_sb_info *) sb->s_fs_info)->inode_store, inode_no);
+
+	memset(bloom, 0, ASSOOFS_BLOOM_SIZE);
+
+	for (; count; count--, record++)
+		assoofs_bloom_add(bloom, record->filename, strlen(record->filename));
+}
+
+/**
+ * Hash a filename for the directory indexes
+ */
+static u32 assoofs_dir_hash(const void *data, u32 len, u32 seed) {
+
+	return jhash(data, strlen(data), seed);
+}
+
+/**
+ * Hash the filename of a directory index entry
+ */
+static u32 assoofs_dir_obj_hash(const void *data, u32 len, u32 seed) {
+
+	return assoofs_dir_hash(((const struct assoofs_dir_entry *) data)->filename, len, seed);
+}
+
+/**
+ * Compare a filename with a directory index entry (0 if they match)
+ */
+static int assoofs_dir_cmp(struct rhashtable_compare_arg *arg, const void *obj) {
+
+	return strcmp(arg->key, ((const struct assoofs_dir_entry *) obj)->filename);
+}
+
+/**
+ * Create a directory index entry (or NULL if there is no memory)
+ */
+static struct assoofs_dir_entry *assoofs_new_dir_entry(const char *filename, uint64_t inode_no) {
+
+	size_t len = strlen(filename);
+	struct assoofs_dir_entry *entry = kmalloc(sizeof(*entry) + len + 1, GFP_KERNEL);
+
+	if (!entry) return NULL;
+
+	entry->inode_no = inode_no;
+	memcpy(entry->filename, filename, len + 1);
+
+	return entry;
+}
+
+/**
+ * Free a directory index entry (called when destroying an index)
+ */
+static void assoofs_free_dir_entry(void *ptr, void *arg) {
+
+	kfree(ptr);
+}
+
+/**
+ * Destroy a directory index
+ * NOTE: it must be unreachable for the readers (unpublished and after a grace period)
+ */
+static void assoofs_destroy_index(struct assoofs_dir_index *index) {
+
+	rhashtable_free_and_destroy(&index->table, assoofs_free_dir_entry, NULL);
+	kfree(index);
+}
+
+/**
+ * Destroy an unpublished directory index once the lockless readers are done with it, without waiting for them
+ * NOTE: destroying the table can sleep, so it is done from a workqueue instead of an rcu callback
+ */
+static void assoofs_retire_index(struct assoofs_dir_index *index) {
+
+	INIT_RCU_WORK(&index->free_work, assoofs_free_index_work);
+	queue_rcu_work(assoofs_index_wq, &index->free_work);
+}
+
+/**
+ * Destroy a retired directory index (after its grace period)
+ */
+static void assoofs_free_index_work(struct work_struct *work) {
+
+	assoofs_destroy_index(container_of(to_rcu_work(work), struct assoofs_dir_index, free_work));
+}
+
+/**
+ * Build the in-memory index of a directory from its records, publishing it unless another one was built first
+ * NOTE: the directory must be locked by the vfs (so its records dont change)
+ */
+static void assoofs_build_index(struct super_block *sb, struct assoofs_inode *dir, struct assoofs_dir_record_entry *record) {
+
+	struct assoofs_sb_info *sbi = sb->s_fs_info;
+	struct assoofs_dir_index *index;
+	struct assoofs_dir_entry *entry;
+	uint64_t i;
+
+	// the lookups of the directories over the limit keep reading their block
+	if (READ_ONCE(sbi->index_count) >= READ_ONCE(sbi->index_max))
+		return;
+
+	index = kzalloc(sizeof(*index), GFP_KERNEL);
+	if (!index) return;
+
+	if (rhashtable_init(&index->table, &assoofs_dir_params)) {
+
+		kfree(index);
+		return;
+	}
+
+	for (i = 0; i < dir->dir_children_count; i++, record++) {
+
+		entry = assoofs_new_dir_entry(record->filename, record->inode_no);
+
+		if (!entry || rhashtable_insert_fast(&index->table, &entry->node, assoofs_dir_params)) {
+
+			// the lookups keep reading the directory block
+			kfree(entry);
+			assoofs_destroy_index(index);
+			return;
+		}
+	}
+
+	mutex_lock(&sbi->index_lock);
+
+	if (rcu_access_pointer(sbi->dir_index[dir->inode_no - 1]) || sbi->index_count >= sbi->index_max) {
+
+		mutex_unlock(&sbi->index_lock);
+		assoofs_destroy_index(index);
+		return;
+	}
+
+	rcu_assign_pointer(sbi->dir_index[dir->inode_no - 1], index);
+	sbi->index_count++;
+
+	mutex_unlock(&sbi->index_lock);
+
+	info2("Built the index of inode %llu (%llu entries)\n", dir->inode_no, dir->dir_children_count);
+}
+
+/**
+ * Look up a filename in the in-memory index of a directory without locks, setting indexed if the directory has one
+ * Returns the inode number (or 0 if it is not found)
+ */
+static uint64_t assoofs_index_lookup(struct super_block *sb, struct assoofs_inode *dir, const char *filename, bool *indexed) {
+
+	struct assoofs_sb_info *sbi = sb->s_fs_info;
+	struct assoofs_dir_index *index;
+	struct assoofs_dir_entry *entry;
+	uint64_t inode_no = 0;
+
+	rcu_read_lock();
+
+	index = rcu_dereference(sbi->dir_index[dir->inode_no - 1]);
+	*indexed = index;
+
+	if (index) {
+
+		// only write the flag when it changes, keeping the cache line shared between cores
+		if (!READ_ONCE(index->referenced))
+			WRITE_ONCE(index->referenced, true);
+
+		entry = rhashtable_lookup(&index->table, filename, assoofs_dir_params);
+		if (entry)
+			inode_no = READ_ONCE(entry->inode_no);
+	}
+
+	rcu_read_unlock();
+
+	return inode_no;
+}
+
+/**
+ * Update a filename in the in-memory index of a directory (if built), adding it if missing or removing it if the inode number is 0
+ * NOTE: the directory must be locked by the vfs
+ */
+static void assoofs_update_index(struct super_block *sb, uint64_t dir_no, const char *filename, uint64_t inode_no) {
+
+	struct assoofs_sb_info *sbi = sb->s_fs_info;
+	struct assoofs_dir_index *index;
+	struct assoofs_dir_entry *entry;
+
+	mutex_lock(&sbi->index_lock);
+
+	index = rcu_dereference_protected(sbi->dir_index[dir_no - 1], lockdep_is_held(&sbi->index_lock));
+
+	if (!index) {
+
+		mutex_unlock(&sbi->index_lock);
+		return;
+	}
+
+	entry = rhashtable_lookup_fast(&index->table, filename, assoofs_dir_params);
+
+	if (entry && inode_no) {
+
+		WRITE_ONCE(entry->inode_no, inode_no);
+
+	} else if (entry) {
+
+		rhashtable_remove_fast(&index->table, &entry->node, assoofs_dir_params);
+		kfree_rcu(entry, rcu);
+
+	} else if (inode_no) {
+
+		entry = assoofs_new_dir_entry(filename, inode_no);
+
+		if (!entry || rhashtable_insert_fast(&index->table, &entry->node, assoofs_dir_params)) {
+
+			// an index that cant be kept current is dropped, and built again on the next lookup
+			kfree(entry);
+
+			RCU_INIT_POINTER(sbi->dir_index[dir_no - 1], NULL);
+			sbi->index_count--;
+			mutex_unlock(&sbi->index_lock);
+
+			assoofs_retire_index(index);
+			return;
+		}
+	}
+
+	mutex_unlock(&sbi->index_lock);
+}
+
+/**
+ * Get a compressor, allocating it (and the cluster buffers) on first use
+ * NOTE: the compress lock must be held
+ */
+static struct crypto_comp *assoofs_get_compressor(struct super_block *sb, int algorithm) {
+
+	struct assoofs_sb_info *sbi = sb->s_fs_info;
+	struct crypto_comp *tfm;
+
+	if (algorithm <= ASSOOFS_COMPRESS_NONE || algorithm >= ASSOOFS_COMPRESS_ALGORITHMS) {
+
+		error1("Unknown compression algorithm %d\n", algorithm);
+		return NULL;
+	}
+
+	// allocate the cluster buffers
+	if (!sbi->cluster) {
+
+		sbi->cluster = kvmalloc(ASSOOFS_CLUSTER_SIZE, GFP_KERNEL);
+		if (!sbi->cluster) return NULL;
+	}
+	if (!sbi->cluster_disk) {
+
+		sbi->cluster_disk = kmalloc(ASSOOFS_BLOCK_SIZE, GFP_KERNEL);
+		if (!sbi->cluster_disk) return NULL;
+	}
+
+	// allocate the compressor
+	if (!sbi->tfm[algorithm]) {
+
+		tfm = crypto_alloc_comp(assoofs_compress_names[algorithm], 0, 0);
+
+		if (IS_ERR(tfm)) {
+
+			error1("Cant allocate the %s compressor\n", assoofs_compress_names[algorithm]);
+			return NULL;
+		}
+
+		sbi->tfm[algorithm] = tfm;
+	}
+
+	return sbi->tfm[algorithm];
+}
+
+/**
+ * Compress a cluster into the compressed cluster buffer, returning the bytes to store (or 0 if it does not pay off)
+ * NOTE: the compress lock must be held
+ */
+static int assoofs_compress(struct super_block *sb, const char *src, unsigned int len) {
+
+	struct assoofs_sb_info *sbi = sb->s_fs_info;
+	struct assoofs_cluster_header *header = (struct assoofs_cluster_header *) sbi->cluster_disk;
+	int algorithm = sbi->compress ? sbi->compress : ASSOOFS_COMPRESS_LZ4;
+	struct crypto_comp *tfm = assoofs_get_compressor(sb, algorithm);
+	unsigned int size = ASSOOFS_BLOCK_SIZE - sizeof(*header);
+
+	if (!tfm) return 0;
+
+	// the compressor fails if the output does not fit in the block
+	if (crypto_comp_compress(tfm, src, len, (u8 *) (header + 1), &size))
+		return 0;
+
+	// require saving at least an eighth of the data, or it is not worth decompressing on every read
+	if (size + sizeof(*header) > len - len / 8)
+		return 0;
+
+	header->algorithm = algorithm;
+	header->size = size;
+
+	return size + sizeof(*header);
+}
+
+/**
+ * Decompress a data block into the cluster buffer, returning the uncompressed size (or a negative value on error)
+ * NOTE: the compress lock must be held
+ */
+static int assoofs_decompress(struct super_block *sb, const char *block) {
+
+	struct assoofs_sb_info *sbi = sb->s_fs_info;
+	const struct assoofs_cluster_header *header = (const struct assoofs_cluster_header *) block;
+	struct crypto_comp *tfm;
+	unsigned int size = ASSOOFS_CLUSTER_SIZE;
+
+	if (header->size > ASSOOFS_BLOCK_SIZE - sizeof(*header))
+		return -1;
+
+	tfm = assoofs_get_compressor(sb, header->algorithm);
+	if (!tfm) return -1;
+
+	if (crypto_comp_decompress(tfm, (const u8 *) (header + 1), header->size, sbi->cluster, &size))
+		return -1;
+
+	return size;
+}
+
+/**
+ * Find the first free block from a goal block, returning its number (or 0 if there is none)
+ * NOTE: the superblock lock must be held (the blocks being discarded are skipped, as waiting for them here would stall every mount, see assoofs_wait_discard)
+ */
+static uint64_t assoofs_find_free_block(struct super_block *sb, uint64_t goal) {
+
+	struct assoofs_sb_info *sbi = sb->s_fs_info;
+	struct assoofs_super_block *assoofs_sb = sbi->sb_disk;
+	uint64_t busy = atomic64_read(&sbi->discard_busy);
+	uint64_t one = 1;
+	uint64_t i;
+
+	for (i = max_t(uint64_t, goal, ASSOOFS_LAST_RESERVED_BLOCK + 1); i < ASSOOFS_FILESYSTEM_MAX_OBJECTS; i++) {
+
+		// NOTE: the kernel warns about undefined behaviour if the shift is performed on int (32 bits) (by default on all numeric variables)
+		if (assoofs_sb->free_blocks & ~busy & (one << i))
+			return i;
+	}
+
+	return 0;
+}
+
+/**
+ * Allocate a free block (the first one from a goal block), returning its number (or 0 if there are no free blocks)
+ * NOTE: the superblock lock must be held
+ */
+static uint64_t assoofs_alloc_block(struct super_block *sb, uint64_t goal) {
+
+	struct assoofs_sb_info *sbi = sb->s_fs_info;
+	uint64_t block = assoofs_find_free_block(sb, goal);
+	uint64_t one = 1;
+
+	if (!block) return 0;
+
+	// remove it from the list (cancelling its discard) and sync the superblock with disk
+	sbi->sb_disk->free_blocks &= ~(one << block);
+	sbi->sb_disk->free_blocks_count--;
+	sbi->discard_pending &= ~(one << block);
+	assoofs_sync_super(sb);
+
+	return block;
+}
+
+/**
+ * Return a block to the free list
+ * NOTE: the superblock lock must be held
+ */
+static void assoofs_free_block(struct super_block *sb, uint64_t block) {
+
+	struct assoofs_sb_info *sbi = sb->s_fs_info;
+	uint64_t one = 1;
+
+	sbi->sb_disk->free_blocks |= one << block;
+	sbi->sb_disk->free_blocks_count++;
+	assoofs_sync_super(sb);
+
+	// once the free block is on disk, the device can be told (in a batch with the next ones)
+	if (sbi->discard) {
+
+		sbi->discard_pending |= one << block;
+		schedule_delayed_work(&sbi->discard_work, HZ);
+	}
+}
+
+/**
+ * Check if the device (or every member of a striped volume) supports discard
+ */
+static bool assoofs_can_discard(struct super_block *sb) {
+
+	struct assoofs_sb_info *sbi = sb->s_fs_info;
+	unsigned int i;
+
+	for (i = 0; i < max(sbi->members_count, 1u); i++) {
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 19, 0)
+		if (!bdev_max_discard_sectors(sbi->members[i]))
+			return false;
+#else
+		if (!blk_queue_discard(bdev_get_queue(sbi->members[i])))
+			return false;
+#endif
+	}
+
+	return true;
+}
+
+/**
+ * Discard the runs of blocks of a bitmap at least minlen blocks long, returning the number of blocks discarded
+ * NOTE: the blocks must be claimed (see assoofs_claim_discard), and the superblock lock must not be held
+ */
+static uint64_t assoofs_discard_blocks(struct super_block *sb, uint64_t blocks, uint64_t minlen) {
+
+	struct assoofs_sb_info *sbi = sb->s_fs_info;
+	uint64_t one = 1;
+	uint64_t discarded = 0;
+	uint64_t first;
+	uint64_t i = 0;
+	int code;
+
+	if (!blocks)
+		return 0;
+
+	// nothing on disk can point to the blocks before their contents are lost (metadata=writeback leaves the writes to the flusher)
+	sync_dirty_buffer(sbi->sb_bh);
+	sync_dirty_buffer(sbi->inode_store_bh);
+
+	while (i < ASSOOFS_FILESYSTEM_MAX_OBJECTS) {
+
+		// find the next run
+		if (!(blocks & (one << i))) {
+
+			i++;
+			continue;
+		}
+
+		for (first = i; i < ASSOOFS_FILESYSTEM_MAX_OBJECTS && (blocks & (one << i)); i++);
+
+		if (i - first < minlen)
+			continue;
+
+		code = assoofs_issue_discard(sb, first, i - first);
+
+		if (code) {
+
+			error3("Error discarding blocks %llu to %llu (%d)\n", first, i - 1, code);
+			continue;
+		}
+
+		discarded += i - first;
+	}
+
+	return discarded;
+}
+
+/**
+ * Discard the freed blocks in a batch, unless they were allocated again meanwhile
+ */
+static void assoofs_discard_work(struct work_struct *work) {
+
+	struct assoofs_sb_info *sbi = container_of(to_delayed_work(work), struct assoofs_sb_info, discard_work);
+	uint64_t blocks;
+	uint64_t discarded;
+
+	// take the blocks out of the allocator, and discard them without holding the superblock lock
+	mutex_lock(&assoofs_super_lock);
+
+	blocks = assoofs_claim_discard(sbi->sb, sbi->discard_pending);
+	sbi->discard_pending = 0;
+
+	mutex_unlock(&assoofs_super_lock);
+
+	discarded = assoofs_discard_blocks(sbi->sb, blocks, 1);
+	assoofs_release_discard(sbi->sb, blocks);
+
+	info1("Discarded %llu freed blocks\n", discarded);
+}
+
+/**
+ * Keep the free blocks of a bitmap from being allocated while they are discarded, returning the ones claimed
+ * NOTE: the superblock lock must be held (the blocks already being discarded are left out)
+ */
+static uint64_t assoofs_claim_discard(struct super_block *sb, uint64_t blocks) {
+
+	struct assoofs_sb_info *sbi = sb->s_fs_info;
+
+	blocks &= sbi->sb_disk->free_blocks & ~atomic64_read(&sbi->discard_busy);
+	atomic64_or(blocks, &sbi->discard_busy);
+
+	return blocks;
+}
+
+/**
+ * Give the discarded blocks back to the allocator, waking up the allocations waiting for them
+ */
+static void assoofs_release_discard(struct super_block *sb, uint64_t blocks) {
+
+	struct assoofs_sb_info *sbi = sb->s_fs_info;
+
+	if (!blocks)
+		return;
+
+	atomic64_andnot(blocks, &sbi->discard_busy);
+	wake_up_all(&sbi->discard_wait);
+}
+
+/**
+ * Wait for the discards in flight to end, returning whether there were any (so an allocation that found no free block can be retried)
+ * NOTE: the superblock lock must not be held (discards dont need it to end, but every other mount does)
+ */
+static bool assoofs_wait_discard(struct super_block *sb) {
+
+	struct assoofs_sb_info *sbi = sb->s_fs_info;
+	uint64_t busy = atomic64_read(&sbi->discard_busy);
+
+	if (!busy)
+		return false;
+
+	wait_event(sbi->discard_wait, !(atomic64_read(&sbi->discard_busy) & busy));
+	return true;
+}
+
+/**
+ * Get the share table, creating it if requested and not present (returns NULL if there is none)
+ * NOTE: the superblock lock must be held
+ */
+static struct assoofs_share_entry *assoofs_get_share_table(struct super_block *sb, bool create) {
+
+	struct assoofs_sb_info *sbi = sb->s_fs_info;
+	uint64_t block;
+
+	if (sbi->share_table || !create)
+		return sbi->share_table;
+
+	info("Creating the share table\n");
+
+	block = assoofs_alloc_block(sb, 0);
+
+	if (!block) {
+
+		error("Cant create the share table: No more free blocks available\n");
+		return NULL;
+	}
+
+	// start with an empty table
+	sbi->share_table_bh = assoofs_getblk(sb, block);
+
+	if (!sbi->share_table_bh) {
+
+		assoofs_free_block(sb, block);
+		return NULL;
+	}
+
+	lock_buffer(sbi->share_table_bh);
+	memset(sbi->share_table_bh->b_data, 0, ASSOOFS_BLOCK_SIZE);
+	set_buffer_uptodate(sbi->share_table_bh);
+	unlock_buffer(sbi->share_table_bh);
+
+	assoofs_sync_metadata(sb, sbi->share_table_bh);
+
+	// link it from the superblock
+	sbi->share_table = (struct assoofs_share_entry *) sbi->share_table_bh->b_data;
+	sbi->sb_disk->share_table_block = block;
+	assoofs_sync_super(sb);
+
+	return sbi->share_table;
+}
+
+/**
+ * Find the share table entry of a block (or NULL if it has none)
+ * NOTE: the superblock lock must be held
+ */
+static struct assoofs_share_entry *assoofs_find_share(struct super_block *sb, uint64_t block) {
+
+	struct assoofs_share_entry *entry = assoofs_get_share_table(sb, false);
+	int i;
+
+	if (!entry) return NULL;
+
+	for (i = 0; i < ASSOOFS_SHARE_TABLE_ENTRIES; i++, entry++)
+		if (entry->block == block)
+			return entry;
+
+	return NULL;
+}
+
+/**
+ * Drop a reference to a data block, freeing it when it has no more users
+ * NOTE: the superblock lock must be held
+ */
+static void assoofs_release_block(struct super_block *sb, uint64_t block) {
+
+	struct assoofs_sb_info *sbi = sb->s_fs_info;
+	struct assoofs_share_entry *entry;
+
+	// holes have no block to release
+	if (!block) return;
+
+	entry = assoofs_find_share(sb, block);
+
+	if (entry && entry->refcount > 1) {
+
+		entry->refcount--;
+
+	} else {
+
+		if (entry)
+			memset(entry, 0, sizeof(*entry));
+
+		assoofs_free_block(sb, block);
+	}
+
+	if (entry) {
+
+		assoofs_sync_metadata(sb, sbi->share_table_bh);
+	}
+}
+
+/**
+ * Take another reference to a data block (returns -1 if the share table is full)
+ * NOTE: the superblock lock must be held
+ */
+static int assoofs_share_block(struct super_block *sb, uint64_t block) {
+
+	struct assoofs_sb_info *sbi = sb->s_fs_info;
+	struct assoofs_share_entry *entry;
+
+	if (!assoofs_get_share_table(sb, true))
+		return -1;
+
+	entry = assoofs_find_share(sb, block);
+
+	if (entry) {
+
+		if (entry->refcount == U16_MAX)
+			return -1;
+
+		entry->refcount++;
+
+	} else {
+
+		// the block was used by a single inode, and its hash is unknown
+		entry = assoofs_find_share(sb, 0);
+		if (!entry) return -1;
+
+		entry->block = block;
+		entry->refcount = 2;
+	}
+
+	assoofs_sync_metadata(sb, sbi->share_table_bh);
+
+	return 0;
+}
+
+/**
+ * Get the data block of an inode ready to be modified, copying it first if it is shared with other files
+ * The buffer head passed is released, returning the one to use (or NULL if a free block cant be found)
+ * NOTE: the superblock lock must be held, and the inode must be saved afterwards
+ */
+static struct buffer_head *assoofs_cow_block(struct super_block *sb, struct assoofs_inode *inode, struct buffer_head *bh) {
+
+	struct assoofs_share_entry *entry = assoofs_find_share(sb, inode->data_block_number);
+	struct buffer_head *copy;
+	uint64_t block;
+
+	// the block is owned by this file alone
+	if (!entry || entry->refcount <= 1)
+		return bh;
+
+	info2("Copying shared block %llu of inode %llu\n", inode->data_block_number, inode->inode_no);
+
+	block = assoofs_alloc_block(sb, 0);
+
+	if (!block) {
+
+		error("Cant copy shared block: No more free blocks available\n");
+		brelse(bh);
+		return NULL;
+	}
+
+	copy = assoofs_getblk(sb, block);
+
+	if (!copy) {
+
+		assoofs_free_block(sb, block);
+		brelse(bh);
+		return NULL;
+	}
+
+	lock_buffer(copy);
+	memcpy(copy->b_data, bh->b_data, ASSOOFS_BLOCK_SIZE);
+	set_buffer_uptodate(copy);
+	unlock_buffer(copy);
+
+	// drop the reference to the shared block
+	assoofs_release_block(sb, inode->data_block_number);
+	inode->data_block_number = block;
+
+	brelse(bh);
+	return copy;
+}
+
+/**
+ * Give a file without a data block (a hole) a new zeroed block, returning its buffer head (or NULL if a free block cant be found)
+ * NOTE: the superblock lock must be held, and the inode must be saved afterwards
+ */
+static struct buffer_head *assoofs_alloc_data_block(struct super_block *sb, struct assoofs_inode *inode) {
+
+	struct buffer_head *bh;
+	uint64_t block = assoofs_alloc_block(sb, 0);
+
+	if (!block) {
+
+		error("Cant fill hole: No more free blocks available\n");
+		return NULL;
+	}
+
+	bh = assoofs_getblk(sb, block);
+
+	if (!bh) {
+
+		assoofs_free_block(sb, block);
+		return NULL;
+	}
+
+	lock_buffer(bh);
+	memset(bh->b_data, 0, ASSOOFS_BLOCK_SIZE);
+	set_buffer_uptodate(bh);
+	unlock_buffer(bh);
+
+	info2("Inode %llu gets block %llu\n", inode->inode_no, block);
+	inode->data_block_number = block;
+
+	return bh;
+}
+
+/**
+ * Write the data block of an inode to disk, sharing an identical block instead if deduplication is enabled
+ * The buffer head passed is released, returning the one the inode uses now
+ * NOTE: the superblock lock must be held, the block must not be shared (see assoofs_cow_block) and the inode must be saved afterwards
+ */
+static struct buffer_head *assoofs_store_block(struct super_block *sb, struct assoofs_inode *inode, struct buffer_head *bh, unsigned int size) {
+
+	struct assoofs_sb_info *sbi = sb->s_fs_info;
+	struct assoofs_share_entry *entry = assoofs_find_share(sb, inode->data_block_number);
+	struct assoofs_share_entry *iterator;
+	struct buffer_head *candidate_bh;
+	char *candidate;
+	uint64_t hash = 0;
+	int i;
+
+	if (sbi->dedup && size && assoofs_get_share_table(sb, true)) {
+
+		hash = assoofs_hash(bh->b_data, size);
+
+		// look for a block with the same contents
+		iterator = sbi->share_table;
+
+		for (i = 0; i < ASSOOFS_SHARE_TABLE_ENTRIES; i++, iterator++) {
+
+			if (!iterator->block || iterator->block == inode->data_block_number || iterator->hash != hash || iterator->size != size || iterator->refcount == U16_MAX)
+				continue;
+
+			// confirm the match, as hashes can collide
+			candidate = (char *) read_block(sb, &candidate_bh, iterator->block);
+
+			if (!candidate) continue;
+
+			if (memcmp(candidate, bh->b_data, size)) {
+
+				brelse(candidate_bh);
+				continue;
+			}
+
+			info3("Sharing block %llu with inode %llu (instead of block %llu)\n", (uint64_t) iterator->block, inode->inode_no, inode->data_block_number);
+
+			// use the identical block, without writing anything
+			iterator->refcount++;
+			assoofs_release_block(sb, inode->data_block_number);
+			inode->data_block_number = iterator->block;
+
+			assoofs_sync_metadata(sb, sbi->share_table_bh);
+
+			brelse(bh);
+			return candidate_bh;
+		}
+
+		// remember the hash of this block for the next writes
+		if (!entry)
+			entry = assoofs_find_share(sb, 0);
+	}
+
+	// write changes to disk (or add them to the batch of the task)
+	assoofs_write_buffer(sb, bh);
+
+	// keep the share table entry of the block up to date, dropping it if the hash is unknown
+	if (entry) {
+
+		if (hash) {
+
+			entry->block = inode->data_block_number;
+			entry->refcount = 1;
+			entry->hash = hash;
+			entry->size = size;
+
+		} else {
+
+			memset(entry, 0, sizeof(*entry));
+		}
+
+		assoofs_sync_metadata(sb, sbi->share_table_bh);
+	}
+
+	return bh;
+}
+
+/**
+ * Create the debugfs directory of a mount, with the trace ring (trace), the capture switch (capture) and the records lost (dropped)
+ */
+static void assoofs_trace_init(struct super_block *sb) {
+
+	struct assoofs_sb_info *sbi = sb->s_fs_info;
+
+	sbi->debugfs = debugfs_create_dir(sb->s_id, assoofs_debugfs);
+
+	debugfs_create_file("trace", 0400, sbi->debugfs, sbi, &assoofs_trace_fops);
+	debugfs_create_file("capture", 0600, sbi->debugfs, sbi, &assoofs_capture_fops);
+	debugfs_create_u64("dropped", 0400, sbi->debugfs, &sbi->trace_dropped);
+}
+
+/**
+ * Remove the debugfs directory of a mount and release its trace ring
+ */
+static void assoofs_trace_exit(struct super_block *sb) {
+
+	struct assoofs_sb_info *sbi = sb->s_fs_info;
+
+	// waits for the open trace files to be done
+	debugfs_remove_recursive(sbi->debugfs);
+
+	kvfree(sbi->trace);
+}
+
+/**
+ * Capture an operation, if a capture is running (the oldest records are overwritten when the reader falls behind)
+ */
+static void assoofs_trace(struct super_block *sb, uint32_t op, uint64_t inode_no, uint64_t arg, uint64_t len, const char *name) {
+
+	struct assoofs_sb_info *sbi = sb->s_fs_info;
+	struct assoofs_trace_record *record;
+
+	if (!READ_ONCE(sbi->trace_on))
+		return;
+
+	spin_lock(&sbi->trace_lock);
+
+	if (sbi->trace_head - sbi->trace_tail >= ASSOOFS_TRACE_RECORDS) {
+
+		sbi->trace_tail++;
+		sbi->trace_dropped++;
+	}
+
+	record = &sbi->trace[sbi->trace_head++ % ASSOOFS_TRACE_RECORDS];
+
+	record->time = ktime_get_ns() - sbi->trace_start;
+	record->op = op;
+	record->task = task_pid_nr(current);
+	record->inode_no = inode_no;
+	record->arg = arg;
+	record->len = len;
+	strscpy_pad(record->name, name ? name : "", sizeof(record->name));
+
+	spin_unlock(&sbi->trace_lock);
+}
+
+/**
+ * Read the captured operations, consuming them (only whole records are returned)
+ */
+static ssize_t assoofs_trace_read(struct file *file, char __user *buf, size_t len, loff_t *ppos) {
+
+	struct assoofs_sb_info *sbi = file->private_data;
+	struct assoofs_trace_record record;
+	size_t done = 0;
+
+	while (len - done >= sizeof(record)) {
+
+		// copy the record out of the ring, so the capture doesnt wait for the user memory
+		spin_lock(&sbi->trace_lock);
+
+		if (!sbi->trace || sbi->trace_tail == sbi->trace_head) {
+
+			spin_unlock(&sbi->trace_lock);
+			break;
+		}
+
+		record = sbi->trace[sbi->trace_tail++ % ASSOOFS_TRACE_RECORDS];
+
+		spin_unlock(&sbi->trace_lock);
+
+		if (copy_to_user(buf + done, &record, sizeof(record)))
+			return done ? done : -EFAULT;
+
+		done += sizeof(record);
+	}
+
+	return done;
+}
+
+/**
+ * Read whether a capture is running
+ */
+static ssize_t assoofs_capture_read(struct file *file, char __user *buf, size_t len, loff_t *ppos) {
+
+	struct assoofs_sb_info *sbi = file->private_data;
+
+	return simple_read_from_buffer(buf, len, ppos, READ_ONCE(sbi->trace_on) ? "1\n" : "0\n", 2);
+}
+
+/**
+ * Start a new capture (discarding the records left) or stop the running one
+ */
+static ssize_t assoofs_capture_write(struct file *file, const char __user *buf, size_t len, loff_t *ppos) {
+
+	struct assoofs_sb_info *sbi = file->private_data;
+	struct assoofs_trace_record *trace = NULL;
+	bool on;
+	int code;
+
+	code = kstrtobool_from_user(buf, len, &on);
+	if (code) return code;
+
+	// the ring is only allocated for the mounts that are captured
+	if (on && !READ_ONCE(sbi->trace)) {
+
+		trace = kvcalloc(ASSOOFS_TRACE_RECORDS, sizeof(*trace), GFP_KERNEL);
+		if (!trace) return -ENOMEM;
+	}
+
+	spin_lock(&sbi->trace_lock);
+
+	if (trace && !sbi->trace) {
+
+		sbi->trace = trace;
+		trace = NULL;
+	}
+
+	if (on && !sbi->trace_on) {
+
+		sbi->trace_head = 0;
+		sbi->trace_tail = 0;
+		sbi->trace_dropped = 0;
+		sbi->trace_start = ktime_get_ns();
+
+		info1("Capturing the operations on '%s'\n", sbi->sb->s_id);
+	}
+
+	WRITE_ONCE(sbi->trace_on, on);
+
+	spin_unlock(&sbi->trace_lock);
+
+	// another writer allocated the ring first
+	kvfree(trace);
+
+	return len;
+}
+
+/**
+ * Read the packed metadata whole, in a single batch (it is contiguous), checking it can be used without any further check
+ */
+static int assoofs_load_packed(struct super_block *sb) {
+
+	struct assoofs_sb_info *sbi = sb->s_fs_info;
+	uint64_t size = sbi->sb_disk->packed_meta_size;
+	unsigned int count = DIV_ROUND_UP(size, ASSOOFS_BLOCK_SIZE);
+	struct buffer_head **bhs;
+	uint64_t *numbers;
+	unsigned int i;
+	int code = -ENOMEM;
+
+	info1("Reading %llu bytes of packed metadata\n", size);
+
+	if (!count || count > assoofs_blocks_count(sbi->sb_disk) - ASSOOFS_PACKED_META_BLOCK)
+		return -EINVAL;
+
+	sbi->packed_meta = kvmalloc(count * ASSOOFS_BLOCK_SIZE, GFP_KERNEL);
+	bhs = kmalloc_array(count, sizeof(*bhs), GFP_KERNEL);
+	numbers = kmalloc_array(count, sizeof(*numbers), GFP_KERNEL);
+
+	if (!sbi->packed_meta || !bhs || !numbers)
+		goto out;
+
+	for (i = 0; i < count; i++)
+		numbers[i] = ASSOOFS_PACKED_META_BLOCK + i;
+
+	code = assoofs_read_blocks(sb, numbers, count, bhs);
+	if (code)
+		goto out;
+
+	for (i = 0; i < count; i++) {
+
+		memcpy(sbi->packed_meta + i * ASSOOFS_BLOCK_SIZE, bhs[i]->b_data, ASSOOFS_BLOCK_SIZE);
+		brelse(bhs[i]);
+	}
+
+	code = assoofs_check_packed(sb) ? 0 : -EINVAL;
+
+out:
+	kfree(numbers);
+	kfree(bhs);
+	return code;
+}
+
+/**
+ * Check every offset of a packed image (the inodes, the directory entries and the filenames) stays inside the image
+ */
+static bool assoofs_check_packed(struct super_block *sb) {
+
+	struct assoofs_sb_info *sbi = sb->s_fs_info;
+	uint64_t size = sbi->sb_disk->packed_meta_size;
+	uint64_t blocks = assoofs_blocks_count(sbi->sb_disk);
+	struct assoofs_inode *inode = sbi->inode_store;
+	struct assoofs_packed_dirent *entry;
+	char *link;
+	uint64_t i, j;
+
+	// the inode store holds no more inodes than a block does
+	if (sbi->sb_disk->inodes_count > ASSOOFS_FILESYSTEM_MAX_OBJECTS) {
+
+		error1("Corrupted packed image: %llu inodes\n", sbi->sb_disk->inodes_count);
+		return false;
+	}
+
+	for (i = 0; i < sbi->sb_disk->inodes_count; i++, inode++) {
+
+		// the inodes are found by position
+		if (inode->inode_no != i + 1)
+			goto corrupted;
+
+		if (S_ISDIR(inode->mode)) {
+
+			if (inode->data_offset > size || inode->dir_children_count > (size - inode->data_offset) / sizeof(*entry))
+				goto corrupted;
+
+			entry = (struct assoofs_packed_dirent *) (sbi->packed_meta + inode->data_offset);
+
+			for (j = 0; j < inode->dir_children_count; j++, entry++)
+				if (!entry->inode_no || entry->inode_no > sbi->sb_disk->inodes_count || !entry->name_len || (uint64_t) entry->name_offset + entry->name_len > size)
+					goto corrupted;
+
+		} else if (S_ISLNK(inode->mode)) {
+
+			// the targets end with a terminator (the inline ones, in place of the bloom filter, too)
+			if (inode->data_offset) {
+
+				if (inode->data_offset >= size || inode->file_size >= size - inode->data_offset || sbi->packed_meta[inode->data_offset + inode->file_size])
+					goto corrupted;
+
+			} else {
+
+				link = assoofs_inline_link(sbi->inode_store, inode->inode_no);
+
+				if (inode->file_size > ASSOOFS_INLINE_LINK_MAX || link[inode->file_size])
+					goto corrupted;
+			}
+
+		} else if (inode->file_size) {
+
+			// files never cross a block, so they are read with a single one
+			if (inode->file_size > ASSOOFS_BLOCK_SIZE || inode->data_offset % ASSOOFS_BLOCK_SIZE + inode->file_size > ASSOOFS_BLOCK_SIZE || inode->data_offset / ASSOOFS_BLOCK_SIZE >= blocks)
+				goto corrupted;
+		}
+	}
+
+	return true;
+
+corrupted:
+	error1("Corrupted packed inode %llu\n", i + 1);
+	return false;
+}
+
+/**
+ * Create the linux inode of a packed image inode (pointing to it in the pinned inode store, as it never changes)
+ */
+static struct inode *assoofs_packed_iget(struct super_block *sb, struct inode *dir, uint64_t inode_no) {
+
+	struct assoofs_sb_info *sbi = sb->s_fs_info;
+	struct assoofs_inode *assoofs_inode = sbi->inode_store + inode_no - 1;
+	struct inode *inode;
+
+	inode = new_inode(sb);
+	if (!inode) return ERR_PTR(-ENOMEM);
+
+	inode->i_ino = inode_no;
+	inode->i_private = assoofs_inode;
+
+	inode_init_owner(sb->s_user_ns, inode, dir, assoofs_inode->mode);
+	assoofs_load_times(inode);
+
+	if (S_ISDIR(assoofs_inode->mode)) {
+
+		inode->i_op = &assoofs_packed_dir_iops;
+		inode->i_fop = &assoofs_packed_dir_ops;
+
+	} else if (S_ISLNK(assoofs_inode->mode)) {
+
+		// every target is in memory (in the inode store or the packed metadata)
+		inode->i_op = &assoofs_fast_symlink_ops;
+		inode->i_size = assoofs_inode->file_size;
+		inode->i_link = assoofs_inode->data_offset ? sbi->packed_meta + assoofs_inode->data_offset : assoofs_inline_link(sbi->inode_store, inode_no);
+
+	} else {
+
+		inode->i_fop = &assoofs_packed_file_ops;
+		inode->i_size = assoofs_inode->file_size;
+	}
+
+	return inode;
+}
+
+/**
+ * Find a file inside a directory of a packed image (binary searching its sorted entries, in memory)
+ */
+static struct dentry *assoofs_packed_lookup(struct inode *dir, struct dentry *dentry, unsigned int flags) {
+
+	struct super_block *sb = dir->i_sb;
+	struct assoofs_sb_info *sbi = sb->s_fs_info;
+	struct assoofs_inode *parent = dir->i_private;
+	struct assoofs_packed_dirent *entries = (struct assoofs_packed_dirent *) (sbi->packed_meta + parent->data_offset);
+	struct inode *inode = NULL;
+	uint64_t low = 0;
+	uint64_t high = parent->dir_children_count;
+	uint64_t middle;
+	int cmp;
+
+	while (low < high) {
+
+		middle = low + (high - low) / 2;
+
+		// byte order, with prefixes first
+		cmp = memcmp(dentry->d_name.name, sbi->packed_meta + entries[middle].name_offset, min_t(u32, dentry->d_name.len, entries[middle].name_len));
+		if (!cmp)
+			cmp = (dentry->d_name.len > entries[middle].name_len) - (dentry->d_name.len < entries[middle].name_len);
+
+		if (!cmp) {
+
+			inode = assoofs_packed_iget(sb, dir, entries[middle].inode_no);
+			if (IS_ERR(inode)) return ERR_CAST(inode);
+			break;
+		}
+
+		if (cmp < 0)
+			high = middle;
+		else
+			low = middle + 1;
+	}
+
+	assoofs_trace(sb, ASSOOFS_TRACE_LOOKUP, parent->inode_no, inode ? inode->i_ino : 0, inode ? inode->i_mode : 0, dentry->d_name.name);
+
+	// misses are cached as negative dentries
+	d_add(dentry, inode);
+	return NULL;
+}
+
+/**
+ * Read a directory of a packed image (the position is the index of the next entry)
+ */
+static int assoofs_packed_iterate(struct file *file, struct dir_context *ctx) {
 
-			assoofs_inode = assoofs_get_inode(sb, record->inode_no);
-			
-			mutex_unlock(&assoofs_super_lock);
-			mutex_unlock(&assoofs_inode_lock);
+	struct inode *dir = file_inode(file);
+	struct assoofs_sb_info *sbi = dir->i_sb->s_fs_info;
+	struct assoofs_inode *assoofs_inode = dir->i_private;
+	struct assoofs_packed_dirent *entries = (struct assoofs_packed_dirent *) (sbi->packed_meta + assoofs_inode->data_offset);
+	struct assoofs_packed_dirent *entry;
 
-			inode = new_inode(sb);
-			if (!inode) {
+	if (!ctx->pos)
+		assoofs_trace(dir->i_sb, ASSOOFS_TRACE_ITERATE, assoofs_inode->inode_no, 0, 0, NULL);
 
-				error("Error on lookup: cant create inode\n");
-				brelse(bh);
-				return NULL;
-			}
+	for (; ctx->pos < assoofs_inode->dir_children_count; ctx->pos++) {
 
-			// initialize the linux inode
-			inode->i_ino = record->inode_no;
-			inode->i_sb = sb;
-			inode->i_op = &assoofs_inode_ops;
-			inode->i_private = assoofs_inode;
-
-			inode->i_atime = assoofs_inode->time;
-			inode->i_mtime = assoofs_inode->time;
-			inode->i_ctime = assoofs_inode->time;
-
-			// use the correct type (directory or file)
-			if (S_ISDIR(assoofs_inode->mode))
-				inode->i_fop = &assoofs_dir_ops;
-			else if (S_ISREG(assoofs_inode->mode))
-				inode->i_fop = &assoofs_file_ops;
-			else
-				error("Error on lookup: unknown inode type.\n");
-
-			// initialize the owner of the inode
-			inode_init_owner(sb->s_user_ns, inode, parent_inode, assoofs_inode->mode);
-			
-			// add it to the child entry
-			d_add(child_dentry, inode);
-			
-			// release resources and exit
-			brelse(bh);
-			return NULL;
-		}
+		entry = &entries[ctx->pos];
 
-		// prepare the next inode to search
-		record++;
+		if (!dir_emit(ctx, sbi->packed_meta + entry->name_offset, entry->name_len, entry->inode_no, fs_umode_to_dtype(sbi->inode_store[entry->inode_no - 1].mode)))
+			break;
 	}
 
-	// print an error message if its not found and return
-	error2("Filename '%s' not found in inode %llu\n", child_dentry->d_name.name, parent->inode_no);
-	brelse(bh);
-	return NULL;
+	return 0;
 }
 
-
-/*
- * Read a whole directory
+/**
+ * Read from a file of a packed image (small files share their block, so a single read serves all of them)
  */
-// TODO: USE FILE MUTEXES FOR CONCURRENT READ-WRITE? (they are struct mutex as well)
-static int assoofs_iterate(struct file *file, struct dir_context *ctx) {
+static ssize_t assoofs_packed_read_iter(struct kiocb *iocb, struct iov_iter *to) {
 
-	// declare and get the inodes (linux and assoofs) the superblock
-	struct inode *inode = file->f_path.dentry->d_inode;
+	struct inode *inode = file_inode(iocb->ki_filp);
 	struct assoofs_inode *assoofs_inode = inode->i_private;
-	struct super_block *sb = inode->i_sb;
-
-	// declare the rest of the variables
-	int i;
 	struct buffer_head *bh;
-	struct assoofs_dir_record_entry *record;
+	char *block;
+	uint64_t offset;
+	size_t len;
 
-	info1("Reading directory '%s' contents\n", file->f_path.dentry->d_name.name);
-
-	// check if the context is already created, exiting if it is not
-	if (ctx->pos) {
+	if (iocb->ki_pos >= assoofs_inode->file_size || !iov_iter_count(to))
+		return 0;
 
-		error("Directory context is not initialized\n");
-		return -1;
-	}
+	assoofs_trace(inode->i_sb, ASSOOFS_TRACE_READ, assoofs_inode->inode_no, iocb->ki_pos, iov_iter_count(to), NULL);
 
-	// check if the inode is a directory, exiting if its not
-	if (!S_ISDIR(assoofs_inode->mode)) {
-		
-		error3("Inode (%llu, %lu) for file '%s' is not a directory\n", assoofs_inode->inode_no, inode->i_ino, file->f_path.dentry->d_name.name);
-		return -2;
-	}
+	len = min_t(size_t, iov_iter_count(to), assoofs_inode->file_size - iocb->ki_pos);
+	offset = assoofs_inode->data_offset + iocb->ki_pos;
 
-	// read the directory record from disk
-	record = (struct assoofs_dir_record_entry *) read_block(sb, &bh, assoofs_inode->data_block_number);
+	// files never cross a block (see assoofs_check_packed)
+	if (iocb->ki_flags & IOCB_NOWAIT) {
 
-	if (!record) return -3;
+		block = assoofs_read_cached_block(inode->i_sb, &bh, offset / ASSOOFS_BLOCK_SIZE);
+		if (!block) return -EAGAIN;
 
-	// iterate over all files in directory
-	for (i = 0; i < assoofs_inode->dir_children_count; i++) {
+	} else {
 
-		// add the file to the context
-		dir_emit(ctx, record->filename, ASSOOFS_FILENAME_MAX_LENGTH, record->inode_no, DT_UNKNOWN);
-		ctx->pos += sizeof(struct assoofs_dir_record_entry);
-		
-		// prepare the next record
-		record++;
+		block = read_block(inode->i_sb, &bh, offset / ASSOOFS_BLOCK_SIZE);
+		if (!block) return -EIO;
 	}
 
-	info2("Directory '%s' read. Found %d inodes\n", file->f_path.dentry->d_name.name, i);
-
-	// release resources and return
+	len = copy_to_iter(block + offset % ASSOOFS_BLOCK_SIZE, len, to);
 	brelse(bh);
-	return 0;
-}
 
+	iocb->ki_pos += len;
+	return len;
+}
 
-/*
- * Read from a file
+/**
+ * Splice a file of a packed image to a pipe, referencing its block in the buffer cache instead of copying it
+ * NOTE: only packed images lend their blocks, as they are never written or freed (the writable files are copied by generic_file_splice_read)
  */
-// TODO: USE FILE MUTEXES FOR CONCURRENT READ-WRITE? (they are struct mutex as well)
-ssize_t assoofs_read(struct file * file, char __user * buf, size_t len, loff_t * pos) {
+static ssize_t assoofs_packed_splice_read(struct file *in, loff_t *ppos, struct pipe_inode_info *pipe, size_t len, unsigned int flags) {
 
-	// declare and get the assoofs inode and the superblock
-	struct assoofs_inode *inode = file->f_path.dentry->d_inode->i_private;
-	struct super_block *sb = file->f_path.dentry->d_inode->i_sb;
-
-	// declare other variables
+	struct inode *inode = file_inode(in);
+	struct assoofs_inode *assoofs_inode = inode->i_private;
 	struct buffer_head *bh;
-	char *buffer;
-
-	size_t left;
-	int nbytes;
-
-	info3("Trying to read %lu bytes from file '%s', starting from byte %llu\n", len, file->f_path.dentry->d_name.name, *pos);
+	struct pipe_buffer buf;
+	uint64_t offset;
+	ssize_t code;
 
-	// prevent reading data outside the file
-	if (*pos >= inode->file_size) {
-	
-		error("Cant read from disk: Trying to read outside the file\n");
+	if (*ppos >= assoofs_inode->file_size || !len)
 		return 0;
-	}
 
-	// get the file block
-	buffer = (char *) read_block(sb, &bh, inode->data_block_number);
-	
-	// return 0 if the block hasn't been read
-	if (!buffer) return 0;
+	assoofs_trace(inode->i_sb, ASSOOFS_TRACE_READ, assoofs_inode->inode_no, *ppos, len, NULL);
 
-	// move the buffer to the current position
-	buffer += *pos;
+	// files never cross a block (see assoofs_check_packed)
+	offset = assoofs_inode->data_offset + *ppos;
 
-	// find the amount of bytes to read
-	left = (size_t) inode->file_size - (size_t) *pos;
-	nbytes = min(left, len);
+	if (!read_block(inode->i_sb, &bh, offset / ASSOOFS_BLOCK_SIZE))
+		return -EIO;
 
-	// copy the data from the block buffer to the userspace buffer, checking for errors
-	if (copy_to_user(buf, buffer, nbytes)) {
+	// hand the page of the block to the pipe
+	buf = (struct pipe_buffer) {
+		.page = bh->b_page,
+		.offset = bh_offset(bh) + offset % ASSOOFS_BLOCK_SIZE,
+		.len = min_t(size_t, len, assoofs_inode->file_size - *ppos),
+		.ops = &assoofs_pipe_buf_ops,
+	};
 
-		error("Error copying file contents to the userspace buffer\n");
-		
-		// release resources and return
-		brelse(bh);
-		return 0;
-	}
+	get_page(buf.page);
 
-	// update the current position
-	*pos += nbytes;
+	// the pipe drops the page reference if it cant take the buffer
+	code = add_to_pipe(pipe, &buf);
 
-	info2("Read %d bytes from file '%s'\n", nbytes, file->f_path.dentry->d_name.name);
+	if (code > 0) {
+
+		*ppos += code;
+		file_accessed(in);
+	}
 
-	// release resources and return the amount of bytes read
 	brelse(bh);
-	return nbytes;
+	return code;
 }
 
-/*
- * Write to a file
+/**
+ * Open the rest of the members of a striped volume, placing each one by the position in its superblock
  */
-// TODO: USE FILE MUTEXES FOR CONCURRENT READ-WRITE? (they are struct mutex as well)
-ssize_t assoofs_write(struct file * file, const char __user * buf, size_t len, loff_t * pos) {
-
-	// declare and get the assoofs inode and the superblock
-	struct assoofs_inode *inode = file->f_path.dentry->d_inode->i_private;
-	struct super_block *sb = file->f_path.dentry->d_inode->i_sb;
+static int assoofs_open_members(struct super_block *sb, struct assoofs_mount_opts *opts) {
 
-	// declare some variables
+	struct assoofs_sb_info *sbi = sb->s_fs_info;
+	struct assoofs_super_block *sb_disk = sbi->sb_disk;
+	struct assoofs_super_block *member_disk;
+	struct block_device *bdev;
 	struct buffer_head *bh;
-	char *buffer;
+	uint64_t index;
+	unsigned int i;
 
-	info3("Trying to write %lu bytes from file '%s', starting from byte %llu\n", len, file->f_path.dentry->d_name.name, *pos);
-	
-	// verify the amount of space to write
-	if (*pos + len >= ASSOOFS_BLOCK_SIZE) {
+	if (!assoofs_striped(sb_disk)) {
 
-		error("Cant write to disk: File size after write exceeds block size\n");
-		return 0;
+		if (!opts->devices_count)
+			return 0;
+
+		error("The volume is not striped, but more devices were given. Refusing to mount\n");
+		return -EINVAL;
 	}
 
-	// get the file block
-	buffer = (char *) read_block(sb, &bh, inode->data_block_number);
-	
-	// return 0 if the block hasn't been read
-	if (!buffer) return 0;
+	if (sb_disk->stripe_index || sb_disk->stripe_members < 2 || sb_disk->stripe_members > ASSOOFS_MAX_MEMBERS || !sb_disk->stripe_stride) {
 
-	// move the buffer to the current position
-	buffer += *pos;    
+		error("The device is not the first member of a striped volume. Refusing to mount\n");
+		return -EINVAL;
+	}
 
-	// copy the buffer to the userspace buffer, checking for errors
-	if (copy_from_user(buffer, buf, len)) {
+	if (opts->devices_count != sb_disk->stripe_members - 1) {
 
-		error("Error copying userspace buffer to the file buffer\n");
-		
-		// release resources and return
-		brelse(bh);
-		return 0;
+		error2("The volume has %llu devices, but %u were given. Refusing to mount\n", sb_disk->stripe_members, opts->devices_count + 1);
+		return -EINVAL;
 	}
 
-	// update the current position
-	*pos += len;
+	info2("Mounting a volume striped across %llu devices (%llu blocks per stripe)\n", sb_disk->stripe_members, sb_disk->stripe_stride);
 
-	// write changes to disk
-	mark_buffer_dirty(bh);
-	sync_dirty_buffer(bh);
+	// the members are written together with the mounted device, so they are opened the same way
+	sbi->members_mode = sb_rdonly(sb) ? FMODE_READ | FMODE_EXCL : FMODE_READ | FMODE_WRITE | FMODE_EXCL;
 
-	// update the inode information
-	inode->file_size = *pos;
+	for (i = 0; i < opts->devices_count; i++) {
 
-	if (mutex_lock_interruptible(&assoofs_super_lock)) {
+		bdev = blkdev_get_by_path(opts->devices[i], sbi->members_mode, sb);
+		if (IS_ERR(bdev)) {
 
-		error("Failed to acquire superblock mutex\n");
-		brelse(bh);
-		return 0;
-	}
-	if (mutex_lock_interruptible(&assoofs_inode_lock)) {
+			error1("Error opening the device '%s'. Refusing to mount\n", opts->devices[i]);
+			return PTR_ERR(bdev);
+		}
 
-		error("Failed to acquire inode store mutex\n");
-		mutex_unlock(&assoofs_super_lock);
-		brelse(bh);
-		return 0;
-	}
+		bh = set_blocksize(bdev, sb->s_blocksize) ? NULL : __bread(bdev, ASSOOFS_SUPERBLOCK_BLOCK_NUMBER, sb->s_blocksize);
+		member_disk = bh ? (struct assoofs_super_block *) bh->b_data : NULL;
+		index = member_disk ? member_disk->stripe_index : 0;
 
-	assoofs_save_inode(sb, inode);
+		// every member keeps a copy of the superblock, telling its position
+		if (!member_disk || member_disk->magic != ASSOOFS_MAGIC || !assoofs_striped(member_disk) || member_disk->stripe_volume != sb_disk->stripe_volume || !index || index >= sb_disk->stripe_members || sbi->members[index]) {
 
-	mutex_unlock(&assoofs_super_lock);
-	mutex_unlock(&assoofs_inode_lock);
+			error1("The device '%s' is not a member of the volume. Refusing to mount\n", opts->devices[i]);
+			brelse(bh);
+			blkdev_put(bdev, sbi->members_mode);
+			return -EINVAL;
+		}
 
-	info2("Written %lu bytes to file '%s'\n", len, file->f_path.dentry->d_name.name);
+		brelse(bh);
+		sbi->members[index] = bdev;
+	}
 
-	// release resources and return the amount of bytes read
-	brelse(bh);
-	return len;
+	// the blocks are only mapped to the members once all of them are there
+	sbi->members_count = sb_disk->stripe_members;
+	return 0;
 }
 
-
 /**
- * Read a block data from disk printing a message if it can't be read
- * NOTE: on successful read, it is necessary to release the buffer head after use
+ * Write and release the rest of the members of a striped volume
  */
-void *read_block(struct super_block *sb, struct buffer_head **bh, uint64_t number) {
+static void assoofs_close_members(struct super_block *sb) {
 
-	// read the buffer head and store it
-	struct buffer_head *tmp;
-	tmp = sb_bread(sb, number);
-
-	// verify the buffer head
-	if (!tmp) {
-
-		// print a message and release the buffer head
-		error1("Error reading block %llu\n", number);
-		brelse(tmp);
+	struct assoofs_sb_info *sbi = sb->s_fs_info;
+	unsigned int i;
 
-		// return NULL to signal the error
-		return NULL;
-	}
-
-	// save the buffer head
-	*bh = tmp;
+	assoofs_sync_members(sb, true);
 
-	// return the requested data
-	return tmp->b_data;
+	// the first member is the mounted device, released by the vfs
+	for (i = 1; i < ASSOOFS_MAX_MEMBERS; i++)
+		if (sbi->members[i])
+			blkdev_put(sbi->members[i], sbi->members_mode);
 }
 
 /**
- * Update an inode on disk
+ * Write the dirty blocks of every member, starting all of them before waiting for any (so they are written in parallel)
  */
-int assoofs_save_inode(struct super_block *sb, struct assoofs_inode *assoofs_inode) {
-
-	// declare the variables
-	struct buffer_head *bh;
-	struct assoofs_inode *inode_iterator;
-	uint64_t count = 0;
-	uint64_t inode_num;
+static int assoofs_sync_members(struct super_block *sb, bool wait) {
 
-	info1("Updating inode %llu\n", assoofs_inode->inode_no);
-
-	// get the number of inodes
-	inode_num = ((struct assoofs_super_block *) sb->s_fs_info)->inodes_count;
+	struct assoofs_sb_info *sbi = sb->s_fs_info;
+	unsigned int count = max(sbi->members_count, 1u);
+	unsigned int i;
+	int code = 0;
+	int err;
 
-	// get the inode store
-	inode_iterator = (struct assoofs_inode *) read_block(sb, &bh, ASSOOFS_INODESTORE_BLOCK_NUMBER);
+	for (i = 0; i < count; i++) {
 
-	if (!inode_iterator) return -1;
+		err = filemap_fdatawrite(sbi->members[i]->bd_inode->i_mapping);
+		code = code ? code : err;
+	}
 
-	// search for the inode to update
-	info2("Searching inode %llu, starting from inode %llu\n", assoofs_inode->inode_no, inode_iterator->inode_no);
+	if (!wait)
+		return code;
 
-	// iterate until its found or there are no more inodes
-	while ((inode_iterator->inode_no != assoofs_inode->inode_no) && (count < inode_num)) {
-		
-		count++;
+	for (i = 0; i < count; i++) {
 
-		// move to the next inode
-		inode_iterator++;
+		err = filemap_fdatawait(sbi->members[i]->bd_inode->i_mapping);
+		code = code ? code : err;
 	}
 
-	// exit if the inode is not found
-	if (inode_iterator->inode_no != assoofs_inode->inode_no) {
-
-		error1("Cant update inode to disk: Inode %llu not found\n", assoofs_inode->inode_no);
-		brelse(bh);
-		return -2;
-	}
+	return code;
+}
 
-	info1("Inode %llu found\n", assoofs_inode->inode_no);
+/**
+ * Write the filesystem (the vfs only writes the mounted device, so the rest of the members are written here)
+ */
+static int assoofs_sync_fs(struct super_block *sb, int wait) {
 
-	// store the inode and save to disk
-	memcpy(inode_iterator, assoofs_inode, sizeof(*inode_iterator));
-	mark_buffer_dirty(bh);
-	sync_dirty_buffer(bh);
+	struct assoofs_sb_info *sbi = sb->s_fs_info;
 
-	info1("Inode %llu updated\n", assoofs_inode->inode_no);
+	if (!sbi->members_count)
+		return 0;
 
-	brelse(bh);
-	return 0;
+	return assoofs_sync_members(sb, wait);
 }
 
 /**
- * Get an inode from the store with the specified number (if exists)
+ * Get the device holding a block of the volume, turning the block number into its position there
  */
-struct assoofs_inode *assoofs_get_inode(struct super_block *sb, uint64_t inode_num) {
+static struct block_device *assoofs_map_block(struct super_block *sb, uint64_t *block) {
 
-	// declare get the superblock
-	struct assoofs_super_block *assoofs_sb = sb->s_fs_info;
+	struct assoofs_sb_info *sbi = sb->s_fs_info;
+	uint64_t member;
 
-	// prepare a default value to return
-	struct assoofs_inode *inode_buffer = NULL;
+	// the superblock is read before the members are open (it is always on the first one)
+	if (!sbi || !sbi->members_count)
+		return sb->s_bdev;
 
-	// declare some variables
-	struct buffer_head *bh;
-	struct assoofs_inode *assoofs_inode;
-	int i;
+	member = assoofs_stripe_member(sbi->sb_disk, *block);
+	*block = assoofs_stripe_block(sbi->sb_disk, *block);
 
-	info1("Getting inode number %llu\n", inode_num);
+	return sbi->members[member];
+}
 
-	// get the inode block
-	assoofs_inode = (struct assoofs_inode *) read_block(sb, &bh, ASSOOFS_INODESTORE_BLOCK_NUMBER);
+/**
+ * Get the buffer head of a block of the volume, without reading it (sb_getblk on the member holding it)
+ */
+static struct buffer_head *assoofs_getblk(struct super_block *sb, uint64_t block) {
 
-	// return the default value if the block hasn't been read
-	if (!assoofs_inode) return inode_buffer;
+	struct block_device *bdev = assoofs_map_block(sb, &block);
 
-	// iterate over all inodes until the requested inode is found
-	for (i = 0; i < assoofs_sb->inodes_count; i++) {
+	return __getblk_gfp(bdev, block, sb->s_blocksize, __GFP_MOVABLE);
+}
 
-		// when found, copy it to the buffer, and exit the loop
-		if (assoofs_inode->inode_no == inode_num) {
+/**
+ * Discard a run of blocks of the volume (split into the pieces that are contiguous on each member)
+ */
+static int assoofs_issue_discard(struct super_block *sb, uint64_t first, uint64_t count) {
 
-			info1("Inode %llu found\n", inode_num);
+	sector_t sectors_per_block = ASSOOFS_BLOCK_SIZE >> 9;
+	struct block_device *bdev;
+	uint64_t start, next, len;
+	int code;
 
-			inode_buffer = kmalloc(sizeof(struct assoofs_inode), GFP_KERNEL);
-			memcpy(inode_buffer, assoofs_inode, sizeof(*inode_buffer));
+	while (count) {
 
-			break;
+		start = first;
+		bdev = assoofs_map_block(sb, &start);
+
+		for (len = 1; len < count; len++) {
+
+			next = first + len;
+			if (assoofs_map_block(sb, &next) != bdev || next != start + len)
+				break;
 		}
 
-		// change to the next inode
-		assoofs_inode++;
-	}
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 19, 0)
+		code = blkdev_issue_discard(bdev, start * sectors_per_block, len * sectors_per_block, GFP_NOFS);
+#else
+		code = blkdev_issue_discard(bdev, start * sectors_per_block, len * sectors_per_block, GFP_NOFS, 0);
+#endif
 
+		if (code)
+			return code;
 
-	if (inode_buffer == NULL) 
-		error1("Inode %llu not found\n", inode_num);
+		first += len;
+		count -= len;
+	}
 
-	// release resources and return the requested inode
-	brelse(bh);
-	return inode_buffer;
+	return 0;
 }
 
 
+/**
+ * The KUnit suite (built in with the module, as it uses its static routines)
+ */
+#ifdef CONFIG_ASSOOFS_KUNIT_TEST
+#include "assoofs_test.c"
+#endif
 
 /**
  * Register the load and unload functions
@@ -3,7 +3,8 @@
  */
 #define ASSOOFS_NAME    "assoofs"   // The filesystem name
 #define ASSOOFS_MAGIC   0x20230602  // The magic code of the filesystem
-#define ASSOOFS_VERSION 1           // The version of the filesystem
+#define ASSOOFS_VERSION 2           // The version of the filesystem
+#define ASSOOFS_VERSION_1 1         // The version of the images without feature flags (still mounted, tune.assoofs upgrades them)
 
 #define ASSOOFS_BLOCK_SIZE              4096    // The size of a block in bytes
 #define ASSOOFS_SUPERBLOCK_BLOCK_NUMBER 0       // The superblock block
@@ -14,10 +15,59 @@
 
 #define ASSOOFS_FILESYSTEM_MAX_OBJECTS  64      // The max number of inodes
 #define ASSOOFS_FILENAME_MAX_LENGTH     255     // The max number of characters per filename
+#define ASSOOFS_DIR_MAX_RECORDS         (ASSOOFS_BLOCK_SIZE / sizeof(struct assoofs_dir_record_entry))  // The max number of records per directory
+
+#define ASSOOFS_PACKED_META_BLOCK       2       // The first block of the packed metadata (in place of the root directory block, see ASSOOFS_FEATURE_INCOMPAT_PACKED)
 
 #define ASSOOFS_LAST_RESERVED_BLOCK ASSOOFS_ROOTDIR_BLOCK_NUMBER    // The last reserved block number
+
+#define ASSOOFS_MAX_MEMBERS             8       // The max number of devices of a striped volume
+#define ASSOOFS_STRIPE_FIRST_BLOCK      (ASSOOFS_LAST_RESERVED_BLOCK + 1)   // The first striped block (the ones before it stay on the first member, see ASSOOFS_FEATURE_INCOMPAT_STRIPED)
 #define ASSOOFS_LAST_RESERVED_INODE ASSOOFS_ROOTDIR_INODE_NUMBER    // The last reserved inode number
 
+#define ASSOOFS_SHARE_TABLE_ENTRIES     (ASSOOFS_BLOCK_SIZE / sizeof(struct assoofs_share_entry))   // The number of entries in the share table
+
+#define ASSOOFS_BLOOM_SIZE              16      // The size of the bloom filter of each directory in bytes
+#define ASSOOFS_BLOOM_HASHES            3       // The number of bits set per filename in a bloom filter
+#define ASSOOFS_BLOOM_OFFSET            (ASSOOFS_FILESYSTEM_MAX_OBJECTS * sizeof(struct assoofs_inode))  // The bloom filters follow the inodes in the inode store block
+
+#define ASSOOFS_INLINE_LINK_MAX         (ASSOOFS_BLOOM_SIZE - 1)    // The max length of a symlink target stored in the inode store (longer ones use a data block)
+
+#define ASSOOFS_CLUSTER_SIZE            (4 * ASSOOFS_BLOCK_SIZE)    // The max size of a compressed file (stored in one block)
+
+#define ASSOOFS_COMPRESS_NONE           0       // No compression
+#define ASSOOFS_COMPRESS_LZ4            1       // LZ4 compression
+#define ASSOOFS_COMPRESS_ZSTD           2       // Zstandard compression
+#define ASSOOFS_COMPRESS_ALGORITHMS     3       // The number of compression algorithms (including none)
+
+#define ASSOOFS_STATE_CLEAN             1       // The filesystem was cleanly unmounted, so its summary counters are valid
+
+/**
+ * Feature flags, telling which parts of the layout an image uses (images without them are version 1, see assoofs_features)
+ * Unknown compat features are ignored, unknown ro_compat ones only allow read-only mounts and unknown incompat ones refuse the mount
+ */
+#define ASSOOFS_FEATURE_COMPAT_TIMES        0x0001  // The inode timestamps are kept in the timestamps block
+
+#define ASSOOFS_FEATURE_RO_COMPAT_BLOOMS    0x0001  // The directory bloom filters are kept up to date in the inode store
+#define ASSOOFS_FEATURE_RO_COMPAT_COUNTERS  0x0002  // The superblock keeps the free space summary counters
+#define ASSOOFS_FEATURE_RO_COMPAT_SHARED    0x0004  // Data blocks can be shared, counted in the share table
+
+#define ASSOOFS_FEATURE_INCOMPAT_HOLES      0x0001  // Files and short symlinks can have no data block
+#define ASSOOFS_FEATURE_INCOMPAT_COMPRESSED 0x0002  // Data blocks can hold compressed clusters
+#define ASSOOFS_FEATURE_INCOMPAT_PACKED     0x0004  // The read-only packed layout: sorted directories and long symlink targets in the packed metadata, and files tail-packed by byte offset
+#define ASSOOFS_FEATURE_INCOMPAT_STRIPED    0x0008  // The volume is striped across several devices (see assoofs_stripe_member)
+
+#define ASSOOFS_FEATURE_COMPAT_SUPP         ASSOOFS_FEATURE_COMPAT_TIMES   // The compat features this version understands
+#define ASSOOFS_FEATURE_RO_COMPAT_SUPP      (ASSOOFS_FEATURE_RO_COMPAT_BLOOMS | ASSOOFS_FEATURE_RO_COMPAT_COUNTERS | ASSOOFS_FEATURE_RO_COMPAT_SHARED)  // The ro_compat features this version understands
+#define ASSOOFS_FEATURE_INCOMPAT_SUPP       (ASSOOFS_FEATURE_INCOMPAT_HOLES | ASSOOFS_FEATURE_INCOMPAT_COMPRESSED | ASSOOFS_FEATURE_INCOMPAT_PACKED | ASSOOFS_FEATURE_INCOMPAT_STRIPED)  // The incompat features this version understands
+
+/**
+ * Inode flags, stored in the upper bits of the mode (unused by the file type and permissions)
+ */
+#define ASSOOFS_INODE_COMPRESS          0x00010000  // Compress the file data (chattr +c)
+#define ASSOOFS_INODE_COMPRESSED        0x00020000  // The data block holds a compressed cluster
+#define ASSOOFS_INODE_NOCOMPRESS        0x00040000  // The last compression attempt did not pay off
+
 /**
  * The superblock structure
  */
@@ -27,8 +77,23 @@ struct assoofs_super_block {
 	uint64_t block_size;    // The block size field
 	uint64_t inodes_count;  // The number of inodes
 	uint64_t free_blocks;   // The free status of all blocks (bit 1 for free, bit 0 for occupied)
+	uint64_t share_table_block; // The block of the share table (0 if there is none)
+	uint64_t dir_blooms;    // Whether the directory bloom filters are up to date (0 if they must be rebuilt, see assoofs_has_blooms)
+	uint64_t blocks_count;  // The number of blocks in the volume (0 for ASSOOFS_FILESYSTEM_MAX_OBJECTS)
+	uint64_t times_block;   // The block of the inode timestamps (0 if there is none, see assoofs_has_times)
+	uint64_t free_blocks_count; // The number of free blocks (only trusted if the filesystem is clean)
+	uint64_t free_inodes_count; // The number of free inodes (only trusted if the filesystem is clean)
+	uint64_t state;         // Whether the filesystem was cleanly unmounted (see ASSOOFS_STATE_CLEAN)
+	uint64_t feature_compat;    // The compat features used (ASSOOFS_FEATURE_COMPAT_*)
+	uint64_t feature_ro_compat; // The ro_compat features used (ASSOOFS_FEATURE_RO_COMPAT_*)
+	uint64_t feature_incompat;  // The incompat features used (ASSOOFS_FEATURE_INCOMPAT_*)
+	uint64_t packed_meta_size;  // The bytes of packed metadata from ASSOOFS_PACKED_META_BLOCK (only on packed images)
+	uint64_t stripe_volume;     // The id of the striped volume, the same on every member (only on striped volumes)
+	uint64_t stripe_members;    // The number of devices of the volume
+	uint64_t stripe_index;      // The position of this device in the volume (0 for the first member, which holds the metadata)
+	uint64_t stripe_stride;     // The consecutive blocks placed on each member before moving to the next one
 
-	char padding[4056];     // Some padding space (4056 bytes)
+	char padding[3936];     // Some padding space (3936 bytes)
 };
 
 /**
@@ -45,11 +110,290 @@ struct assoofs_dir_record_entry {
 struct assoofs_inode {
 	mode_t mode;                // The kind of inode (directory, file...)
 	uint64_t inode_no;          // The corresponding inode
-	uint64_t data_block_number; // The corresponding data block
+	union {
+		uint64_t data_block_number; // The corresponding data block
+		uint64_t data_offset;       // The byte offset of the data on packed images (in the packed metadata for directories and long symlinks, in the volume for files)
+	};
 	struct timespec64 time;     // The time the inode was created
 
 	union {
-		uint64_t file_size;             // The size of the file in bytes
+		uint64_t file_size;             // The size of the file (or the length of the symlink target) in bytes
 		uint64_t dir_children_count;    // The number of files in a directory
 	};
-};
\ No newline at end of file
+};
+
+/**
+ * The entries of a directory on packed images, sorted by filename (followed by the filenames, in the packed metadata)
+ */
+struct assoofs_packed_dirent {
+	uint64_t inode_no;      // The inode number
+	uint32_t name_offset;   // The offset of the filename in the packed metadata
+	uint32_t name_len;      // The length of the filename (without a terminator)
+};
+
+/**
+ * The timestamps of an inode, stored in the timestamps block by inode number (the inode store has no room left for them)
+ */
+struct assoofs_times {
+	struct timespec64 atime;    // The last access time
+	struct timespec64 mtime;    // The last modification time
+	struct timespec64 ctime;    // The last change time
+};
+
+/**
+ * The header at the start of a compressed data block
+ */
+struct assoofs_cluster_header {
+	uint32_t algorithm;     // The compression algorithm used
+	uint32_t size;          // The size of the compressed data (following the header) in bytes
+};
+
+/**
+ * The share table entries (data blocks with a known hash or used by more than one inode)
+ * Blocks without an entry are used by a single inode
+ */
+struct assoofs_share_entry {
+	uint64_t hash;          // The hash of the stored data
+	uint32_t block;         // The data block (0 for an empty entry)
+	uint16_t refcount;      // The number of inodes using the block
+	uint16_t size;          // The size of the hashed data in bytes (0 if the hash is unknown)
+};
+
+/**
+ * A captured operation, as read from the trace file of a mount in debugfs (see replay.assoofs)
+ */
+struct assoofs_trace_record {
+	uint64_t time;          // The nanoseconds since the capture started
+	uint32_t op;            // The operation (ASSOOFS_TRACE_*)
+	uint32_t task;          // The process that issued it
+	uint64_t inode_no;      // The file (or the parent directory, for lookups and creations)
+	uint64_t arg;           // The offset of reads and writes, or the inode found or created (0 if the lookup missed)
+	uint64_t len;           // The bytes of reads and writes, the mode of the inode found or the length of the symlink target
+	char name[24];          // The filename of lookups and creations (truncated)
+};
+
+#define ASSOOFS_TRACE_CREATE    1   // A file was created
+#define ASSOOFS_TRACE_MKDIR     2   // A directory was created
+#define ASSOOFS_TRACE_SYMLINK   3   // A symlink was created
+#define ASSOOFS_TRACE_LOOKUP    4   // A filename was looked up
+#define ASSOOFS_TRACE_ITERATE   5   // A directory was listed
+#define ASSOOFS_TRACE_READ      6   // A file was read
+#define ASSOOFS_TRACE_WRITE     7   // A file was written
+
+/**
+ * The argument of the defragmentation ioctl
+ */
+struct assoofs_defrag {
+	uint64_t goal;          // The first block to consider for the data block of the file (0 for the start of the volume)
+	uint64_t block;         // The data block of the file after the call (0 for a hole)
+};
+
+#define ASSOOFS_IOC_DEFRAG  _IOWR('a', 1, struct assoofs_defrag)   // Move the data block of a file (see struct assoofs_defrag)
+#define ASSOOFS_IOC_RESIZE  _IOWR('a', 2, uint64_t)                 // Grow the volume to a number of blocks (0 for the whole device), returning the new number
+
+/**
+ * Get the number of blocks in the volume (images created before the field use every block the bitmap can hold)
+ */
+static inline uint64_t assoofs_blocks_count(const struct assoofs_super_block *sb) {
+
+	return sb->blocks_count ? sb->blocks_count : ASSOOFS_FILESYSTEM_MAX_OBJECTS;
+}
+
+/**
+ * Get the feature flags of an image (version 1 images use every feature of the layout they were created with, without flags, and tell the optional structures by their fields)
+ */
+static inline void assoofs_features(const struct assoofs_super_block *sb, uint64_t *compat, uint64_t *ro_compat, uint64_t *incompat) {
+
+	if (sb->version == ASSOOFS_VERSION_1) {
+
+		*compat = sb->times_block ? ASSOOFS_FEATURE_COMPAT_TIMES : 0;
+		*ro_compat = ASSOOFS_FEATURE_RO_COMPAT_COUNTERS | ASSOOFS_FEATURE_RO_COMPAT_SHARED;
+		if (sb->dir_blooms)
+			*ro_compat |= ASSOOFS_FEATURE_RO_COMPAT_BLOOMS;
+		*incompat = ASSOOFS_FEATURE_INCOMPAT_HOLES | ASSOOFS_FEATURE_INCOMPAT_COMPRESSED;
+		return;
+	}
+
+	*compat = sb->feature_compat;
+	*ro_compat = sb->feature_ro_compat;
+	*incompat = sb->feature_incompat;
+}
+
+/**
+ * Check if an image can be used (0), only read (1, because of unknown ro_compat features) or not at all (-1)
+ */
+static inline int assoofs_check_features(const struct assoofs_super_block *sb) {
+
+	uint64_t compat, ro_compat, incompat;
+
+	if (sb->version != ASSOOFS_VERSION && sb->version != ASSOOFS_VERSION_1)
+		return -1;
+
+	assoofs_features(sb, &compat, &ro_compat, &incompat);
+
+	if (incompat & ~(uint64_t) ASSOOFS_FEATURE_INCOMPAT_SUPP)
+		return -1;
+
+	return (ro_compat & ~(uint64_t) ASSOOFS_FEATURE_RO_COMPAT_SUPP) ? 1 : 0;
+}
+
+/**
+ * Check if an image has a timestamps block (images without one use the creation times)
+ */
+static inline int assoofs_has_times(const struct assoofs_super_block *sb) {
+
+	uint64_t compat, ro_compat, incompat;
+
+	assoofs_features(sb, &compat, &ro_compat, &incompat);
+	return (compat & ASSOOFS_FEATURE_COMPAT_TIMES) && sb->times_block;
+}
+
+/**
+ * Check if the directory bloom filters of an image are up to date (images without them must rebuild them)
+ */
+static inline int assoofs_has_blooms(const struct assoofs_super_block *sb) {
+
+	uint64_t compat, ro_compat, incompat;
+
+	assoofs_features(sb, &compat, &ro_compat, &incompat);
+	return (ro_compat & ASSOOFS_FEATURE_RO_COMPAT_BLOOMS) ? 1 : 0;
+}
+
+/**
+ * Record the timestamps block of an image (the superblock is written by the caller)
+ */
+static inline void assoofs_set_times_block(struct assoofs_super_block *sb, uint64_t block) {
+
+	sb->times_block = block;
+	if (sb->version != ASSOOFS_VERSION_1)
+		sb->feature_compat |= ASSOOFS_FEATURE_COMPAT_TIMES;
+}
+
+/**
+ * Mark the directory bloom filters of an image as up to date (the superblock is written by the caller)
+ */
+static inline void assoofs_set_blooms(struct assoofs_super_block *sb) {
+
+	sb->dir_blooms = 1;
+	if (sb->version != ASSOOFS_VERSION_1)
+		sb->feature_ro_compat |= ASSOOFS_FEATURE_RO_COMPAT_BLOOMS;
+}
+
+/**
+ * Check if a volume is striped across several devices
+ */
+static inline int assoofs_striped(const struct assoofs_super_block *sb) {
+
+	return sb->version != ASSOOFS_VERSION_1 && (sb->feature_incompat & ASSOOFS_FEATURE_INCOMPAT_STRIPED);
+}
+
+/**
+ * Get the member holding a block of a volume (the reserved blocks stay on the first one, the rest go round the members a stride at a time)
+ */
+static inline uint64_t assoofs_stripe_member(const struct assoofs_super_block *sb, uint64_t block) {
+
+	if (!assoofs_striped(sb) || block < ASSOOFS_STRIPE_FIRST_BLOCK)
+		return 0;
+
+	return (block - ASSOOFS_STRIPE_FIRST_BLOCK) / sb->stripe_stride % sb->stripe_members;
+}
+
+/**
+ * Get the position of a block of a volume inside its member (every member keeps the reserved blocks, so the stripes start at the same place)
+ */
+static inline uint64_t assoofs_stripe_block(const struct assoofs_super_block *sb, uint64_t block) {
+
+	uint64_t offset = block - ASSOOFS_STRIPE_FIRST_BLOCK;
+
+	if (!assoofs_striped(sb) || block < ASSOOFS_STRIPE_FIRST_BLOCK)
+		return block;
+
+	return ASSOOFS_STRIPE_FIRST_BLOCK + offset / (sb->stripe_stride * sb->stripe_members) * sb->stripe_stride + offset % sb->stripe_stride;
+}
+
+/**
+ * Get the number of blocks a striped volume can hold with members of a given size (only whole rows of stripes are used)
+ */
+static inline uint64_t assoofs_stripe_capacity(const struct assoofs_super_block *sb, uint64_t member_blocks) {
+
+	if (member_blocks <= ASSOOFS_STRIPE_FIRST_BLOCK)
+		return member_blocks;
+
+	return ASSOOFS_STRIPE_FIRST_BLOCK + (member_blocks - ASSOOFS_STRIPE_FIRST_BLOCK) / sb->stripe_stride * sb->stripe_stride * sb->stripe_members;
+}
+
+/**
+ * Hash some data for deduplication (64 bit FNV-1a, seeded with the length)
+ */
+static inline uint64_t assoofs_hash(const void *data, uint64_t len) {
+
+	const unsigned char *byte = data;
+	uint64_t hash = 0xcbf29ce484222325ULL ^ len;
+
+	while (len--) {
+
+		hash ^= *byte++;
+		hash *= 0x100000001b3ULL;
+	}
+
+	return hash;
+}
+
+/**
+ * Get the bloom filter of a directory (indexed by inode number after the inodes in the inode store block)
+ */
+static inline uint8_t *assoofs_bloom(void *inode_store, uint64_t inode_no) {
+
+	return (uint8_t *) inode_store + ASSOOFS_BLOOM_OFFSET + (inode_no - 1) * ASSOOFS_BLOOM_SIZE;
+}
+
+/**
+ * Get the target of a short symlink, stored in place of its bloom filter (only directories use theirs)
+ */
+static inline char *assoofs_inline_link(void *inode_store, uint64_t inode_no) {
+
+	return (char *) assoofs_bloom(inode_store, inode_no);
+}
+
+/**
+ * Get the bit of a filename in a bloom filter (double hashing the halves of its hash)
+ */
+static inline unsigned int assoofs_bloom_bit(uint64_t hash, unsigned int i) {
+
+	return ((uint32_t) hash + i * (uint32_t) (hash >> 32)) % (ASSOOFS_BLOOM_SIZE * 8);
+}
+
+/**
+ * Add a filename to a bloom filter
+ */
+static inline void assoofs_bloom_add(uint8_t *bloom, const char *name, uint64_t len) {
+
+	uint64_t hash = assoofs_hash(name, len);
+	unsigned int bit;
+	unsigned int i;
+
+	for (i = 0; i < ASSOOFS_BLOOM_HASHES; i++) {
+
+		bit = assoofs_bloom_bit(hash, i);
+		bloom[bit / 8] |= 1 << (bit % 8);
+	}
+}
+
+/**
+ * Check if a filename may be in a bloom filter (0 if it is surely not)
+ */
+static inline int assoofs_bloom_test(const uint8_t *bloom, const char *name, uint64_t len) {
+
+	uint64_t hash = assoofs_hash(name, len);
+	unsigned int bit;
+	unsigned int i;
+
+	for (i = 0; i < ASSOOFS_BLOOM_HASHES; i++) {
+
+		bit = assoofs_bloom_bit(hash, i);
+		if (!(bloom[bit / 8] & (1 << (bit % 8))))
+			return 0;
+	}
+
+	return 1;
+}
@@ -0,0 +1,643 @@
+/**
+ * KUnit suite of the core routines, run on ram disks (included at the end of assoofs.c, see the Kconfig)
+ * NOTE: every test formats and mounts a ram disk of its own (unmounts are finished asynchronously, so the disks are not reused)
+ */
+#include <kunit/test.h>         // Needed for kunit
+#include <linux/namei.h>        // Needed for the path lookups
+#include <linux/mount.h>        // Needed for vfs_kern_mount
+#include <linux/major.h>        // Needed for RAMDISK_MAJOR
+#include <linux/ktime.h>        // Needed for the timings
+
+#define ASSOOFS_TEST_RUNS       200     // The runs of each timed operation (the fastest one is kept, as it has the least noise)
+#define ASSOOFS_TEST_DIRS       4       // The directories the inodes are spread over (a directory only holds ASSOOFS_DIR_MAX_RECORDS)
+
+/**
+ * A filesystem mounted for a test
+ */
+struct assoofs_test_mount {
+	struct vfsmount *mnt;       // The mount
+	struct super_block *sb;     // The superblock
+	struct dentry *root;        // The root directory
+};
+
+static atomic_t assoofs_test_disks = ATOMIC_INIT(0);
+
+/**
+ * Write an empty filesystem (like mkassoofs without the welcome file) to a ram disk
+ */
+static int assoofs_test_format(dev_t dev) {
+
+	struct block_device *bdev;
+	struct buffer_head *bh;
+	struct assoofs_super_block *sb_disk;
+	struct assoofs_inode *root;
+	uint64_t i;
+	int code;
+
+	bdev = blkdev_get_by_dev(dev, FMODE_READ | FMODE_WRITE, NULL);
+	if (IS_ERR(bdev)) return PTR_ERR(bdev);
+
+	code = set_blocksize(bdev, ASSOOFS_BLOCK_SIZE);
+
+	for (i = 0; !code && i <= ASSOOFS_LAST_RESERVED_BLOCK; i++) {
+
+		bh = __getblk(bdev, i, ASSOOFS_BLOCK_SIZE);
+		if (!bh) {
+
+			code = -ENOMEM;
+			break;
+		}
+
+		lock_buffer(bh);
+		memset(bh->b_data, 0, ASSOOFS_BLOCK_SIZE);
+
+		if (i == ASSOOFS_SUPERBLOCK_BLOCK_NUMBER) {
+
+			sb_disk = (struct assoofs_super_block *) bh->b_data;
+			sb_disk->magic = ASSOOFS_MAGIC;
+			sb_disk->version = ASSOOFS_VERSION;
+			sb_disk->block_size = ASSOOFS_BLOCK_SIZE;
+			sb_disk->inodes_count = ASSOOFS_LAST_RESERVED_INODE;
+			sb_disk->free_blocks = ~0ULL << (ASSOOFS_LAST_RESERVED_BLOCK + 1);
+			sb_disk->blocks_count = ASSOOFS_FILESYSTEM_MAX_OBJECTS;
+			sb_disk->free_blocks_count = ASSOOFS_FILESYSTEM_MAX_OBJECTS - ASSOOFS_LAST_RESERVED_BLOCK - 1;
+			sb_disk->free_inodes_count = ASSOOFS_FILESYSTEM_MAX_OBJECTS - ASSOOFS_LAST_RESERVED_INODE;
+			sb_disk->state = ASSOOFS_STATE_CLEAN;
+			sb_disk->feature_ro_compat = ASSOOFS_FEATURE_RO_COMPAT_COUNTERS | ASSOOFS_FEATURE_RO_COMPAT_SHARED;
+			sb_disk->feature_incompat = ASSOOFS_FEATURE_INCOMPAT_HOLES | ASSOOFS_FEATURE_INCOMPAT_COMPRESSED;
+
+			// the root directory is empty, so its (zeroed) bloom filter is up to date
+			assoofs_set_blooms(sb_disk);
+
+		} else if (i == ASSOOFS_INODESTORE_BLOCK_NUMBER) {
+
+			root = (struct assoofs_inode *) bh->b_data;
+			root->mode = S_IFDIR;
+			root->inode_no = ASSOOFS_ROOTDIR_INODE_NUMBER;
+			root->data_block_number = ASSOOFS_ROOTDIR_BLOCK_NUMBER;
+			ktime_get_real_ts64(&root->time);
+		}
+
+		set_buffer_uptodate(bh);
+		unlock_buffer(bh);
+		mark_buffer_dirty(bh);
+
+		code = sync_dirty_buffer(bh);
+		brelse(bh);
+	}
+
+	blkdev_put(bdev, FMODE_READ | FMODE_WRITE);
+	return code;
+}
+
+/**
+ * Format the next ram disk and mount it (through a device node on the root filesystem)
+ */
+static int assoofs_test_init(struct kunit *test) {
+
+	struct assoofs_test_mount *ctx;
+	struct dentry *dentry;
+	struct path path;
+	char name[32];
+	int disk = atomic_inc_return(&assoofs_test_disks) - 1;
+	dev_t dev = MKDEV(RAMDISK_MAJOR, disk);
+	int code;
+
+	if (disk >= CONFIG_BLK_DEV_RAM_COUNT) {
+
+		kunit_err(test, "Out of ram disks (raise CONFIG_BLK_DEV_RAM_COUNT)\n");
+		return -ENODEV;
+	}
+
+	ctx = kunit_kzalloc(test, sizeof(*ctx), GFP_KERNEL);
+	if (!ctx) return -ENOMEM;
+
+	code = assoofs_test_format(dev);
+	if (code) return code;
+
+	sprintf(name, "/assoofs-kunit%d", disk);
+
+	dentry = kern_path_create(AT_FDCWD, name, &path, 0);
+	if (IS_ERR(dentry)) return PTR_ERR(dentry);
+
+	code = vfs_mknod(&init_user_ns, d_inode(path.dentry), dentry, S_IFBLK | 0600, dev);
+	done_path_create(&path, dentry);
+
+	if (code) return code;
+
+	ctx->mnt = vfs_kern_mount(&assoofs_type, 0, name, NULL);
+	if (IS_ERR(ctx->mnt)) return PTR_ERR(ctx->mnt);
+
+	ctx->sb = ctx->mnt->mnt_sb;
+	ctx->root = ctx->mnt->mnt_root;
+	test->priv = ctx;
+
+	return 0;
+}
+
+/**
+ * Unmount the filesystem of a test
+ */
+static void assoofs_test_exit(struct kunit *test) {
+
+	struct assoofs_test_mount *ctx = test->priv;
+
+	if (ctx)
+		mntput(ctx->mnt);
+}
+
+/**
+ * Create a file or a directory, returning its inode number (0 if it failed)
+ */
+static uint64_t assoofs_test_create(struct kunit *test, struct dentry *dir, const char *name, bool is_dir) {
+
+	struct dentry *dentry;
+	uint64_t inode_no = 0;
+	int code;
+
+	inode_lock_nested(d_inode(dir), I_MUTEX_PARENT);
+
+	dentry = lookup_one_len(name, dir, strlen(name));
+	code = PTR_ERR_OR_ZERO(dentry);
+
+	if (!code) {
+
+		if (is_dir)
+			code = vfs_mkdir(&init_user_ns, d_inode(dir), dentry, 0755);
+		else
+			code = vfs_create(&init_user_ns, d_inode(dir), dentry, 0644, true);
+
+		if (!code && d_inode(dentry))
+			inode_no = d_inode(dentry)->i_ino;
+
+		dput(dentry);
+	}
+
+	inode_unlock(d_inode(dir));
+
+	KUNIT_EXPECT_EQ(test, code, 0);
+	return inode_no;
+}
+
+/**
+ * Look a filename up with assoofs_lookup (skipping the dentry cache), returning the inode number found (0 if it is not there)
+ */
+static uint64_t assoofs_test_lookup(struct kunit *test, struct dentry *dir, const char *name) {
+
+	struct dentry *dentry = d_alloc_name(dir, name);
+	struct dentry *found;
+	uint64_t inode_no = 0;
+
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, dentry);
+
+	inode_lock_shared(d_inode(dir));
+	found = d_inode(dir)->i_op->lookup(d_inode(dir), dentry, 0);
+	inode_unlock_shared(d_inode(dir));
+
+	KUNIT_EXPECT_FALSE(test, IS_ERR(found));
+
+	// a dentry returned in place of the new one is the one used
+	if (!IS_ERR_OR_NULL(found)) {
+
+		if (d_inode(found))
+			inode_no = d_inode(found)->i_ino;
+
+		d_drop(found);
+		dput(found);
+
+	} else if (d_inode(dentry)) {
+
+		inode_no = d_inode(dentry)->i_ino;
+	}
+
+	// dont leave the aliases in the cache, so the next lookups get here again
+	d_drop(dentry);
+	dput(dentry);
+
+	return inode_no;
+}
+
+/**
+ * Rename an entry inside a directory, replacing the target if it exists
+ */
+static int assoofs_test_rename(struct dentry *dir, const char *from, const char *to) {
+
+	struct renamedata rd = {
+		.old_mnt_userns = &init_user_ns,
+		.old_dir = d_inode(dir),
+		.new_mnt_userns = &init_user_ns,
+		.new_dir = d_inode(dir),
+	};
+	int code;
+
+	lock_rename(dir, dir);
+
+	rd.old_dentry = lookup_one_len(from, dir, strlen(from));
+	rd.new_dentry = lookup_one_len(to, dir, strlen(to));
+
+	code = PTR_ERR_OR_ZERO(rd.old_dentry) ?: PTR_ERR_OR_ZERO(rd.new_dentry);
+	if (!code)
+		code = vfs_rename(&rd);
+
+	if (!IS_ERR(rd.new_dentry))
+		dput(rd.new_dentry);
+	if (!IS_ERR(rd.old_dentry))
+		dput(rd.old_dentry);
+
+	unlock_rename(dir, dir);
+	return code;
+}
+
+/**
+ * Get the number of children of a directory from the inode store
+ */
+static uint64_t assoofs_test_children(struct kunit *test, struct super_block *sb, uint64_t inode_no) {
+
+	struct assoofs_inode *inode = assoofs_get_inode(sb, inode_no);
+	uint64_t count;
+
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, inode);
+
+	count = inode->dir_children_count;
+	kfree(inode);
+
+	return count;
+}
+
+/**
+ * Time the fastest of some lookups of a filename
+ */
+static u64 assoofs_test_time_lookup(struct kunit *test, struct dentry *dir, const char *name) {
+
+	u64 best = U64_MAX;
+	u64 start;
+	int i;
+
+	for (i = 0; i < ASSOOFS_TEST_RUNS; i++) {
+
+		start = ktime_get_ns();
+		assoofs_test_lookup(test, dir, name);
+		best = min(best, ktime_get_ns() - start);
+	}
+
+	return best;
+}
+
+/**
+ * Blocks are read from the device, and blocks past its end are reported
+ */
+static void assoofs_test_read_block(struct kunit *test) {
+
+	struct assoofs_test_mount *ctx = test->priv;
+	struct assoofs_super_block *sb_disk;
+	struct assoofs_inode *inode_store;
+	struct buffer_head *bh;
+
+	sb_disk = read_block(ctx->sb, &bh, ASSOOFS_SUPERBLOCK_BLOCK_NUMBER);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, sb_disk);
+
+	KUNIT_EXPECT_EQ(test, sb_disk->magic, (uint64_t) ASSOOFS_MAGIC);
+	KUNIT_EXPECT_EQ(test, sb_disk->block_size, (uint64_t) ASSOOFS_BLOCK_SIZE);
+	brelse(bh);
+
+	inode_store = read_block(ctx->sb, &bh, ASSOOFS_INODESTORE_BLOCK_NUMBER);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, inode_store);
+
+	KUNIT_EXPECT_EQ(test, inode_store->inode_no, (uint64_t) ASSOOFS_ROOTDIR_INODE_NUMBER);
+	KUNIT_EXPECT_TRUE(test, S_ISDIR(inode_store->mode));
+	brelse(bh);
+
+	// the ram disk ends long before it
+	KUNIT_EXPECT_PTR_EQ(test, read_block(ctx->sb, &bh, 1ULL << 40), NULL);
+}
+
+/**
+ * Inodes are copied out of the store, and saved back to it (and to its block)
+ */
+static void assoofs_test_inode_store(struct kunit *test) {
+
+	struct assoofs_test_mount *ctx = test->priv;
+	struct assoofs_inode *inode;
+	struct assoofs_inode *inode_store;
+	struct assoofs_inode missing = { .inode_no = ASSOOFS_FILESYSTEM_MAX_OBJECTS };
+	struct buffer_head *bh;
+	uint64_t inode_no;
+	int code;
+
+	inode = assoofs_get_inode(ctx->sb, ASSOOFS_ROOTDIR_INODE_NUMBER);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, inode);
+
+	KUNIT_EXPECT_TRUE(test, S_ISDIR(inode->mode));
+	KUNIT_EXPECT_EQ(test, inode->data_block_number, (uint64_t) ASSOOFS_ROOTDIR_BLOCK_NUMBER);
+	KUNIT_EXPECT_EQ(test, inode->dir_children_count, 0ULL);
+
+	// a copy is returned, so it only changes once saved
+	inode->time.tv_sec = 1234;
+
+	mutex_lock(&assoofs_inode_lock);
+	code = assoofs_save_inode(ctx->sb, inode);
+	mutex_unlock(&assoofs_inode_lock);
+
+	KUNIT_EXPECT_EQ(test, code, 0);
+	kfree(inode);
+
+	inode = assoofs_get_inode(ctx->sb, ASSOOFS_ROOTDIR_INODE_NUMBER);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, inode);
+	KUNIT_EXPECT_EQ(test, inode->time.tv_sec, 1234LL);
+	kfree(inode);
+
+	inode_store = read_block(ctx->sb, &bh, ASSOOFS_INODESTORE_BLOCK_NUMBER);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, inode_store);
+	KUNIT_EXPECT_EQ(test, inode_store->time.tv_sec, 1234LL);
+	brelse(bh);
+
+	// new inodes are found, and unknown ones are not
+	inode_no = assoofs_test_create(test, ctx->root, "file", false);
+	KUNIT_ASSERT_NE(test, inode_no, 0ULL);
+
+	inode = assoofs_get_inode(ctx->sb, inode_no);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, inode);
+	KUNIT_EXPECT_TRUE(test, S_ISREG(inode->mode));
+	KUNIT_EXPECT_EQ(test, inode->file_size, 0ULL);
+	kfree(inode);
+
+	KUNIT_EXPECT_PTR_EQ(test, assoofs_get_inode(ctx->sb, ASSOOFS_FILESYSTEM_MAX_OBJECTS), (struct assoofs_inode *) NULL);
+
+	mutex_lock(&assoofs_inode_lock);
+	code = assoofs_save_inode(ctx->sb, &missing);
+	mutex_unlock(&assoofs_inode_lock);
+
+	KUNIT_EXPECT_EQ(test, code, -2);
+}
+
+/**
+ * Blocks are allocated first fit, counted, and given back
+ */
+static void assoofs_test_alloc_free(struct kunit *test) {
+
+	struct assoofs_test_mount *ctx = test->priv;
+	struct assoofs_sb_info *sbi = ctx->sb->s_fs_info;
+	uint64_t blocks[ASSOOFS_FILESYSTEM_MAX_OBJECTS];
+	uint64_t free_count, first, second, i, count;
+	uint64_t one = 1;
+
+	mutex_lock(&assoofs_super_lock);
+
+	free_count = sbi->sb_disk->free_blocks_count;
+
+	first = assoofs_alloc_block(ctx->sb, 0);
+	second = assoofs_alloc_block(ctx->sb, 0);
+
+	KUNIT_EXPECT_EQ(test, first, (uint64_t) ASSOOFS_LAST_RESERVED_BLOCK + 1);
+	KUNIT_EXPECT_EQ(test, second, first + 1);
+	KUNIT_EXPECT_FALSE(test, sbi->sb_disk->free_blocks & (one << first));
+	KUNIT_EXPECT_EQ(test, sbi->sb_disk->free_blocks_count, free_count - 2);
+
+	// the first free block is taken again
+	assoofs_free_block(ctx->sb, first);
+	KUNIT_EXPECT_TRUE(test, sbi->sb_disk->free_blocks & (one << first));
+	KUNIT_EXPECT_EQ(test, assoofs_alloc_block(ctx->sb, 0), first);
+
+	assoofs_free_block(ctx->sb, first);
+	assoofs_free_block(ctx->sb, second);
+	KUNIT_EXPECT_EQ(test, sbi->sb_disk->free_blocks_count, free_count);
+
+	// until there are none
+	for (count = 0; (blocks[count] = assoofs_alloc_block(ctx->sb, 0)); count++);
+
+	KUNIT_EXPECT_EQ(test, count, free_count);
+	KUNIT_EXPECT_EQ(test, sbi->sb_disk->free_blocks_count, 0ULL);
+
+	for (i = 0; i < count; i++)
+		assoofs_free_block(ctx->sb, blocks[i]);
+
+	KUNIT_EXPECT_EQ(test, sbi->sb_disk->free_blocks_count, free_count);
+
+	mutex_unlock(&assoofs_super_lock);
+}
+
+/**
+ * Files and directories are found by name, and missing names are not
+ */
+static void assoofs_test_lookup_names(struct kunit *test) {
+
+	struct assoofs_test_mount *ctx = test->priv;
+	uint64_t file, dir;
+
+	KUNIT_EXPECT_EQ(test, assoofs_test_lookup(test, ctx->root, "file"), 0ULL);
+
+	file = assoofs_test_create(test, ctx->root, "file", false);
+	dir = assoofs_test_create(test, ctx->root, "dir", true);
+
+	KUNIT_ASSERT_NE(test, file, 0ULL);
+	KUNIT_ASSERT_NE(test, dir, 0ULL);
+
+	KUNIT_EXPECT_EQ(test, assoofs_test_lookup(test, ctx->root, "file"), file);
+	KUNIT_EXPECT_EQ(test, assoofs_test_lookup(test, ctx->root, "dir"), dir);
+	KUNIT_EXPECT_EQ(test, assoofs_test_lookup(test, ctx->root, "fil"), 0ULL);
+	KUNIT_EXPECT_EQ(test, assoofs_test_lookup(test, ctx->root, "missing"), 0ULL);
+	KUNIT_EXPECT_EQ(test, assoofs_test_children(test, ctx->sb, ASSOOFS_ROOTDIR_INODE_NUMBER), 2ULL);
+}
+
+/**
+ * Renames move the entry, and replace (and free) the target
+ */
+static void assoofs_test_rename_entries(struct kunit *test) {
+
+	struct assoofs_test_mount *ctx = test->priv;
+	struct assoofs_sb_info *sbi = ctx->sb->s_fs_info;
+	uint64_t old, x, y, d1, free_blocks;
+
+	old = assoofs_test_create(test, ctx->root, "old", false);
+	KUNIT_ASSERT_NE(test, old, 0ULL);
+
+	KUNIT_EXPECT_EQ(test, assoofs_test_rename(ctx->root, "old", "new"), 0);
+	KUNIT_EXPECT_EQ(test, assoofs_test_lookup(test, ctx->root, "old"), 0ULL);
+	KUNIT_EXPECT_EQ(test, assoofs_test_lookup(test, ctx->root, "new"), old);
+	KUNIT_EXPECT_EQ(test, assoofs_test_children(test, ctx->sb, ASSOOFS_ROOTDIR_INODE_NUMBER), 1ULL);
+
+	// over a file
+	x = assoofs_test_create(test, ctx->root, "x", false);
+	y = assoofs_test_create(test, ctx->root, "y", false);
+
+	KUNIT_EXPECT_EQ(test, assoofs_test_rename(ctx->root, "x", "y"), 0);
+	KUNIT_EXPECT_EQ(test, assoofs_test_lookup(test, ctx->root, "x"), 0ULL);
+	KUNIT_EXPECT_EQ(test, assoofs_test_lookup(test, ctx->root, "y"), x);
+	KUNIT_EXPECT_EQ(test, assoofs_test_children(test, ctx->sb, ASSOOFS_ROOTDIR_INODE_NUMBER), 2ULL);
+
+	// the replaced file is freed, and the next create takes its slot
+	KUNIT_EXPECT_PTR_EQ(test, assoofs_get_inode(ctx->sb, y), (struct assoofs_inode *) NULL);
+	KUNIT_EXPECT_EQ(test, assoofs_test_create(test, ctx->root, "z", false), y);
+
+	// over an empty directory, whose block is freed
+	d1 = assoofs_test_create(test, ctx->root, "d1", true);
+	assoofs_test_create(test, ctx->root, "d2", true);
+	free_blocks = sbi->sb_disk->free_blocks_count;
+
+	KUNIT_EXPECT_EQ(test, assoofs_test_rename(ctx->root, "d1", "d2"), 0);
+	KUNIT_EXPECT_EQ(test, assoofs_test_lookup(test, ctx->root, "d1"), 0ULL);
+	KUNIT_EXPECT_EQ(test, assoofs_test_lookup(test, ctx->root, "d2"), d1);
+	KUNIT_EXPECT_EQ(test, assoofs_test_children(test, ctx->sb, ASSOOFS_ROOTDIR_INODE_NUMBER), 4ULL);
+	KUNIT_EXPECT_EQ(test, sbi->sb_disk->free_blocks_count, free_blocks + 1);
+
+	// but not over a file
+	KUNIT_EXPECT_NE(test, assoofs_test_rename(ctx->root, "d2", "y"), 0);
+}
+
+/**
+ * Time the lookups across directory sizes (the timings are only reported, as the vfs overhead of a lookup hides the record walk at this size, so the index is checked instead)
+ */
+static void assoofs_test_bench_lookup(struct kunit *test) {
+
+	struct assoofs_test_mount *ctx = test->priv;
+	struct assoofs_sb_info *sbi = ctx->sb->s_fs_info;
+	static const unsigned int sizes[] = { 1, 4, 8, ASSOOFS_DIR_MAX_RECORDS };
+	u64 hit[ARRAY_SIZE(sizes)];
+	u64 miss;
+	char name[16];
+	uint64_t last = 0;
+	unsigned int count = 0;
+	unsigned int i;
+	bool indexed;
+
+	for (i = 0; i < ARRAY_SIZE(sizes); i++) {
+
+		while (count < sizes[i]) {
+
+			sprintf(name, "f%02u", count++);
+			last = assoofs_test_create(test, ctx->root, name, false);
+			KUNIT_ASSERT_NE(test, last, 0ULL);
+		}
+
+		// the last name added is the last record of the block
+		hit[i] = assoofs_test_time_lookup(test, ctx->root, name);
+		miss = assoofs_test_time_lookup(test, ctx->root, "missing");
+
+		kunit_info(test, "lookup: %u entries: hit %llu ns, miss %llu ns\n", sizes[i], hit[i], miss);
+	}
+
+	// lookups must be answered by the index built on first use (instead of walking the records again)
+	KUNIT_EXPECT_TRUE(test, rcu_access_pointer(sbi->dir_index[ASSOOFS_ROOTDIR_INODE_NUMBER - 1]) != NULL);
+	KUNIT_EXPECT_EQ(test, assoofs_index_lookup(ctx->sb, d_inode(ctx->root)->i_private, name, &indexed), last);
+	KUNIT_EXPECT_TRUE(test, indexed);
+}
+
+/**
+ * Time the block allocations across fill levels
+ */
+static void assoofs_test_bench_alloc(struct kunit *test) {
+
+	struct assoofs_test_mount *ctx = test->priv;
+	struct assoofs_sb_info *sbi = ctx->sb->s_fs_info;
+	static const unsigned int levels[] = { 0, 16, 32, 48, 60 };
+	uint64_t blocks[ASSOOFS_FILESYSTEM_MAX_OBJECTS];
+	uint64_t block, expected;
+	unsigned int used = 0;
+	unsigned int i, j;
+	u64 best, start;
+
+	mutex_lock(&assoofs_super_lock);
+
+	for (i = 0; i < ARRAY_SIZE(levels); i++) {
+
+		while (used < levels[i] && (blocks[used] = assoofs_alloc_block(ctx->sb, 0)))
+			used++;
+
+		KUNIT_EXPECT_EQ(test, used, levels[i]);
+
+		expected = __ffs64(sbi->sb_disk->free_blocks);
+		best = U64_MAX;
+
+		for (j = 0; j < ASSOOFS_TEST_RUNS; j++) {
+
+			start = ktime_get_ns();
+			block = assoofs_alloc_block(ctx->sb, 0);
+			assoofs_free_block(ctx->sb, block);
+			best = min(best, ktime_get_ns() - start);
+
+			KUNIT_EXPECT_EQ(test, block, expected);
+		}
+
+		kunit_info(test, "alloc and free: %u blocks used: %llu ns\n", used + ASSOOFS_LAST_RESERVED_BLOCK + 1, best);
+	}
+
+	while (used)
+		assoofs_free_block(ctx->sb, blocks[--used]);
+
+	mutex_unlock(&assoofs_super_lock);
+}
+
+/**
+ * Time the inode store reads across inode counts (the last inode is the one scanned the longest)
+ */
+static void assoofs_test_bench_get_inode(struct kunit *test) {
+
+	struct assoofs_test_mount *ctx = test->priv;
+	struct assoofs_sb_info *sbi = ctx->sb->s_fs_info;
+	static const unsigned int counts[] = { 8, 32, ASSOOFS_FILESYSTEM_MAX_OBJECTS };
+	struct dentry *dirs[ASSOOFS_TEST_DIRS];
+	struct assoofs_inode *inode;
+	uint64_t last = ASSOOFS_ROOTDIR_INODE_NUMBER;
+	char name[16];
+	unsigned int created = 0;
+	unsigned int i, j;
+	u64 best, start;
+
+	for (i = 0; i < ASSOOFS_TEST_DIRS; i++) {
+
+		sprintf(name, "d%u", i);
+		KUNIT_ASSERT_NE(test, assoofs_test_create(test, ctx->root, name, true), 0ULL);
+
+		dirs[i] = lookup_one_len_unlocked(name, ctx->root, strlen(name));
+		KUNIT_ASSERT_NOT_ERR_OR_NULL(test, dirs[i]);
+	}
+
+	for (i = 0; i < ARRAY_SIZE(counts); i++) {
+
+		while (sbi->sb_disk->inodes_count < counts[i]) {
+
+			sprintf(name, "f%02u", created);
+			last = assoofs_test_create(test, dirs[created++ % ASSOOFS_TEST_DIRS], name, false);
+			KUNIT_ASSERT_NE(test, last, 0ULL);
+		}
+
+		best = U64_MAX;
+
+		for (j = 0; j < ASSOOFS_TEST_RUNS; j++) {
+
+			start = ktime_get_ns();
+			inode = assoofs_get_inode(ctx->sb, last);
+			best = min(best, ktime_get_ns() - start);
+
+			KUNIT_ASSERT_NOT_ERR_OR_NULL(test, inode);
+			KUNIT_EXPECT_EQ(test, inode->inode_no, last);
+			kfree(inode);
+		}
+
+		kunit_info(test, "get inode: %llu inodes: %llu ns\n", sbi->sb_disk->inodes_count, best);
+	}
+
+	for (i = 0; i < ASSOOFS_TEST_DIRS; i++)
+		dput(dirs[i]);
+}
+
+static struct kunit_case assoofs_test_cases[] = {
+	KUNIT_CASE(assoofs_test_read_block),
+	KUNIT_CASE(assoofs_test_inode_store),
+	KUNIT_CASE(assoofs_test_alloc_free),
+	KUNIT_CASE(assoofs_test_lookup_names),
+	KUNIT_CASE(assoofs_test_rename_entries),
+	KUNIT_CASE(assoofs_test_bench_lookup),
+	KUNIT_CASE(assoofs_test_bench_alloc),
+	KUNIT_CASE(assoofs_test_bench_get_inode),
+	{}
+};
+
+static struct kunit_suite assoofs_test_suite = {
+	.name = ASSOOFS_NAME,
+	.init = assoofs_test_init,
+	.exit = assoofs_test_exit,
+	.test_cases = assoofs_test_cases,
+};
+
+kunit_test_suite(assoofs_test_suite);
@@ -0,0 +1,238 @@
+/**
+ * Include dependencies
+ */
+#include <unistd.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "libassoofs.h"
+
+/**
+ * The metadata of the image, with the block usage
+ */
+struct image {
+	struct assoofs_image core;                                      // The image metadata
+	uint64_t refcount[ASSOOFS_FILESYSTEM_MAX_OBJECTS];              // The number of inodes using each block
+	int released[ASSOOFS_FILESYSTEM_MAX_OBJECTS];                   // The blocks no longer used by some inode
+};
+
+/**
+ * Get the number of bytes of a file stored in its data block
+ */
+static uint64_t stored_size(const struct assoofs_inode *inode, const char *block) {
+
+	if (inode->mode & ASSOOFS_INODE_COMPRESSED)
+		return sizeof(struct assoofs_cluster_header) + ((const struct assoofs_cluster_header *) block)->size;
+
+	return inode->file_size;
+}
+
+/**
+ * Point files with identical contents to the same data block
+ */
+static int share_blocks(struct image *img, int *shared) {
+
+	// the unique blocks seen so far
+	static char blocks[ASSOOFS_FILESYSTEM_MAX_OBJECTS][ASSOOFS_BLOCK_SIZE];
+	uint64_t numbers[ASSOOFS_FILESYSTEM_MAX_OBJECTS];
+	uint64_t hashes[ASSOOFS_FILESYSTEM_MAX_OBJECTS];
+	uint64_t sizes[ASSOOFS_FILESYSTEM_MAX_OBJECTS];
+	int count = 0;
+
+	char block[ASSOOFS_BLOCK_SIZE];
+	struct assoofs_inode *inode;
+	uint64_t size, hash;
+	uint64_t i;
+	int j;
+
+	*shared = 0;
+
+	for (i = 0; i < img->core.sb.inodes_count; i++) {
+
+		inode = &img->core.inodes[i];
+
+		// only files with data can be shared (holes have no block)
+		if (!S_ISREG(inode->mode) || !inode->file_size || !inode->data_block_number)
+			continue;
+
+		if (assoofs_read_image_block(&img->core, inode->data_block_number, block))
+			return -1;
+
+		size = stored_size(inode, block);
+		if (size > ASSOOFS_BLOCK_SIZE) {
+
+			printf("Skipping inode %llu: Corrupted data block\n", (unsigned long long) inode->inode_no);
+			continue;
+		}
+
+		hash = assoofs_hash(block, size);
+
+		// look for an identical block (confirming the match, as hashes can collide)
+		for (j = 0; j < count; j++)
+			if (hashes[j] == hash && sizes[j] == size && !memcmp(blocks[j], block, size))
+				break;
+
+		if (j < count) {
+
+			if (inode->data_block_number != numbers[j]) {
+
+				printf("Sharing block %llu with inode %llu (instead of block %llu)\n", (unsigned long long) numbers[j], (unsigned long long) inode->inode_no, (unsigned long long) inode->data_block_number);
+
+				img->released[inode->data_block_number] = 1;
+				inode->data_block_number = numbers[j];
+				(*shared)++;
+			}
+
+			continue;
+		}
+
+		// remember the block
+		memcpy(blocks[count], block, size);
+		numbers[count] = inode->data_block_number;
+		hashes[count] = hash;
+		sizes[count] = size;
+		count++;
+	}
+
+	return 0;
+}
+
+/**
+ * Rebuild the reference counts, the free blocks and the share table from the inode store
+ */
+static int rebuild_share_table(struct image *img, int *freed) {
+
+	char block[ASSOOFS_BLOCK_SIZE];
+	struct assoofs_share_entry *entry = img->core.share_table;
+	struct assoofs_inode *inode;
+	uint64_t one = 1;
+	uint64_t size;
+	uint64_t i;
+
+	*freed = 0;
+
+	// count the users of every block
+	memset(img->refcount, 0, sizeof(img->refcount));
+
+	for (i = 0; i < img->core.sb.inodes_count; i++)
+		if (img->core.inodes[i].data_block_number)
+			img->refcount[img->core.inodes[i].data_block_number]++;
+
+	// free the released blocks no longer used by any inode
+	for (i = ASSOOFS_LAST_RESERVED_BLOCK + 1; i < ASSOOFS_FILESYSTEM_MAX_OBJECTS; i++) {
+
+		if (!img->released[i] || img->refcount[i])
+			continue;
+
+		img->core.sb.free_blocks |= one << i;
+		(*freed)++;
+	}
+
+	// create the share table if needed
+	if (!img->core.sb.share_table_block) {
+
+		for (i = ASSOOFS_LAST_RESERVED_BLOCK + 1; i < ASSOOFS_FILESYSTEM_MAX_OBJECTS; i++)
+			if (img->core.sb.free_blocks & (one << i))
+				break;
+
+		if (i >= ASSOOFS_FILESYSTEM_MAX_OBJECTS) {
+
+			printf("Cant create the share table: No more free blocks available\n");
+			return -1;
+		}
+
+		img->core.sb.free_blocks &= ~(one << i);
+		img->core.sb.share_table_block = i;
+	}
+
+	// store the hash and the users of every file block
+	memset(img->core.share_table, 0, sizeof(img->core.share_table));
+
+	for (i = 0; i < img->core.sb.inodes_count; i++) {
+
+		inode = &img->core.inodes[i];
+
+		// every block gets a single entry
+		if (!S_ISREG(inode->mode) || !img->refcount[inode->data_block_number])
+			continue;
+
+		if (assoofs_read_image_block(&img->core, inode->data_block_number, block))
+			return -1;
+
+		// blocks without a valid hash only need an entry if they are shared
+		size = stored_size(inode, block);
+		if (size > ASSOOFS_BLOCK_SIZE)
+			size = 0;
+
+		if (!size && img->refcount[inode->data_block_number] <= 1)
+			continue;
+
+		if (entry >= img->core.share_table + ASSOOFS_SHARE_TABLE_ENTRIES) {
+
+			printf("The share table is full\n");
+			return -1;
+		}
+
+		entry->hash = size ? assoofs_hash(block, size) : 0;
+		entry->block = inode->data_block_number;
+		entry->refcount = img->refcount[inode->data_block_number];
+		entry->size = size;
+		entry++;
+
+		img->refcount[inode->data_block_number] = 0;
+	}
+
+	return 0;
+}
+
+/**
+ * Main
+ */
+int main(int argc, char *argv[]) {
+
+	int code = -1;
+	int shared;
+	int freed;
+	static struct image img;
+
+	// Verify the parameters
+	if (argc != 2) {
+		printf("Usage: ./dedup.assoofs <device>\n");
+		return code;
+	}
+
+	// Open the (unmounted) image for writing
+	if (assoofs_open_image(&img.core, argv[1], 0))
+		return code;
+
+	// Deduplicate the files and write the metadata back
+	do {
+		if (share_blocks(&img, &shared))
+			break;
+
+		if (rebuild_share_table(&img, &freed))
+			break;
+
+		if (assoofs_sync_share_table(&img.core))
+			break;
+
+		if (assoofs_sync_inode_store(&img.core))
+			break;
+
+		if (assoofs_sync_super(&img.core))
+			break;
+
+		printf("Deduplicated %d files, %d blocks freed\n", shared, freed);
+		code = 0;
+	} while (0);
+
+	// Close the file and exit
+	assoofs_close_image(&img.core);
+	return code;
+}
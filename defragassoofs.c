@@ -0,0 +1,83 @@
+/**
+ * Include dependencies
+ */
+#include <unistd.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// workaround for the timespec64
+#define timespec64 timespec
+
+#include "assoofs.h"
+
+/**
+ * Move the data block of a file to the first free block from a goal
+ */
+static int defrag_file(const char *path, uint64_t *goal) {
+
+	struct assoofs_defrag defrag;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1) {
+
+		printf("Error opening %s\n", path);
+		return -1;
+	}
+
+	defrag.goal = *goal;
+	defrag.block = 0;
+
+	if (ioctl(fd, ASSOOFS_IOC_DEFRAG, &defrag)) {
+
+		perror(path);
+		close(fd);
+		return -1;
+	}
+
+	close(fd);
+
+	// holes have no block to move
+	if (!defrag.block) {
+
+		printf("%s: No data block\n", path);
+		return 0;
+	}
+
+	printf("%s: Block %llu\n", path, (unsigned long long) defrag.block);
+
+	// the next file goes right after this one
+	*goal = defrag.block + 1;
+
+	return 0;
+}
+
+/**
+ * Main
+ */
+int main(int argc, char *argv[]) {
+
+	uint64_t goal = 0;
+	int code = 0;
+	int i;
+
+	// Verify the parameters
+	if (argc < 2) {
+		printf("Usage: ./defrag.assoofs <file>...\n");
+		return -1;
+	}
+
+	// Place the files one after another, in the given order
+	for (i = 1; i < argc; i++)
+		if (defrag_file(argv[i], &goal))
+			code = -1;
+
+	return code;
+}
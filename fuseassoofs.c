@@ -0,0 +1,543 @@
+/**
+ * Include dependencies
+ */
+#define FUSE_USE_VERSION 34
+
+#include <unistd.h>
+#include <stdio.h>
+#include <errno.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/statvfs.h>
+#include <fuse_lowlevel.h>
+
+#include "libassoofs.h"
+
+/**
+ * Some constants
+ */
+#define ATTR_TIMEOUT    1.0     // The seconds the kernel caches attributes and names (the daemon is the only writer)
+
+/**
+ * The mounted image, shared by all the worker threads
+ */
+static struct assoofs_image img;
+
+// readers (lookups, attributes, reads) run in parallel, changes to the image are exclusive
+static pthread_rwlock_t img_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+/**
+ * Get an inode for a request, replying with an error if it doesnt exist
+ * NOTE: the image lock must be held
+ */
+static struct assoofs_inode *get_inode(fuse_req_t req, fuse_ino_t ino) {
+
+	struct assoofs_inode *inode = assoofs_get_inode(&img, ino);
+
+	if (!inode)
+		fuse_reply_err(req, ENOENT);
+
+	return inode;
+}
+
+/**
+ * Reply with the entry of an inode
+ * NOTE: the image lock must be held
+ */
+static void reply_entry(fuse_req_t req, const struct assoofs_inode *inode) {
+
+	struct fuse_entry_param entry;
+
+	memset(&entry, 0, sizeof(entry));
+	entry.ino = inode->inode_no;
+	entry.attr_timeout = ATTR_TIMEOUT;
+	entry.entry_timeout = ATTR_TIMEOUT;
+	assoofs_stat(&img, inode, &entry.attr);
+
+	fuse_reply_entry(req, &entry);
+}
+
+/**
+ * Find a children file inside a directory
+ */
+static void fuse_assoofs_lookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
+
+	struct assoofs_inode *dir;
+	struct assoofs_inode *inode;
+	int code;
+
+	pthread_rwlock_rdlock(&img_lock);
+
+	dir = get_inode(req, parent);
+
+	if (dir) {
+
+		code = assoofs_lookup(&img, dir, name, &inode);
+
+		if (code)
+			fuse_reply_err(req, -code);
+		else
+			reply_entry(req, inode);
+	}
+
+	pthread_rwlock_unlock(&img_lock);
+}
+
+/**
+ * Get the attributes of an inode
+ */
+static void fuse_assoofs_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+
+	struct assoofs_inode *inode;
+	struct stat st;
+
+	pthread_rwlock_rdlock(&img_lock);
+
+	inode = get_inode(req, ino);
+
+	if (inode) {
+
+		assoofs_stat(&img, inode, &st);
+		fuse_reply_attr(req, &st, ATTR_TIMEOUT);
+	}
+
+	pthread_rwlock_unlock(&img_lock);
+}
+
+/**
+ * Change the attributes of an inode (only the size and the timestamps are stored)
+ */
+static void fuse_assoofs_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set, struct fuse_file_info *fi) {
+
+	struct assoofs_inode *inode;
+	struct timespec now;
+	struct stat st;
+	int code = 0;
+
+	pthread_rwlock_wrlock(&img_lock);
+
+	inode = get_inode(req, ino);
+
+	if (inode) {
+
+		// the image keeps no owner and the core cannot rewrite the mode, so
+		// only requests that leave them as they are may succeed
+		assoofs_stat(&img, inode, &st);
+		if ((to_set & FUSE_SET_ATTR_MODE) && (attr->st_mode & 07777) != (st.st_mode & 07777))
+			code = -EPERM;
+		if ((to_set & FUSE_SET_ATTR_UID) && attr->st_uid != st.st_uid)
+			code = -EPERM;
+		if ((to_set & FUSE_SET_ATTR_GID) && attr->st_gid != st.st_gid)
+			code = -EPERM;
+
+		if (!code && (to_set & FUSE_SET_ATTR_SIZE))
+			code = assoofs_truncate(&img, inode, attr->st_size);
+
+		if (!code && (to_set & (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME))) {
+
+			clock_gettime(CLOCK_REALTIME, &now);
+
+			if (to_set & FUSE_SET_ATTR_ATIME_NOW)
+				attr->st_atim = now;
+			if (to_set & FUSE_SET_ATTR_MTIME_NOW)
+				attr->st_mtim = now;
+
+			code = assoofs_set_times(&img, inode, (to_set & FUSE_SET_ATTR_ATIME) ? &attr->st_atim : NULL, (to_set & FUSE_SET_ATTR_MTIME) ? &attr->st_mtim : NULL);
+		}
+
+		if (code) {
+
+			fuse_reply_err(req, -code);
+
+		} else {
+
+			assoofs_stat(&img, inode, &st);
+			fuse_reply_attr(req, &st, ATTR_TIMEOUT);
+		}
+	}
+
+	pthread_rwlock_unlock(&img_lock);
+}
+
+/**
+ * Read a whole directory
+ */
+static void fuse_assoofs_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi) {
+
+	union assoofs_dir_block block;
+	struct assoofs_dir_record_entry *record = block.record;
+	struct assoofs_inode *dir;
+	struct stat st;
+	char *buf;
+	size_t used = 0;
+	size_t entry_size;
+	uint64_t i;
+
+	pthread_rwlock_rdlock(&img_lock);
+
+	dir = get_inode(req, ino);
+	if (!dir) goto out;
+
+	if (!S_ISDIR(dir->mode)) {
+
+		fuse_reply_err(req, ENOTDIR);
+		goto out;
+	}
+
+	if (assoofs_read_image_block(&img, dir->data_block_number, block.data)) {
+
+		fuse_reply_err(req, EIO);
+		goto out;
+	}
+
+	buf = malloc(size);
+	if (!buf) {
+
+		fuse_reply_err(req, ENOMEM);
+		goto out;
+	}
+
+	// the offset of each entry is the position of the next record
+	memset(&st, 0, sizeof(st));
+
+	for (i = off; i < dir->dir_children_count; i++) {
+
+		st.st_ino = record[i].inode_no;
+		entry_size = fuse_add_direntry(req, buf + used, size - used, record[i].filename, &st, i + 1);
+
+		if (entry_size > size - used)
+			break;
+
+		used += entry_size;
+	}
+
+	fuse_reply_buf(req, buf, used);
+	free(buf);
+
+out:
+	pthread_rwlock_unlock(&img_lock);
+}
+
+/**
+ * Read from a file, splicing the data straight from the image
+ */
+static void fuse_assoofs_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi) {
+
+	struct fuse_bufvec data = FUSE_BUFVEC_INIT(0);
+	struct assoofs_inode *inode;
+	char buf[ASSOOFS_BLOCK_SIZE];
+	ssize_t nbytes;
+
+	pthread_rwlock_rdlock(&img_lock);
+
+	inode = get_inode(req, ino);
+	if (!inode) goto out;
+
+	// plain data blocks are moved with splice, without copying them to the daemon (the reply is sent before the block can change)
+	if (S_ISREG(inode->mode) && inode->data_block_number && !(inode->mode & ASSOOFS_INODE_COMPRESSED)) {
+
+		if ((uint64_t) off >= inode->file_size)
+			size = 0;
+		else if (size > inode->file_size - off)
+			size = inode->file_size - off;
+
+		data.buf[0].size = size;
+		data.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+		data.buf[0].fd = img.fd;
+		data.buf[0].pos = inode->data_block_number * ASSOOFS_BLOCK_SIZE + off;
+
+		fuse_reply_data(req, &data, FUSE_BUF_SPLICE_MOVE);
+		goto out;
+	}
+
+	// holes (and errors) go through the core
+	nbytes = assoofs_read(&img, inode, buf, size < sizeof(buf) ? size : sizeof(buf), off);
+
+	if (nbytes < 0)
+		fuse_reply_err(req, -nbytes);
+	else
+		fuse_reply_buf(req, buf, nbytes);
+
+out:
+	pthread_rwlock_unlock(&img_lock);
+}
+
+/**
+ * Write to a file
+ */
+static void fuse_assoofs_write(fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size, off_t off, struct fuse_file_info *fi) {
+
+	struct assoofs_inode *inode;
+	ssize_t nbytes;
+
+	pthread_rwlock_wrlock(&img_lock);
+
+	inode = get_inode(req, ino);
+
+	if (inode) {
+
+		nbytes = assoofs_write(&img, inode, buf, size, off);
+
+		if (nbytes < 0)
+			fuse_reply_err(req, -nbytes);
+		else
+			fuse_reply_write(req, nbytes);
+	}
+
+	pthread_rwlock_unlock(&img_lock);
+}
+
+/**
+ * Create a file or directory, replying with its entry (and opening files)
+ */
+static void create_inode(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, struct fuse_file_info *fi) {
+
+	struct assoofs_inode *dir;
+	struct assoofs_inode *inode;
+	struct fuse_entry_param entry;
+	int code;
+
+	pthread_rwlock_wrlock(&img_lock);
+
+	dir = get_inode(req, parent);
+	if (!dir) goto out;
+
+	code = assoofs_create(&img, dir, name, mode, &inode);
+
+	if (code) {
+
+		fuse_reply_err(req, -code);
+		goto out;
+	}
+
+	if (!fi) {
+
+		reply_entry(req, inode);
+		goto out;
+	}
+
+	memset(&entry, 0, sizeof(entry));
+	entry.ino = inode->inode_no;
+	entry.attr_timeout = ATTR_TIMEOUT;
+	entry.entry_timeout = ATTR_TIMEOUT;
+	assoofs_stat(&img, inode, &entry.attr);
+
+	fuse_reply_create(req, &entry, fi);
+
+out:
+	pthread_rwlock_unlock(&img_lock);
+}
+
+/**
+ * Create a file
+ */
+static void fuse_assoofs_create(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, struct fuse_file_info *fi) {
+
+	create_inode(req, parent, name, mode, fi);
+}
+
+/**
+ * Create a directory
+ */
+static void fuse_assoofs_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode) {
+
+	create_inode(req, parent, name, S_IFDIR | mode, NULL);
+}
+
+/**
+ * Create a symlink
+ */
+static void fuse_assoofs_symlink(fuse_req_t req, const char *link, fuse_ino_t parent, const char *name) {
+
+	struct assoofs_inode *dir;
+	struct assoofs_inode *inode;
+	int code;
+
+	pthread_rwlock_wrlock(&img_lock);
+
+	dir = get_inode(req, parent);
+
+	if (dir) {
+
+		code = assoofs_symlink(&img, dir, name, link, &inode);
+
+		if (code)
+			fuse_reply_err(req, -code);
+		else
+			reply_entry(req, inode);
+	}
+
+	pthread_rwlock_unlock(&img_lock);
+}
+
+/**
+ * Read the target of a symlink
+ */
+static void fuse_assoofs_readlink(fuse_req_t req, fuse_ino_t ino) {
+
+	struct assoofs_inode *inode;
+	char link[ASSOOFS_BLOCK_SIZE];
+	ssize_t code;
+
+	pthread_rwlock_rdlock(&img_lock);
+
+	inode = get_inode(req, ino);
+
+	if (inode) {
+
+		code = assoofs_readlink(&img, inode, link, sizeof(link));
+
+		if (code < 0)
+			fuse_reply_err(req, -code);
+		else
+			fuse_reply_readlink(req, link);
+	}
+
+	pthread_rwlock_unlock(&img_lock);
+}
+
+/**
+ * Rename a file or folder
+ */
+static void fuse_assoofs_rename(fuse_req_t req, fuse_ino_t parent, const char *name, fuse_ino_t newparent, const char *newname, unsigned int flags) {
+
+	struct assoofs_inode *old_dir;
+	struct assoofs_inode *new_dir;
+
+	pthread_rwlock_wrlock(&img_lock);
+
+	old_dir = get_inode(req, parent);
+	new_dir = old_dir ? get_inode(req, newparent) : NULL;
+
+	if (new_dir)
+		fuse_reply_err(req, -assoofs_rename(&img, old_dir, name, new_dir, newname, flags));
+
+	pthread_rwlock_unlock(&img_lock);
+}
+
+/**
+ * Get the filesystem usage
+ */
+static void fuse_assoofs_statfs(fuse_req_t req, fuse_ino_t ino) {
+
+	struct statvfs st;
+
+	memset(&st, 0, sizeof(st));
+
+	pthread_rwlock_rdlock(&img_lock);
+
+	st.f_bsize = ASSOOFS_BLOCK_SIZE;
+	st.f_frsize = ASSOOFS_BLOCK_SIZE;
+	st.f_blocks = assoofs_blocks_count(&img.sb);
+	st.f_bfree = __builtin_popcountll(img.sb.free_blocks);
+	st.f_bavail = st.f_bfree;
+	st.f_files = ASSOOFS_FILESYSTEM_MAX_OBJECTS;
+	st.f_ffree = ASSOOFS_FILESYSTEM_MAX_OBJECTS - assoofs_used_inodes(&img);
+	st.f_favail = st.f_ffree;
+	st.f_namemax = ASSOOFS_FILENAME_MAX_LENGTH - 1;
+
+	pthread_rwlock_unlock(&img_lock);
+
+	fuse_reply_statfs(req, &st);
+}
+
+/**
+ * The operations of the filesystem
+ */
+static const struct fuse_lowlevel_ops fuse_assoofs_ops = {
+	.lookup = fuse_assoofs_lookup,
+	.getattr = fuse_assoofs_getattr,
+	.setattr = fuse_assoofs_setattr,
+	.readdir = fuse_assoofs_readdir,
+	.read = fuse_assoofs_read,
+	.write = fuse_assoofs_write,
+	.create = fuse_assoofs_create,
+	.mkdir = fuse_assoofs_mkdir,
+	.symlink = fuse_assoofs_symlink,
+	.readlink = fuse_assoofs_readlink,
+	.rename = fuse_assoofs_rename,
+	.statfs = fuse_assoofs_statfs,
+};
+
+/**
+ * Take the image from the arguments (the first one that is not an option)
+ */
+static int parse_arg(void *data, const char *arg, int key, struct fuse_args *outargs) {
+
+	const char **image = data;
+
+	if (key == FUSE_OPT_KEY_NONOPT && !*image) {
+
+		*image = arg;
+		return 0;
+	}
+
+	return 1;
+}
+
+/**
+ * Main
+ */
+int main(int argc, char *argv[]) {
+
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+	struct fuse_cmdline_opts opts;
+	struct fuse_loop_config config;
+	struct fuse_session *se;
+	const char *image = NULL;
+	int code = -1;
+
+	// Verify the parameters
+	if (fuse_opt_parse(&args, &image, NULL, parse_arg) || fuse_parse_cmdline(&args, &opts))
+		return code;
+
+	if (opts.show_help || !image || !opts.mountpoint) {
+		printf("Usage: ./fuse.assoofs <device> <mountpoint> [options]\n");
+		fuse_cmdline_help();
+		fuse_lowlevel_help();
+		goto free_args;
+	}
+
+	// Open the image
+	if (assoofs_open_image(&img, image, 0))
+		goto free_args;
+
+	// Mount it, serving requests from several threads unless asked not to
+	se = fuse_session_new(&args, &fuse_assoofs_ops, sizeof(fuse_assoofs_ops), NULL);
+	if (!se)
+		goto close_image;
+
+	if (fuse_set_signal_handlers(se))
+		goto destroy_session;
+
+	if (fuse_session_mount(se, opts.mountpoint))
+		goto remove_handlers;
+
+	fuse_daemonize(opts.foreground);
+
+	if (opts.singlethread) {
+
+		code = fuse_session_loop(se);
+
+	} else {
+
+		config.clone_fd = opts.clone_fd;
+		config.max_idle_threads = opts.max_idle_threads;
+		code = fuse_session_loop_mt(se, &config);
+	}
+
+	fuse_session_unmount(se);
+
+remove_handlers:
+	fuse_remove_signal_handlers(se);
+destroy_session:
+	fuse_session_destroy(se);
+close_image:
+	assoofs_close_image(&img);
+free_args:
+	free(opts.mountpoint);
+	fuse_opt_free_args(&args);
+	return code;
+}
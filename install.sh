@@ -7,7 +7,7 @@ sudo /bin/bash -c ":"
 # install dependencies
 echo -e "\033[32m INSTALLING DEPENDENCIES \033[0m"
 sudo add-apt-repository universe -y
-sudo apt install build-essential dwarves -y
+sudo apt install build-essential dwarves libfuse3-dev pkg-config -y
 sudo cp /sys/kernel/btf/vmlinux /usr/lib/modules/`uname -r`/build/
 
 # compile all files
@@ -0,0 +1,935 @@
+/**
+ * Include dependencies
+ */
+#include <unistd.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libassoofs.h"
+
+/**
+ * Open an image, reading its metadata (returns 0 or a negative error code)
+ */
+int assoofs_open_image(struct assoofs_image *img, const char *path, int readonly) {
+
+	off_t size;
+	int code = -EINVAL;
+
+	memset(img, 0, sizeof(*img));
+	img->readonly = readonly;
+
+	img->fd = open(path, readonly ? O_RDONLY : O_RDWR);
+	if (img->fd == -1) {
+
+		printf("Error opening the device\n");
+		return -errno;
+	}
+
+	do {
+		if (assoofs_read_image_block(img, ASSOOFS_SUPERBLOCK_BLOCK_NUMBER, &img->sb)) {
+
+			code = -EIO;
+			break;
+		}
+
+		if (img->sb.magic != ASSOOFS_MAGIC || img->sb.block_size != ASSOOFS_BLOCK_SIZE || assoofs_check_features(&img->sb) < 0) {
+
+			printf("The image is not a supported assoofs filesystem\n");
+			break;
+		}
+
+		// the packed layout is only understood by the kernel module
+		if (img->sb.version != ASSOOFS_VERSION_1 && (img->sb.feature_incompat & ASSOOFS_FEATURE_INCOMPAT_PACKED)) {
+
+			printf("Packed images are not supported\n");
+			break;
+		}
+
+		// the tools work on a single image file
+		if (assoofs_striped(&img->sb)) {
+
+			printf("Striped volumes are not supported\n");
+			break;
+		}
+
+		if (!readonly && assoofs_check_features(&img->sb)) {
+
+			printf("The image uses features that can only be read\n");
+			code = -EROFS;
+			break;
+		}
+
+		// the image must hold the whole volume
+		size = lseek(img->fd, 0, SEEK_END);
+
+		if (size == (off_t) -1 || assoofs_blocks_count(&img->sb) > (uint64_t) size / ASSOOFS_BLOCK_SIZE) {
+
+			printf("The image is smaller than the volume (%llu blocks)\n", (unsigned long long) assoofs_blocks_count(&img->sb));
+			break;
+		}
+
+		if (assoofs_read_image_block(img, ASSOOFS_INODESTORE_BLOCK_NUMBER, img->inode_store)) {
+
+			code = -EIO;
+			break;
+		}
+
+		img->inodes = (struct assoofs_inode *) img->inode_store;
+
+		// images without a share table get an empty one (only written once it is created)
+		if (img->sb.share_table_block && assoofs_read_image_block(img, img->sb.share_table_block, img->share_table)) {
+
+			code = -EIO;
+			break;
+		}
+
+		// images without timestamps use the creation times
+		if (assoofs_has_times(&img->sb) && assoofs_read_image_block(img, img->sb.times_block, img->times.data)) {
+
+			code = -EIO;
+			break;
+		}
+
+		return 0;
+	} while (0);
+
+	close(img->fd);
+	return code;
+}
+
+/**
+ * Close an image
+ */
+void assoofs_close_image(struct assoofs_image *img) {
+
+	fsync(img->fd);
+	close(img->fd);
+}
+
+/**
+ * Read a block from the image
+ */
+int assoofs_read_image_block(struct assoofs_image *img, uint64_t number, void *block) {
+
+	if (pread(img->fd, block, ASSOOFS_BLOCK_SIZE, number * ASSOOFS_BLOCK_SIZE) != ASSOOFS_BLOCK_SIZE) {
+
+		printf("Error reading block %llu\n", (unsigned long long) number);
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Write a block to the image
+ */
+int assoofs_write_image_block(struct assoofs_image *img, uint64_t number, const void *block) {
+
+	if (img->readonly)
+		return -1;
+
+	if (pwrite(img->fd, block, ASSOOFS_BLOCK_SIZE, number * ASSOOFS_BLOCK_SIZE) != ASSOOFS_BLOCK_SIZE) {
+
+		printf("Error writing block %llu\n", (unsigned long long) number);
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Write the superblock to the image
+ */
+int assoofs_sync_super(struct assoofs_image *img) {
+
+	// keep the summary counters valid (the kernel trusts them on clean filesystems)
+	img->sb.free_blocks_count = __builtin_popcountll(img->sb.free_blocks);
+	img->sb.free_inodes_count = ASSOOFS_FILESYSTEM_MAX_OBJECTS - assoofs_used_inodes(img);
+
+
+	return assoofs_write_image_block(img, ASSOOFS_SUPERBLOCK_BLOCK_NUMBER, &img->sb);
+}
+
+/**
+ * Write the inode store (with the bloom filters) to the image
+ */
+int assoofs_sync_inode_store(struct assoofs_image *img) {
+
+	return assoofs_write_image_block(img, ASSOOFS_INODESTORE_BLOCK_NUMBER, img->inode_store);
+}
+
+/**
+ * Write the share table to the image (if there is one)
+ */
+int assoofs_sync_share_table(struct assoofs_image *img) {
+
+	if (!img->sb.share_table_block)
+		return 0;
+
+	return assoofs_write_image_block(img, img->sb.share_table_block, img->share_table);
+}
+
+/**
+ * Write the timestamps to the image (if there are any)
+ */
+int assoofs_sync_times(struct assoofs_image *img) {
+
+	if (!assoofs_has_times(&img->sb))
+		return 0;
+
+	return assoofs_write_image_block(img, img->sb.times_block, img->times.data);
+}
+
+/**
+ * Allocate the first free block, returning its number (or 0 if there are no free blocks)
+ */
+uint64_t assoofs_alloc_block(struct assoofs_image *img) {
+
+	uint64_t one = 1;
+	uint64_t i;
+
+	for (i = ASSOOFS_LAST_RESERVED_BLOCK + 1; i < assoofs_blocks_count(&img->sb); i++) {
+
+		if (!(img->sb.free_blocks & (one << i)))
+			continue;
+
+		img->sb.free_blocks &= ~(one << i);
+
+		if (assoofs_sync_super(img)) {
+
+			img->sb.free_blocks |= one << i;
+			return 0;
+		}
+
+		return i;
+	}
+
+	return 0;
+}
+
+/**
+ * Mark a block as free
+ */
+void assoofs_free_block(struct assoofs_image *img, uint64_t block) {
+
+	uint64_t one = 1;
+
+	img->sb.free_blocks |= one << block;
+	assoofs_sync_super(img);
+}
+
+/**
+ * Find the share table entry of a block (or NULL if it has none)
+ */
+struct assoofs_share_entry *assoofs_find_share(struct assoofs_image *img, uint64_t block) {
+
+	uint64_t i;
+
+	if (!img->sb.share_table_block)
+		return NULL;
+
+	for (i = 0; i < ASSOOFS_SHARE_TABLE_ENTRIES; i++)
+		if (img->share_table[i].block == block)
+			return &img->share_table[i];
+
+	return NULL;
+}
+
+/**
+ * Drop a reference to a data block, freeing it when it has no more users
+ */
+int assoofs_release_block(struct assoofs_image *img, uint64_t block) {
+
+	struct assoofs_share_entry *entry;
+
+	// holes have no block to release
+	if (!block) return 0;
+
+	entry = assoofs_find_share(img, block);
+
+	if (entry && entry->refcount > 1) {
+
+		entry->refcount--;
+
+	} else {
+
+		if (entry)
+			memset(entry, 0, sizeof(*entry));
+
+		assoofs_free_block(img, block);
+	}
+
+	return entry ? assoofs_sync_share_table(img) : 0;
+}
+
+/**
+ * Count the inodes in use (the slots freed by the kernel before the last inode are not)
+ */
+uint64_t assoofs_used_inodes(const struct assoofs_image *img) {
+
+	uint64_t count = 0;
+	uint64_t i;
+
+	for (i = 0; i < img->sb.inodes_count; i++)
+		if (img->inodes[i].inode_no)
+			count++;
+
+	return count;
+}
+
+/**
+ * Get an inode from the store with the specified number (or NULL if it doesnt exist)
+ */
+struct assoofs_inode *assoofs_get_inode(struct assoofs_image *img, uint64_t inode_no) {
+
+	uint64_t i;
+
+	for (i = 0; i < img->sb.inodes_count; i++)
+		if (img->inodes[i].inode_no == inode_no)
+			return &img->inodes[i];
+
+	return NULL;
+}
+
+/**
+ * Update the change time of an inode (and the modification time if its data changed), writing the timestamps
+ */
+static int touch(struct assoofs_image *img, const struct assoofs_inode *inode, int modified) {
+
+	struct assoofs_times *times = &img->times.times[inode->inode_no - 1];
+	struct timespec now;
+
+	if (!assoofs_has_times(&img->sb))
+		return 0;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+
+	times->ctime = now;
+	if (modified)
+		times->mtime = now;
+
+	return assoofs_sync_times(img) ? -EIO : 0;
+}
+
+/**
+ * Fill the attributes of an inode (everything is owned by the caller)
+ */
+void assoofs_stat(const struct assoofs_image *img, const struct assoofs_inode *inode, struct stat *st) {
+
+	const struct assoofs_times *times = &img->times.times[inode->inode_no - 1];
+
+	memset(st, 0, sizeof(*st));
+
+	st->st_ino = inode->inode_no;
+	st->st_mode = inode->mode & (S_IFMT | 07777);
+	st->st_nlink = S_ISDIR(inode->mode) ? 2 : 1;
+	st->st_uid = getuid();
+	st->st_gid = getgid();
+	st->st_size = S_ISDIR(inode->mode) ? ASSOOFS_BLOCK_SIZE : inode->file_size;
+	st->st_blksize = ASSOOFS_BLOCK_SIZE;
+	st->st_blocks = inode->data_block_number ? ASSOOFS_BLOCK_SIZE / 512 : 0;
+
+	if (!assoofs_has_times(&img->sb)) {
+
+		st->st_atim = inode->time;
+		st->st_mtim = inode->time;
+		st->st_ctim = inode->time;
+		return;
+	}
+
+	st->st_atim = times->atime;
+	st->st_mtim = times->mtime;
+	st->st_ctim = times->ctime;
+}
+
+/**
+ * Find the position of a filename inside the records of a directory (or -1 if it is not present)
+ */
+int assoofs_find_record(const struct assoofs_dir_record_entry *record, uint64_t count, const char *filename) {
+
+	uint64_t i;
+
+	for (i = 0; i < count; i++)
+		if (!strcmp(record[i].filename, filename))
+			return i;
+
+	return -1;
+}
+
+/**
+ * Rebuild the bloom filter of a directory from its records
+ */
+static void fill_bloom(struct assoofs_image *img, uint64_t inode_no, const struct assoofs_dir_record_entry *record, uint64_t count) {
+
+	uint8_t *bloom = assoofs_bloom(img->inode_store, inode_no);
+
+	memset(bloom, 0, ASSOOFS_BLOOM_SIZE);
+
+	for (; count; count--, record++)
+		assoofs_bloom_add(bloom, record->filename, strlen(record->filename));
+}
+
+/**
+ * Rebuild the bloom filters of every directory, marking them as up to date (the inode store and the superblock are written by the caller)
+ */
+int assoofs_build_blooms(struct assoofs_image *img) {
+
+	union assoofs_dir_block block;
+	struct assoofs_inode *inode;
+	uint64_t i;
+
+	for (i = 0; i < img->sb.inodes_count; i++) {
+
+		inode = &img->inodes[i];
+
+		if (!S_ISDIR(inode->mode))
+			continue;
+
+		if (assoofs_read_image_block(img, inode->data_block_number, block.data))
+			return -EIO;
+
+		fill_bloom(img, inode->inode_no, block.record, inode->dir_children_count);
+	}
+
+	assoofs_set_blooms(&img->sb);
+	return 0;
+}
+
+/**
+ * Create the timestamps block if there is none, starting every inode from its creation time (the superblock is written by the caller)
+ */
+int assoofs_build_times(struct assoofs_image *img) {
+
+	uint64_t block;
+	uint64_t i;
+
+	if (assoofs_has_times(&img->sb))
+		return 0;
+
+	block = assoofs_alloc_block(img);
+	if (!block)
+		return -ENOSPC;
+
+	memset(img->times.data, 0, sizeof(img->times.data));
+
+	for (i = 0; i < img->sb.inodes_count; i++) {
+
+		// the slots freed by the kernel have no inode
+		if (!img->inodes[i].inode_no)
+			continue;
+
+		img->times.times[img->inodes[i].inode_no - 1].atime = img->inodes[i].time;
+		img->times.times[img->inodes[i].inode_no - 1].mtime = img->inodes[i].time;
+		img->times.times[img->inodes[i].inode_no - 1].ctime = img->inodes[i].time;
+	}
+
+	if (assoofs_write_image_block(img, block, img->times.data)) {
+
+		assoofs_free_block(img, block);
+		return -EIO;
+	}
+
+	assoofs_set_times_block(&img->sb, block);
+	return 0;
+}
+
+/**
+ * Find a children file inside a directory
+ */
+int assoofs_lookup(struct assoofs_image *img, struct assoofs_inode *dir, const char *filename, struct assoofs_inode **inode) {
+
+	union assoofs_dir_block block;
+	struct assoofs_dir_record_entry *record = block.record;
+	int i;
+
+	if (!S_ISDIR(dir->mode))
+		return -ENOTDIR;
+
+	// names missing from the bloom filter of the directory are not in it (if the filters are up to date)
+	if (assoofs_has_blooms(&img->sb) && !assoofs_bloom_test(assoofs_bloom(img->inode_store, dir->inode_no), filename, strlen(filename)))
+		return -ENOENT;
+
+	if (assoofs_read_image_block(img, dir->data_block_number, block.data))
+		return -EIO;
+
+	i = assoofs_find_record(record, dir->dir_children_count, filename);
+	if (i < 0)
+		return -ENOENT;
+
+	*inode = assoofs_get_inode(img, record[i].inode_no);
+	return *inode ? 0 : -EIO;
+}
+
+/**
+ * Create a file, directory or empty symlink (files start as a hole, getting their block on the first write)
+ */
+int assoofs_create(struct assoofs_image *img, struct assoofs_inode *dir, const char *filename, mode_t mode, struct assoofs_inode **inode) {
+
+	union assoofs_dir_block block;
+	struct assoofs_dir_record_entry *record = block.record;
+	struct assoofs_inode *new_inode;
+	struct timespec now;
+	uint64_t slot;
+
+	if (!S_ISDIR(dir->mode))
+		return -ENOTDIR;
+
+	if (!S_ISDIR(mode) && !S_ISREG(mode) && !S_ISLNK(mode))
+		return -EINVAL;
+
+	if (strlen(filename) >= ASSOOFS_FILENAME_MAX_LENGTH)
+		return -ENAMETOOLONG;
+
+	// reuse the first slot freed by the kernel, appending if there is none (inode numbers follow their slots)
+	for (slot = 0; slot < img->sb.inodes_count && img->inodes[slot].inode_no; slot++);
+
+	if (slot >= ASSOOFS_FILESYSTEM_MAX_OBJECTS || dir->dir_children_count >= ASSOOFS_DIR_MAX_RECORDS)
+		return -ENOSPC;
+
+	if (assoofs_read_image_block(img, dir->data_block_number, block.data))
+		return -EIO;
+
+	if (assoofs_find_record(record, dir->dir_children_count, filename) >= 0)
+		return -EEXIST;
+
+	// fill its slot of the inode store (cleared again if the create fails)
+	new_inode = &img->inodes[slot];
+	memset(new_inode, 0, sizeof(*new_inode));
+
+	new_inode->mode = mode;
+	new_inode->inode_no = slot + 1;
+	clock_gettime(CLOCK_REALTIME, &now);
+	new_inode->time = now;
+
+	img->times.times[new_inode->inode_no - 1].atime = now;
+	img->times.times[new_inode->inode_no - 1].mtime = now;
+	img->times.times[new_inode->inode_no - 1].ctime = now;
+
+	// directories get their block (with no records) right away
+	if (S_ISDIR(mode)) {
+
+		char empty[ASSOOFS_BLOCK_SIZE] = { 0 };
+
+		new_inode->data_block_number = assoofs_alloc_block(img);
+		if (!new_inode->data_block_number) {
+
+			memset(new_inode, 0, sizeof(*new_inode));
+			return -ENOSPC;
+		}
+
+		if (assoofs_write_image_block(img, new_inode->data_block_number, empty)) {
+
+			assoofs_free_block(img, new_inode->data_block_number);
+			memset(new_inode, 0, sizeof(*new_inode));
+			return -EIO;
+		}
+
+		memset(assoofs_bloom(img->inode_store, new_inode->inode_no), 0, ASSOOFS_BLOOM_SIZE);
+	}
+
+	// add the record to the parent directory
+	record[dir->dir_children_count].inode_no = new_inode->inode_no;
+	strcpy(record[dir->dir_children_count].filename, filename);
+
+	if (assoofs_write_image_block(img, dir->data_block_number, block.data)) {
+
+		if (new_inode->data_block_number)
+			assoofs_free_block(img, new_inode->data_block_number);
+		memset(new_inode, 0, sizeof(*new_inode));
+		return -EIO;
+	}
+
+	dir->dir_children_count++;
+	assoofs_bloom_add(assoofs_bloom(img->inode_store, dir->inode_no), filename, strlen(filename));
+
+	// save the inode store and the superblock
+	if (slot == img->sb.inodes_count)
+		img->sb.inodes_count++;
+
+	if (assoofs_sync_inode_store(img) || assoofs_sync_super(img))
+		return -EIO;
+
+	*inode = new_inode;
+
+	// the timestamps of the new inode are written with the ones of the parent
+	return touch(img, dir, 1);
+}
+
+/**
+ * Rename a file or folder, only rewriting the records of the parent directories
+ */
+int assoofs_rename(struct assoofs_image *img, struct assoofs_inode *old_dir, const char *old_name, struct assoofs_inode *new_dir, const char *new_name, unsigned int flags) {
+
+	union assoofs_dir_block old_block;
+	union assoofs_dir_block new_block;
+	struct assoofs_dir_record_entry *old_record = old_block.record;
+	struct assoofs_dir_record_entry *new_record = new_block.record;
+	struct assoofs_inode *target;
+	uint64_t inode_no;
+	int same = old_dir->inode_no == new_dir->inode_no;
+	int old_pos;
+	int new_pos;
+
+	if (flags & ~(ASSOOFS_RENAME_NOREPLACE | ASSOOFS_RENAME_EXCHANGE))
+		return -EINVAL;
+
+	if (strlen(new_name) >= ASSOOFS_FILENAME_MAX_LENGTH)
+		return -ENAMETOOLONG;
+
+	if (assoofs_read_image_block(img, old_dir->data_block_number, old_block.data))
+		return -EIO;
+
+	// share the records on the same directory
+	if (same)
+		new_record = old_record;
+	else if (assoofs_read_image_block(img, new_dir->data_block_number, new_block.data))
+		return -EIO;
+
+	old_pos = assoofs_find_record(old_record, old_dir->dir_children_count, old_name);
+	new_pos = assoofs_find_record(new_record, new_dir->dir_children_count, new_name);
+
+	if (old_pos < 0 || (new_pos < 0 && (flags & ASSOOFS_RENAME_EXCHANGE)))
+		return -ENOENT;
+
+	if (new_pos >= 0 && (flags & ASSOOFS_RENAME_NOREPLACE))
+		return -EEXIST;
+
+	// renaming a file onto itself does nothing
+	if (same && old_pos == new_pos)
+		return 0;
+
+	inode_no = old_record[old_pos].inode_no;
+
+	if (flags & ASSOOFS_RENAME_EXCHANGE) {
+
+		// swap the inodes of both records, keeping the names
+		old_record[old_pos].inode_no = new_record[new_pos].inode_no;
+		new_record[new_pos].inode_no = inode_no;
+
+	} else if (same && new_pos < 0) {
+
+		// rename in place
+		strcpy(old_record[old_pos].filename, new_name);
+
+	} else {
+
+		if (new_pos >= 0) {
+
+			// a directory can only be replaced if it is empty
+			target = assoofs_get_inode(img, new_record[new_pos].inode_no);
+
+			if (target && S_ISDIR(target->mode) && target->dir_children_count)
+				return -ENOTEMPTY;
+
+			// NOTE: the replaced inode keeps its slot on the inode store (unlike in the kernel, the FUSE frontend cant tell when its last handle is closed)
+			new_record[new_pos].inode_no = inode_no;
+
+		} else {
+
+			if (new_dir->dir_children_count >= ASSOOFS_DIR_MAX_RECORDS)
+				return -ENOSPC;
+
+			// append the record to the target directory
+			new_record[new_dir->dir_children_count].inode_no = inode_no;
+			strcpy(new_record[new_dir->dir_children_count].filename, new_name);
+			new_dir->dir_children_count++;
+		}
+
+		// remove the source record moving the last one to its place
+		old_dir->dir_children_count--;
+		if ((uint64_t) old_pos != old_dir->dir_children_count)
+			memcpy(&old_record[old_pos], &old_record[old_dir->dir_children_count], sizeof(*old_record));
+	}
+
+	// keep the bloom filters up to date (names cant be removed from them, so the source one is rebuilt)
+	if (!(flags & ASSOOFS_RENAME_EXCHANGE)) {
+
+		fill_bloom(img, old_dir->inode_no, old_record, old_dir->dir_children_count);
+		assoofs_bloom_add(assoofs_bloom(img->inode_store, new_dir->inode_no), new_name, strlen(new_name));
+	}
+
+	// write the changes to the image
+	if (assoofs_write_image_block(img, old_dir->data_block_number, old_block.data))
+		return -EIO;
+
+	if (!same && assoofs_write_image_block(img, new_dir->data_block_number, new_block.data))
+		return -EIO;
+
+	if (assoofs_sync_inode_store(img))
+		return -EIO;
+
+	if (!same && touch(img, new_dir, 1))
+		return -EIO;
+
+	return touch(img, old_dir, 1);
+}
+
+/**
+ * Set the access and modification times of an inode (NULL keeps the current one)
+ */
+int assoofs_set_times(struct assoofs_image *img, struct assoofs_inode *inode, const struct timespec *atime, const struct timespec *mtime) {
+
+	struct assoofs_times *times = &img->times.times[inode->inode_no - 1];
+
+	if (!assoofs_has_times(&img->sb))
+		return -EOPNOTSUPP;
+
+	if (atime)
+		times->atime = *atime;
+	if (mtime)
+		times->mtime = *mtime;
+
+	return touch(img, inode, 0);
+}
+
+/**
+ * Create a symlink (short targets are stored in the inode store, in place of the bloom filter only directories use)
+ */
+int assoofs_symlink(struct assoofs_image *img, struct assoofs_inode *dir, const char *filename, const char *target, struct assoofs_inode **inode) {
+
+	char block[ASSOOFS_BLOCK_SIZE] = { 0 };
+	struct assoofs_inode *link;
+	size_t len = strlen(target);
+	int code;
+
+	if (len >= ASSOOFS_BLOCK_SIZE)
+		return -ENAMETOOLONG;
+
+	code = assoofs_create(img, dir, filename, S_IFLNK | 0777, &link);
+	if (code)
+		return code;
+
+	link->file_size = len;
+
+	if (len <= ASSOOFS_INLINE_LINK_MAX) {
+
+		memset(assoofs_inline_link(img->inode_store, link->inode_no), 0, ASSOOFS_BLOOM_SIZE);
+		memcpy(assoofs_inline_link(img->inode_store, link->inode_no), target, len);
+
+	} else {
+
+		// long ones use a data block
+		link->data_block_number = assoofs_alloc_block(img);
+		if (!link->data_block_number)
+			return -ENOSPC;
+
+		memcpy(block, target, len);
+
+		if (assoofs_write_image_block(img, link->data_block_number, block))
+			return -EIO;
+	}
+
+	*inode = link;
+	return assoofs_sync_inode_store(img) ? -EIO : 0;
+}
+
+/**
+ * Read the target of a symlink (truncated to the buffer, which always ends with a null), returning its length
+ */
+ssize_t assoofs_readlink(struct assoofs_image *img, struct assoofs_inode *inode, char *buf, size_t size) {
+
+	char block[ASSOOFS_BLOCK_SIZE];
+	const char *target = block;
+	size_t len;
+
+	if (!S_ISLNK(inode->mode))
+		return -EINVAL;
+
+	if (!size)
+		return -ERANGE;
+
+	if (!inode->data_block_number)
+		target = assoofs_inline_link(img->inode_store, inode->inode_no);
+	else if (assoofs_read_image_block(img, inode->data_block_number, block))
+		return -EIO;
+
+	len = inode->file_size < size ? inode->file_size : size - 1;
+	memcpy(buf, target, len);
+	buf[len] = '\0';
+
+	return len;
+}
+
+/**
+ * Read from a file (holes read as zeros)
+ */
+ssize_t assoofs_read(struct assoofs_image *img, struct assoofs_inode *inode, char *buf, size_t len, uint64_t pos) {
+
+	char block[ASSOOFS_BLOCK_SIZE];
+
+	if (!S_ISREG(inode->mode))
+		return -EISDIR;
+
+	if (pos >= inode->file_size)
+		return 0;
+
+	if (len > inode->file_size - pos)
+		len = inode->file_size - pos;
+
+	if (!inode->data_block_number) {
+
+		memset(buf, 0, len);
+		return len;
+	}
+
+	// decompressing needs the kernel compressors
+	if (inode->mode & ASSOOFS_INODE_COMPRESSED)
+		return -EOPNOTSUPP;
+
+	if (assoofs_read_image_block(img, inode->data_block_number, block))
+		return -EIO;
+
+	memcpy(buf, block + pos, len);
+	return len;
+}
+
+/**
+ * Get the data block of a file ready to be modified, copying it first if it is shared and filling holes with a zeroed block
+ */
+static int own_block(struct assoofs_image *img, struct assoofs_inode *inode, char *block) {
+
+	struct assoofs_share_entry *entry;
+	uint64_t number;
+
+	if (inode->data_block_number) {
+
+		if (assoofs_read_image_block(img, inode->data_block_number, block))
+			return -EIO;
+
+		entry = assoofs_find_share(img, inode->data_block_number);
+
+		// the block is owned by this file alone
+		if (!entry || entry->refcount <= 1)
+			return 0;
+
+	} else {
+
+		memset(block, 0, ASSOOFS_BLOCK_SIZE);
+	}
+
+	number = assoofs_alloc_block(img);
+	if (!number)
+		return -ENOSPC;
+
+	// drop the reference to the shared block
+	if (assoofs_release_block(img, inode->data_block_number)) {
+
+		assoofs_free_block(img, number);
+		return -EIO;
+	}
+
+	inode->data_block_number = number;
+	return 0;
+}
+
+/**
+ * Write the data block of a file, dropping the (now stale) hash of the block
+ */
+static int store_block(struct assoofs_image *img, struct assoofs_inode *inode, const char *block) {
+
+	struct assoofs_share_entry *entry;
+
+	if (assoofs_write_image_block(img, inode->data_block_number, block))
+		return -EIO;
+
+	entry = assoofs_find_share(img, inode->data_block_number);
+
+	if (entry) {
+
+		memset(entry, 0, sizeof(*entry));
+
+		if (assoofs_sync_share_table(img))
+			return -EIO;
+	}
+
+	return assoofs_sync_inode_store(img) ? -EIO : 0;
+}
+
+/**
+ * Write to a file
+ */
+ssize_t assoofs_write(struct assoofs_image *img, struct assoofs_inode *inode, const char *buf, size_t len, uint64_t pos) {
+
+	char block[ASSOOFS_BLOCK_SIZE];
+	int code;
+
+	if (!S_ISREG(inode->mode))
+		return -EISDIR;
+
+	if (inode->mode & ASSOOFS_INODE_COMPRESSED)
+		return -EOPNOTSUPP;
+
+	if (pos + len > ASSOOFS_BLOCK_SIZE)
+		return -EFBIG;
+
+	code = own_block(img, inode, block);
+	if (code)
+		return code;
+
+	// fill the gap after the end of the file with zeros
+	if (pos > inode->file_size)
+		memset(block + inode->file_size, 0, pos - inode->file_size);
+
+	memcpy(block + pos, buf, len);
+
+	if (pos + len > inode->file_size)
+		inode->file_size = pos + len;
+
+	code = store_block(img, inode, block);
+	if (!code)
+		code = touch(img, inode, 1);
+
+	return code ? code : (ssize_t) len;
+}
+
+/**
+ * Change the size of a file
+ */
+int assoofs_truncate(struct assoofs_image *img, struct assoofs_inode *inode, uint64_t size) {
+
+	char block[ASSOOFS_BLOCK_SIZE];
+	int code;
+
+	if (!S_ISREG(inode->mode))
+		return -EISDIR;
+
+	if (size == inode->file_size)
+		return 0;
+
+	// resizing a compressed cluster would mean recompressing it, so they can only be emptied
+	if (size && (inode->mode & ASSOOFS_INODE_COMPRESSED))
+		return -EOPNOTSUPP;
+
+	if (size > ASSOOFS_BLOCK_SIZE)
+		return -EFBIG;
+
+	if (!size) {
+
+		// empty files give their block back, becoming a hole
+		if (assoofs_release_block(img, inode->data_block_number))
+			return -EIO;
+
+		inode->data_block_number = 0;
+		inode->mode &= ~(ASSOOFS_INODE_COMPRESSED | ASSOOFS_INODE_NOCOMPRESS);
+
+	} else if (inode->data_block_number && size > inode->file_size) {
+
+		// the bytes after the old end of the file must read as zeros
+		code = own_block(img, inode, block);
+		if (code)
+			return code;
+
+		memset(block + inode->file_size, 0, size - inode->file_size);
+		inode->file_size = size;
+
+		code = store_block(img, inode, block);
+		return code ? code : touch(img, inode, 1);
+	}
+
+	// holes (and shrunk blocks) only need the new size
+	inode->file_size = size;
+	return assoofs_sync_inode_store(img) ? -EIO : touch(img, inode, 1);
+}
@@ -0,0 +1,112 @@
+/**
+ * The userspace core of assoofs, working on the same images the kernel module mounts
+ * NOTE: the functions are not thread safe, callers sharing an image must serialize them
+ */
+#ifndef LIBASSOOFS_H
+#define LIBASSOOFS_H
+
+/**
+ * Include dependencies
+ */
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdint.h>
+#include <time.h>
+
+// workaround for the timespec64
+#define timespec64 timespec
+
+#include "assoofs.h"
+
+/**
+ * Rename flags (with the same values as the kernel ones)
+ */
+#define ASSOOFS_RENAME_NOREPLACE    (1 << 0)    // Fail if the new name exists
+#define ASSOOFS_RENAME_EXCHANGE     (1 << 1)    // Swap both names
+
+/**
+ * A directory data block (the records dont fill the whole block)
+ */
+union assoofs_dir_block {
+	char data[ASSOOFS_BLOCK_SIZE];                                  // The raw block
+	struct assoofs_dir_record_entry record[ASSOOFS_DIR_MAX_RECORDS];        // The records of the directory
+};
+
+/**
+ * The timestamps block (the timestamps dont fill the whole block)
+ */
+union assoofs_times_block {
+	char data[ASSOOFS_BLOCK_SIZE];                                  // The raw block
+	struct assoofs_times times[ASSOOFS_FILESYSTEM_MAX_OBJECTS];     // The timestamps by inode number
+};
+
+/**
+ * The in-memory copy of the filesystem metadata
+ */
+struct assoofs_image {
+	int fd;                                                         // The image file
+	int readonly;                                                   // Whether the image was opened read only
+	struct assoofs_super_block sb;                                  // The superblock
+	char inode_store[ASSOOFS_BLOCK_SIZE];                           // The inode store block
+	struct assoofs_inode *inodes;                                   // The inodes (inside the inode store block)
+	struct assoofs_share_entry share_table[ASSOOFS_SHARE_TABLE_ENTRIES];    // The share table (empty if there is none)
+	union assoofs_times_block times;                                // The inode timestamps (empty if there is none)
+};
+
+/**
+ * Open an image, reading its metadata (returns 0 or a negative error code)
+ */
+int assoofs_open_image(struct assoofs_image *img, const char *path, int readonly);
+
+/**
+ * Close an image
+ */
+void assoofs_close_image(struct assoofs_image *img);
+
+/**
+ * Block access
+ */
+int assoofs_read_image_block(struct assoofs_image *img, uint64_t number, void *block);
+int assoofs_write_image_block(struct assoofs_image *img, uint64_t number, const void *block);
+int assoofs_sync_super(struct assoofs_image *img);
+int assoofs_sync_inode_store(struct assoofs_image *img);
+int assoofs_sync_share_table(struct assoofs_image *img);
+int assoofs_sync_times(struct assoofs_image *img);
+
+/**
+ * Block allocation
+ */
+uint64_t assoofs_alloc_block(struct assoofs_image *img);
+void assoofs_free_block(struct assoofs_image *img, uint64_t block);
+struct assoofs_share_entry *assoofs_find_share(struct assoofs_image *img, uint64_t block);
+int assoofs_release_block(struct assoofs_image *img, uint64_t block);
+
+/**
+ * Layout upgrades (see tune.assoofs)
+ */
+int assoofs_build_blooms(struct assoofs_image *img);
+int assoofs_build_times(struct assoofs_image *img);
+
+/**
+ * Inodes and directories (inodes point inside the inode store, and are saved with assoofs_sync_inode_store)
+ * NOTE: the timestamps are only kept on images mounted read-write by the kernel at least once (see assoofs_build_times)
+ */
+uint64_t assoofs_used_inodes(const struct assoofs_image *img);
+struct assoofs_inode *assoofs_get_inode(struct assoofs_image *img, uint64_t inode_no);
+void assoofs_stat(const struct assoofs_image *img, const struct assoofs_inode *inode, struct stat *st);
+int assoofs_find_record(const struct assoofs_dir_record_entry *record, uint64_t count, const char *filename);
+int assoofs_lookup(struct assoofs_image *img, struct assoofs_inode *dir, const char *filename, struct assoofs_inode **inode);
+int assoofs_create(struct assoofs_image *img, struct assoofs_inode *dir, const char *filename, mode_t mode, struct assoofs_inode **inode);
+int assoofs_rename(struct assoofs_image *img, struct assoofs_inode *old_dir, const char *old_name, struct assoofs_inode *new_dir, const char *new_name, unsigned int flags);
+int assoofs_set_times(struct assoofs_image *img, struct assoofs_inode *inode, const struct timespec *atime, const struct timespec *mtime);
+int assoofs_symlink(struct assoofs_image *img, struct assoofs_inode *dir, const char *filename, const char *target, struct assoofs_inode **inode);
+ssize_t assoofs_readlink(struct assoofs_image *img, struct assoofs_inode *inode, char *buf, size_t size);
+
+/**
+ * File data (files are a single block, compressed clusters are not supported)
+ */
+ssize_t assoofs_read(struct assoofs_image *img, struct assoofs_inode *inode, char *buf, size_t len, uint64_t pos);
+ssize_t assoofs_write(struct assoofs_image *img, struct assoofs_inode *inode, const char *buf, size_t len, uint64_t pos);
+int assoofs_truncate(struct assoofs_image *img, struct assoofs_inode *inode, uint64_t size);
+
+#endif
@@ -10,6 +10,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <dirent.h>
+#include <limits.h>
 
 // workaround for the timespec64
 #define timespec64 timespec
@@ -23,13 +25,30 @@
 #define WELCOMEFILE_FILENAME        "README.txt"                        // The filename for the welcome file
 #define WELCOMEFILE_BLOCK_NUMBER    (ASSOOFS_LAST_RESERVED_BLOCK + 1)   // The block number for the welcome file
 #define WELCOMEFILE_INODE_NUMBER    (ASSOOFS_LAST_RESERVED_INODE + 1)   // The inode number for the welcome file
+#define TIMES_BLOCK_NUMBER          (WELCOMEFILE_BLOCK_NUMBER + 1)      // The block number for the timestamps (if the device has room for it)
+#define PACKED_NAME_MAX             255                                 // The max length of a filename on packed images
+
+/**
+ * A file of the directory being packed
+ */
+struct packed_file {
+	char path[PATH_MAX];        // The path of the source file
+	char name[PACKED_NAME_MAX + 1]; // The filename inside its directory
+	struct stat st;             // The source file info
+	uint64_t first_child;       // The inode of the first child of a directory (children get consecutive inodes)
+	uint64_t children;          // The number of children of a directory
+};
+
+static struct packed_file packed_files[ASSOOFS_FILESYSTEM_MAX_OBJECTS];
+static uint64_t packed_count;
 
 /**
  * Write the superblock to a file
  */
-static int write_superblock(int fd) {
+static int write_superblock(int fd, uint64_t blocks, const struct assoofs_super_block *stripe) {
 	
 	ssize_t byte_count;
+	uint64_t one = 1;
 
 	// Create the superblock
 	struct assoofs_super_block sb = {
@@ -37,7 +56,10 @@ static int write_superblock(int fd) {
 		.version = ASSOOFS_VERSION,
 		.block_size = ASSOOFS_BLOCK_SIZE,
 		.inodes_count = ASSOOFS_LAST_RESERVED_INODE,
-		.free_blocks = 0xFFFFFFFFFFFFFFF8
+		.free_blocks = 0xFFFFFFFFFFFFFFF8,
+		.blocks_count = blocks,
+		.feature_ro_compat = ASSOOFS_FEATURE_RO_COMPAT_COUNTERS | ASSOOFS_FEATURE_RO_COMPAT_SHARED,
+		.feature_incompat = ASSOOFS_FEATURE_INCOMPAT_HOLES | ASSOOFS_FEATURE_INCOMPAT_COMPRESSED
 	};
 
 	// Update the fields if the welcome file is present
@@ -48,6 +70,35 @@ static int write_superblock(int fd) {
 	
 	#endif
 
+	// Only the blocks inside the device are free
+	if (blocks < ASSOOFS_FILESYSTEM_MAX_OBJECTS)
+		sb.free_blocks &= (one << blocks) - 1;
+
+	// The bloom filter of the root directory is written with the inode store
+	assoofs_set_blooms(&sb);
+
+	// The timestamps get the block after the welcome file (devices without it keep the creation times, and dont get the feature)
+	if (blocks > TIMES_BLOCK_NUMBER) {
+
+		assoofs_set_times_block(&sb, TIMES_BLOCK_NUMBER);
+		sb.free_blocks &= ~(one << TIMES_BLOCK_NUMBER);
+	}
+
+	// The new filesystem is clean, so the kernel can trust its counters
+	sb.free_blocks_count = __builtin_popcountll(sb.free_blocks);
+	sb.free_inodes_count = ASSOOFS_FILESYSTEM_MAX_OBJECTS - sb.inodes_count;
+	sb.state = ASSOOFS_STATE_CLEAN;
+
+	// Every member of a striped volume gets a copy, telling its position
+	if (stripe->stripe_members > 1) {
+
+		sb.feature_incompat |= ASSOOFS_FEATURE_INCOMPAT_STRIPED;
+		sb.stripe_volume = stripe->stripe_volume;
+		sb.stripe_members = stripe->stripe_members;
+		sb.stripe_index = stripe->stripe_index;
+		sb.stripe_stride = stripe->stripe_stride;
+	}
+
 	// Write the superblock to the file and verify it
 	printf("Writing the superblock\n");
 
@@ -66,7 +117,7 @@ static int write_superblock(int fd) {
 /**
  * Write the root inode to a file
  */
-static int write_root_inode(int fd) {
+static int write_root_inode(int fd, const struct timespec *now) {
 
 	ssize_t byte_count;
 
@@ -75,7 +126,7 @@ static int write_root_inode(int fd) {
 	root_inode.mode = S_IFDIR;
 	root_inode.inode_no = ASSOOFS_ROOTDIR_INODE_NUMBER;
 	root_inode.data_block_number = ASSOOFS_ROOTDIR_BLOCK_NUMBER;
-	clock_gettime(CLOCK_REALTIME, &root_inode.time);
+	root_inode.time = *now;
 
 	// Set the children count correctly
 	#if WELCOMEFILE_WRITE
@@ -163,13 +214,332 @@ int write_block(int fd, char *block, size_t len) {
 	return 0;
 }
 
+/**
+ * Write the bloom filter of the root directory to its slot in the inode store
+ */
+static int write_root_bloom(int fd, const struct assoofs_dir_record_entry *record) {
+
+	uint8_t inode_store[ASSOOFS_BLOCK_SIZE];
+	uint8_t *bloom = assoofs_bloom(inode_store, ASSOOFS_ROOTDIR_INODE_NUMBER);
+	off_t offset = ASSOOFS_INODESTORE_BLOCK_NUMBER * ASSOOFS_BLOCK_SIZE + (bloom - inode_store);
+
+	memset(bloom, 0, ASSOOFS_BLOOM_SIZE);
+
+	#if WELCOMEFILE_WRITE
+		assoofs_bloom_add(bloom, record->filename, strlen(record->filename));
+	#endif
+
+	if (pwrite(fd, bloom, ASSOOFS_BLOOM_SIZE, offset) != ASSOOFS_BLOOM_SIZE) {
+		printf("The root directory bloom filter was not written properly\n");
+		return -1;
+	}
+
+	printf("Root directory bloom filter written successfully\n");
+	return 0;
+}
+
+/**
+ * Write the timestamps block, starting every inode from its creation time (it goes to the member holding it on striped volumes)
+ */
+static int write_times(const int *fds, const struct assoofs_super_block *stripe, const struct timespec *now) {
+
+	struct assoofs_times times[ASSOOFS_BLOCK_SIZE / sizeof(struct assoofs_times)];
+	uint64_t member = assoofs_stripe_member(stripe, TIMES_BLOCK_NUMBER);
+	off_t offset = assoofs_stripe_block(stripe, TIMES_BLOCK_NUMBER) * ASSOOFS_BLOCK_SIZE;
+	uint64_t i;
+
+	memset(times, 0, sizeof(times));
+
+	for (i = 0; i < WELCOMEFILE_INODE_NUMBER; i++) {
+		times[i].atime = *now;
+		times[i].mtime = *now;
+		times[i].ctime = *now;
+	}
+
+	printf("Writing the timestamps block\n");
+
+	if (pwrite(fds[member], times, sizeof(times), offset) != sizeof(times)) {
+		printf("The timestamps block was not written properly\n");
+		return -1;
+	}
+
+	printf("Timestamps block written successfully\n");
+	return 0;
+}
+
+/**
+ * Sort the children of a directory by their filenames (the kernel binary searches them)
+ */
+static int compare_packed_names(const void *a, const void *b) {
+
+	return strcmp(((const struct packed_file *) a)->name, ((const struct packed_file *) b)->name);
+}
+
+/**
+ * Sort the files by decreasing size (the bigger ones are placed first)
+ */
+static int compare_packed_sizes(const void *a, const void *b) {
+
+	off_t size_a = packed_files[*(const uint64_t *) a].st.st_size;
+	off_t size_b = packed_files[*(const uint64_t *) b].st.st_size;
+
+	return (size_a < size_b) - (size_a > size_b);
+}
+
+/**
+ * Collect the tree under a directory breadth first, so the children of each directory get consecutive inodes
+ */
+static int collect_tree(const char *root) {
+
+	uint64_t i, first;
+	DIR *dir;
+	struct dirent *dirent;
+	struct packed_file *file;
+
+	packed_count = 1;
+	snprintf(packed_files[0].path, sizeof(packed_files[0].path), "%s", root);
+
+	if (stat(root, &packed_files[0].st) || !S_ISDIR(packed_files[0].st.st_mode)) {
+		printf("%s is not a directory\n", root);
+		return -1;
+	}
+
+	for (i = 0; i < packed_count; i++) {
+
+		if (!S_ISDIR(packed_files[i].st.st_mode))
+			continue;
+
+		dir = opendir(packed_files[i].path);
+		if (!dir) {
+			printf("Error opening %s\n", packed_files[i].path);
+			return -1;
+		}
+
+		first = packed_count;
+
+		while ((dirent = readdir(dir))) {
+
+			if (!strcmp(dirent->d_name, ".") || !strcmp(dirent->d_name, ".."))
+				continue;
+
+			if (packed_count == ASSOOFS_FILESYSTEM_MAX_OBJECTS) {
+				printf("Too many files (the max is %d)\n", ASSOOFS_FILESYSTEM_MAX_OBJECTS);
+				closedir(dir);
+				return -1;
+			}
+
+			file = &packed_files[packed_count];
+
+			if (strlen(dirent->d_name) > PACKED_NAME_MAX || snprintf(file->path, sizeof(file->path), "%s/%s", packed_files[i].path, dirent->d_name) >= (int) sizeof(file->path)) {
+				printf("Filename too long: %s\n", dirent->d_name);
+				closedir(dir);
+				return -1;
+			}
+
+			strcpy(file->name, dirent->d_name);
+
+			if (lstat(file->path, &file->st)) {
+				printf("Error reading %s\n", file->path);
+				closedir(dir);
+				return -1;
+			}
+
+			// only the kinds of files assoofs has are packed
+			if (!S_ISDIR(file->st.st_mode) && !S_ISREG(file->st.st_mode) && !S_ISLNK(file->st.st_mode)) {
+				printf("Skipping %s (not a file, directory or symlink)\n", file->path);
+				continue;
+			}
+
+			// files never cross a block, so they can be read with a single one
+			if ((S_ISREG(file->st.st_mode) && file->st.st_size > ASSOOFS_BLOCK_SIZE) || (S_ISLNK(file->st.st_mode) && file->st.st_size >= ASSOOFS_BLOCK_SIZE)) {
+				printf("%s is too big (the max is %d bytes)\n", file->path, ASSOOFS_BLOCK_SIZE);
+				closedir(dir);
+				return -1;
+			}
+
+			packed_count++;
+		}
+
+		closedir(dir);
+
+		qsort(&packed_files[first], packed_count - first, sizeof(packed_files[0]), compare_packed_names);
+		packed_files[i].first_child = first + 1;
+		packed_files[i].children = packed_count - first;
+	}
+
+	return 0;
+}
+
+/**
+ * Write a packed image of a directory (see ASSOOFS_FEATURE_INCOMPAT_PACKED)
+ */
+static int write_packed(int fd, const char *root) {
+
+	static char meta[ASSOOFS_FILESYSTEM_MAX_OBJECTS * ASSOOFS_BLOCK_SIZE];
+	static char data[ASSOOFS_FILESYSTEM_MAX_OBJECTS][ASSOOFS_BLOCK_SIZE];
+	static uint64_t used[ASSOOFS_FILESYSTEM_MAX_OBJECTS];
+	static uint64_t order[ASSOOFS_FILESYSTEM_MAX_OBJECTS];
+	static struct assoofs_super_block sb;
+	static char inode_store[ASSOOFS_BLOCK_SIZE];
+	struct assoofs_inode *inodes = (struct assoofs_inode *) inode_store;
+	struct assoofs_packed_dirent *entries;
+	struct packed_file *file;
+	uint64_t i, j, meta_size = 0, meta_blocks, data_blocks = 0, files = 0, blocks;
+	ssize_t len;
+	struct stat st;
+	int source;
+
+	if (collect_tree(root))
+		return -1;
+
+	printf("Packing %llu files\n", (unsigned long long) packed_count);
+
+	// the directories and the long symlink targets go to the packed metadata
+	for (i = 0; i < packed_count; i++) {
+
+		file = &packed_files[i];
+
+		inodes[i].mode = file->st.st_mode & (S_IFMT | 0777);
+		inodes[i].inode_no = i + 1;
+		inodes[i].time.tv_sec = file->st.st_mtim.tv_sec;
+		inodes[i].time.tv_nsec = file->st.st_mtim.tv_nsec;
+
+		if (S_ISDIR(file->st.st_mode)) {
+
+			// the entries are read in place, so they must be aligned
+			meta_size = (meta_size + 7) & ~7ULL;
+			if (meta_size + file->children * (sizeof(*entries) + PACKED_NAME_MAX) > sizeof(meta)) {
+				printf("The directories do not fit in the image\n");
+				return -1;
+			}
+
+			inodes[i].data_offset = meta_size;
+			inodes[i].dir_children_count = file->children;
+
+			entries = (struct assoofs_packed_dirent *) (meta + meta_size);
+			meta_size += file->children * sizeof(*entries);
+
+			for (j = 0; j < file->children; j++) {
+
+				entries[j].inode_no = file->first_child + j;
+				entries[j].name_offset = meta_size;
+				entries[j].name_len = strlen(packed_files[file->first_child + j - 1].name);
+
+				memcpy(meta + meta_size, packed_files[file->first_child + j - 1].name, entries[j].name_len);
+				meta_size += entries[j].name_len;
+			}
+
+		} else if (S_ISLNK(file->st.st_mode)) {
+
+			if (meta_size + ASSOOFS_BLOCK_SIZE > sizeof(meta)) {
+				printf("The symlinks do not fit in the image\n");
+				return -1;
+			}
+
+			len = readlink(file->path, meta + meta_size, ASSOOFS_BLOCK_SIZE - 1);
+			if (len < 0) {
+				printf("Error reading %s\n", file->path);
+				return -1;
+			}
+
+			inodes[i].file_size = len;
+
+			// short targets stay in the inode store (an offset of 0 is always the root directory)
+			if (len <= ASSOOFS_INLINE_LINK_MAX) {
+
+				memcpy(assoofs_inline_link(inode_store, i + 1), meta + meta_size, len);
+				memset(meta + meta_size, 0, len);
+
+			} else {
+
+				inodes[i].data_offset = meta_size;
+				meta_size += len + 1;
+			}
+
+		} else if (file->st.st_size) {
+
+			order[files++] = i;
+		}
+	}
+
+	meta_blocks = meta_size ? (meta_size + ASSOOFS_BLOCK_SIZE - 1) / ASSOOFS_BLOCK_SIZE : 1;
+	meta_size = meta_size ? meta_size : 1;
+
+	// tail pack the files (first fit, biggest first), so small files share their blocks
+	qsort(order, files, sizeof(order[0]), compare_packed_sizes);
+
+	for (i = 0; i < files; i++) {
+
+		file = &packed_files[order[i]];
+
+		for (j = 0; j < data_blocks && used[j] + file->st.st_size > ASSOOFS_BLOCK_SIZE; j++);
+
+		if (j == data_blocks)
+			data_blocks++;
+
+		source = open(file->path, O_RDONLY);
+		if (source == -1 || read(source, data[j] + used[j], file->st.st_size) != file->st.st_size) {
+			printf("Error reading %s\n", file->path);
+			if (source != -1) close(source);
+			return -1;
+		}
+		close(source);
+
+		inodes[order[i]].data_offset = (ASSOOFS_PACKED_META_BLOCK + meta_blocks + j) * ASSOOFS_BLOCK_SIZE + used[j];
+		inodes[order[i]].file_size = file->st.st_size;
+		used[j] += file->st.st_size;
+	}
+
+	blocks = ASSOOFS_PACKED_META_BLOCK + meta_blocks + data_blocks;
+	if (blocks > ASSOOFS_FILESYSTEM_MAX_OBJECTS) {
+		printf("The files do not fit in the image (%llu blocks, the max is %d)\n", (unsigned long long) blocks, ASSOOFS_FILESYSTEM_MAX_OBJECTS);
+		return -1;
+	}
+
+	// Create the superblock (the image is never written, so nothing is free)
+	sb.magic = ASSOOFS_MAGIC;
+	sb.version = ASSOOFS_VERSION;
+	sb.block_size = ASSOOFS_BLOCK_SIZE;
+	sb.inodes_count = packed_count;
+	sb.blocks_count = blocks;
+	sb.free_inodes_count = ASSOOFS_FILESYSTEM_MAX_OBJECTS - packed_count;
+	sb.state = ASSOOFS_STATE_CLEAN;
+	sb.feature_incompat = ASSOOFS_FEATURE_INCOMPAT_HOLES | ASSOOFS_FEATURE_INCOMPAT_PACKED;
+	sb.packed_meta_size = meta_size;
+
+	// Write the whole image
+	printf("Writing %llu blocks (%llu of metadata, %llu of data)\n", (unsigned long long) blocks, (unsigned long long) meta_blocks, (unsigned long long) data_blocks);
+
+	if (write(fd, &sb, sizeof(sb)) != sizeof(sb) || write(fd, inode_store, sizeof(inode_store)) != sizeof(inode_store) ||
+	    write(fd, meta, meta_blocks * ASSOOFS_BLOCK_SIZE) != (ssize_t) (meta_blocks * ASSOOFS_BLOCK_SIZE) ||
+	    write(fd, data, data_blocks * ASSOOFS_BLOCK_SIZE) != (ssize_t) (data_blocks * ASSOOFS_BLOCK_SIZE)) {
+		printf("Error writing the image\n");
+		return -1;
+	}
+
+	// Image files are cut to the packed size
+	if (!fstat(fd, &st) && S_ISREG(st.st_mode) && ftruncate(fd, blocks * ASSOOFS_BLOCK_SIZE)) {
+		printf("Error truncating the image\n");
+		return -1;
+	}
+
+	printf("Packed image written successfully\n");
+	return 0;
+}
+
 /**
  * Main
  */
 int main(int argc, char *argv[]) {
 
 	int fd;
+	int fds[ASSOOFS_MAX_MEMBERS];
 	int code = -1;
+	int option, members, urandom, i;
+	char *directory = NULL;
+	off_t size;
+	uint64_t blocks = 0;
+	struct assoofs_super_block stripe = { .stripe_stride = 1 };
 	char welcomefile_content[] = "Hello world from " ASSOOFS_NAME;
 	ssize_t welcomefile_size = sizeof(welcomefile_content) - 1; // dont write the "\0"
 	
@@ -185,44 +555,131 @@ int main(int argc, char *argv[]) {
 		.inode_no = WELCOMEFILE_INODE_NUMBER,
 	};
 
-	// set the time
+	// set the time (of every inode)
 	clock_gettime(CLOCK_REALTIME, &welcomefile_inode.time);
 
 
 	// Verify the parameters
-	if (argc != 2) {
-		printf("Usage: ./mkassoofs <device>\n");
+	while ((option = getopt(argc, argv, "p:s:")) != -1) {
+
+		if (option == 'p') {
+			directory = optarg;
+		} else if (option == 's' && atoi(optarg) > 0) {
+			stripe.stripe_stride = atoi(optarg);
+		} else {
+			argc = 0;
+			break;
+		}
+	}
+
+	members = argc - optind;
+
+	if (members < 1 || members > ASSOOFS_MAX_MEMBERS || (directory && members != 1)) {
+		printf("Usage: ./mkassoofs [-p <directory>] <device>\n");
+		printf("       ./mkassoofs [-s <stride>] <device> [<device>...]\n");
 		return code;
 	}
 
-	// Open the file for writing
-	fd = open(argv[1], O_RDWR);
-	if (fd == -1) {
-		printf("Error opening the device\n");
+	// Pack a directory into a read-only image
+	if (directory) {
+
+		fd = open(argv[optind], O_RDWR | O_CREAT, 0644);
+		if (fd == -1) {
+			printf("Error opening the device\n");
+			return code;
+		}
+
+		code = write_packed(fd, directory);
+		close(fd);
 		return code;
 	}
 
-	// Write the components of the filesystem to the file
+	// Open the files for writing (the first one holds the metadata of a striped volume)
+	for (i = 0; i < members; i++) {
+
+		fds[i] = open(argv[optind + i], O_RDWR);
+		size = fds[i] == -1 ? -1 : lseek(fds[i], 0, SEEK_END);
+
+		if (fds[i] == -1 || size == (off_t) -1 || lseek(fds[i], 0, SEEK_SET) == (off_t) -1) {
+			printf("Error opening the device %s\n", argv[optind + i]);
+			while (i--) close(fds[i]);
+			return code;
+		}
+
+		// the smallest member limits every row of stripes
+		if (!i || (uint64_t) size / ASSOOFS_BLOCK_SIZE < blocks)
+			blocks = size / ASSOOFS_BLOCK_SIZE;
+	}
+
+	fd = fds[0];
+
+	// Stripe the blocks after the reserved ones across the members
+	if (members > 1) {
+
+		stripe.version = ASSOOFS_VERSION;
+		stripe.feature_incompat = ASSOOFS_FEATURE_INCOMPAT_STRIPED;
+		stripe.stripe_members = members;
+		blocks = assoofs_stripe_capacity(&stripe, blocks);
+
+		// the members are recognized by the id of the volume
+		urandom = open("/dev/urandom", O_RDONLY);
+		if (urandom == -1 || read(urandom, &stripe.stripe_volume, sizeof(stripe.stripe_volume)) != sizeof(stripe.stripe_volume))
+			stripe.stripe_volume = time(NULL) ^ ((uint64_t) getpid() << 32);
+		if (urandom != -1)
+			close(urandom);
+
+		printf("Striping the volume across %d devices (%llu blocks per stripe)\n", members, (unsigned long long) stripe.stripe_stride);
+	}
+
+	if (blocks <= WELCOMEFILE_BLOCK_NUMBER) {
+		printf("The device is too small (%llu blocks)\n", (unsigned long long) blocks);
+		for (i = 0; i < members; i++) close(fds[i]);
+		return code;
+	}
+
+	if (blocks > ASSOOFS_FILESYSTEM_MAX_OBJECTS)
+		blocks = ASSOOFS_FILESYSTEM_MAX_OBJECTS;
+
+	// Write the components of the filesystem to the file (the welcome file block is the first striped one, so it is on the first member too)
 	do {
-		if (write_superblock(fd)) 
+		if (write_superblock(fd, blocks, &stripe)) 
 			break;
 
-		if (write_root_inode(fd)) 
+		if (write_root_inode(fd, &welcomefile_inode.time)) 
 			break;
 		
 		if (write_welcome_inode(fd, &welcomefile_inode)) 
 			break;
 
+		if (write_root_bloom(fd, &welcomefile_record))
+			break;
+
 		if (write_dirent(fd, &welcomefile_record)) 
 			break;
 		
 		if (write_block(fd, welcomefile_content, welcomefile_size)) 
 			break;
 
+		if (blocks > TIMES_BLOCK_NUMBER && write_times(fds, &stripe, &welcomefile_inode.time))
+			break;
+
+		// The rest of the members only get their copy of the superblock
+		for (i = 1; i < members; i++) {
+
+			stripe.stripe_index = i;
+			if (write_superblock(fds[i], blocks, &stripe))
+				break;
+		}
+
+		if (i < members)
+			break;
+
 		code = 0;
 	} while (0);
 
-	// Close the file and exit
-	close(fd);
+	// Close the files and exit
+	for (i = 0; i < members; i++)
+		close(fds[i]);
+
 	return code;
 }
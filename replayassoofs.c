@@ -0,0 +1,658 @@
+/**
+ * Include dependencies
+ */
+#include <unistd.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// workaround for the timespec64
+#define timespec64 timespec
+
+#include "assoofs.h"
+
+/**
+ * Some constants
+ */
+#define REPLAY_OPS          (ASSOOFS_TRACE_WRITE + 1)   // The number of operation codes (including the unused 0)
+#define REPLAY_MAX_THREADS  64                          // The max number of threads replaying the trace
+
+/**
+ * The trace being replayed, with the paths of the traced inodes on the mounted filesystem
+ */
+struct replay {
+	struct assoofs_trace_record *records;                           // The captured operations
+	size_t count;                                                   // The number of records
+	uint64_t *latency;                                              // The latency of each record in nanoseconds
+	int *failed;                                                    // Whether each record failed
+	uint64_t (*deps)[2];                                            // The inodes each record uses (0 if none, see order)
+	uint64_t (*waits)[2];                                           // The records on each of those inodes to wait for (see order)
+	uint64_t done[ASSOOFS_FILESYSTEM_MAX_OBJECTS + 1];              // The records finished by inode number
+	uint64_t done_changes[ASSOOFS_FILESYSTEM_MAX_OBJECTS + 1];      // The records changing the inode finished by inode number
+	pthread_mutex_t done_lock;                                      // Protects the finished records
+	pthread_cond_t done_cond;                                       // Signaled when a record finishes
+	char *paths[ASSOOFS_FILESYSTEM_MAX_OBJECTS + 1];                // The paths by traced inode number (NULL until known)
+	int fds[ASSOOFS_FILESYSTEM_MAX_OBJECTS + 1];                    // The open files by traced inode number (-1 until opened)
+	pthread_mutex_t fd_lock;                                        // Protects the open files
+	int threads;                                                    // The number of threads
+	double speed;                                                   // The speed of the original timing (0 to replay as fast as possible)
+	struct timespec start;                                          // The time the replay started
+};
+
+/**
+ * A replaying thread (replaying the records of the tasks assigned to it)
+ */
+struct worker {
+	pthread_t thread;                                               // The thread
+	struct replay *replay;                                          // The trace
+	int id;                                                         // The thread number
+};
+
+static const char *op_names[REPLAY_OPS] = {
+	[ASSOOFS_TRACE_CREATE] = "create",
+	[ASSOOFS_TRACE_MKDIR] = "mkdir",
+	[ASSOOFS_TRACE_SYMLINK] = "symlink",
+	[ASSOOFS_TRACE_LOOKUP] = "lookup",
+	[ASSOOFS_TRACE_ITERATE] = "iterate",
+	[ASSOOFS_TRACE_READ] = "read",
+	[ASSOOFS_TRACE_WRITE] = "write",
+};
+
+/**
+ * Get the nanoseconds between two times
+ */
+static uint64_t elapsed(const struct timespec *from, const struct timespec *to) {
+
+	return (to->tv_sec - from->tv_sec) * 1000000000ULL + to->tv_nsec - from->tv_nsec;
+}
+
+/**
+ * Check if a traced inode number can be used
+ */
+static int valid_inode(uint64_t inode_no) {
+
+	return inode_no && inode_no <= ASSOOFS_FILESYSTEM_MAX_OBJECTS;
+}
+
+/**
+ * Build a path inside a directory
+ */
+static char *join(const char *dir, const char *name) {
+
+	char *path = malloc(strlen(dir) + strlen(name) + 2);
+
+	if (path)
+		sprintf(path, "%s/%s", dir, name);
+
+	return path;
+}
+
+/**
+ * Read a whole trace file
+ */
+static int load_trace(struct replay *replay, const char *path) {
+
+	struct stat st;
+	ssize_t nbytes;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1 || fstat(fd, &st)) {
+
+		printf("Error opening the trace\n");
+		return -1;
+	}
+
+	if (st.st_size % sizeof(struct assoofs_trace_record))
+		printf("Ignoring the partial record at the end of the trace\n");
+
+	replay->count = st.st_size / sizeof(struct assoofs_trace_record);
+	replay->records = malloc(replay->count * sizeof(struct assoofs_trace_record) + 1);
+	replay->latency = calloc(replay->count + 1, sizeof(uint64_t));
+	replay->failed = calloc(replay->count + 1, sizeof(int));
+	replay->deps = calloc(replay->count + 1, sizeof(*replay->deps));
+	replay->waits = calloc(replay->count + 1, sizeof(*replay->waits));
+
+	if (!replay->records || !replay->latency || !replay->failed || !replay->deps || !replay->waits) {
+
+		printf("Not enough memory for the trace\n");
+		close(fd);
+		return -1;
+	}
+
+	nbytes = read(fd, replay->records, replay->count * sizeof(struct assoofs_trace_record));
+	close(fd);
+
+	if (nbytes != (ssize_t) (replay->count * sizeof(struct assoofs_trace_record))) {
+
+		printf("Error reading the trace\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Create a file that existed before the capture started (holding the bytes the trace reads from it)
+ */
+static int create_existing(const char *path, mode_t mode, uint64_t size) {
+
+	static char zeros[ASSOOFS_BLOCK_SIZE];
+	int fd;
+
+	if (S_ISDIR(mode))
+		return mkdir(path, 0755) && errno != EEXIST ? -1 : 0;
+
+	if (S_ISLNK(mode))
+		return symlink("target", path) && errno != EEXIST ? -1 : 0;
+
+	fd = open(path, O_CREAT | O_WRONLY, 0644);
+	if (fd == -1)
+		return -1;
+
+	if (size > sizeof(zeros))
+		size = sizeof(zeros);
+
+	if (size && pwrite(fd, zeros, size, 0) != (ssize_t) size) {
+
+		close(fd);
+		return -1;
+	}
+
+	close(fd);
+	return 0;
+}
+
+/**
+ * Give a path in the root directory to an inode used before the trace finds its name (through the dentry cache)
+ */
+static void placeholder(struct replay *replay, mode_t *modes, const char *root, uint64_t inode_no, mode_t mode) {
+
+	char name[32];
+
+	if (!valid_inode(inode_no) || replay->paths[inode_no])
+		return;
+
+	sprintf(name, ".replay-%llu", (unsigned long long) inode_no);
+	replay->paths[inode_no] = join(root, name);
+	modes[inode_no] = mode;
+}
+
+/**
+ * Find the paths of the traced inodes, creating the ones that existed before the capture on the fresh filesystem
+ */
+static int prepare(struct replay *replay, const char *root) {
+
+	int created[ASSOOFS_FILESYSTEM_MAX_OBJECTS + 1] = { 0 };
+	mode_t modes[ASSOOFS_FILESYSTEM_MAX_OBJECTS + 1] = { 0 };
+	uint64_t sizes[ASSOOFS_FILESYSTEM_MAX_OBJECTS + 1] = { 0 };
+	struct assoofs_trace_record *record;
+	uint64_t i;
+
+	replay->paths[ASSOOFS_ROOTDIR_INODE_NUMBER] = strdup(root);
+	modes[ASSOOFS_ROOTDIR_INODE_NUMBER] = S_IFDIR;
+
+	for (i = 0; i < replay->count; i++) {
+
+		record = &replay->records[i];
+		record->name[sizeof(record->name) - 1] = '\0';
+
+		switch (record->op) {
+
+			case ASSOOFS_TRACE_CREATE:
+			case ASSOOFS_TRACE_MKDIR:
+			case ASSOOFS_TRACE_SYMLINK:
+			case ASSOOFS_TRACE_LOOKUP:
+
+				placeholder(replay, modes, root, record->inode_no, S_IFDIR);
+
+				if (!valid_inode(record->arg) || replay->paths[record->arg] || !replay->paths[record->inode_no])
+					break;
+
+				replay->paths[record->arg] = join(replay->paths[record->inode_no], record->name);
+				created[record->arg] = record->op != ASSOOFS_TRACE_LOOKUP;
+				modes[record->arg] = record->op == ASSOOFS_TRACE_LOOKUP ? record->len : 0;
+				break;
+
+			case ASSOOFS_TRACE_ITERATE:
+
+				placeholder(replay, modes, root, record->inode_no, S_IFDIR);
+				break;
+
+			case ASSOOFS_TRACE_READ:
+			case ASSOOFS_TRACE_WRITE:
+
+				if (!valid_inode(record->inode_no))
+					break;
+
+				// only the bytes read before being written must exist
+				if (record->op == ASSOOFS_TRACE_READ && !created[record->inode_no] && sizes[record->inode_no] < record->arg + record->len)
+					sizes[record->inode_no] = record->arg + record->len;
+
+				placeholder(replay, modes, root, record->inode_no, S_IFREG);
+				break;
+		}
+	}
+
+	// create the inodes the trace uses without creating them
+	for (i = ASSOOFS_ROOTDIR_INODE_NUMBER + 1; i <= ASSOOFS_FILESYSTEM_MAX_OBJECTS; i++) {
+
+		if (!replay->paths[i] || created[i] || !modes[i])
+			continue;
+
+		if (create_existing(replay->paths[i], modes[i], sizes[i])) {
+
+			perror(replay->paths[i]);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * Check if a record changes the inodes it uses (creations change the directory and the new inode, writes the file)
+ */
+static int changes(const struct assoofs_trace_record *record) {
+
+	return record->op <= ASSOOFS_TRACE_SYMLINK || record->op == ASSOOFS_TRACE_WRITE;
+}
+
+/**
+ * Order the records on each inode as they were captured, whatever thread replays them
+ * Records changing an inode wait for every earlier record on it, and the rest only for the earlier ones changing it, so they dont wait for each other
+ */
+static void order(struct replay *replay) {
+
+	uint64_t seen[ASSOOFS_FILESYSTEM_MAX_OBJECTS + 1] = { 0 };
+	uint64_t seen_changes[ASSOOFS_FILESYSTEM_MAX_OBJECTS + 1] = { 0 };
+	struct assoofs_trace_record *record;
+	uint64_t inode_no;
+	size_t i;
+	int j;
+
+	for (i = 0; i < replay->count; i++) {
+
+		record = &replay->records[i];
+
+		// creations and lookups also use the inode they name
+		replay->deps[i][0] = record->inode_no;
+		if (record->op <= ASSOOFS_TRACE_LOOKUP && record->arg != record->inode_no)
+			replay->deps[i][1] = record->arg;
+
+		for (j = 0; j < 2; j++) {
+
+			inode_no = replay->deps[i][j];
+
+			if (!valid_inode(inode_no)) {
+
+				replay->deps[i][j] = 0;
+				continue;
+			}
+
+			replay->waits[i][j] = changes(record) ? seen[inode_no] : seen_changes[inode_no];
+
+			seen[inode_no]++;
+			if (changes(record))
+				seen_changes[inode_no]++;
+		}
+	}
+}
+
+/**
+ * Wait for the earlier records on the inodes of a record to finish (see order)
+ */
+static void wait_turn(struct replay *replay, size_t i) {
+
+	uint64_t *finished;
+	uint64_t inode_no;
+	int j;
+
+	pthread_mutex_lock(&replay->done_lock);
+
+	for (j = 0; j < 2; j++) {
+
+		inode_no = replay->deps[i][j];
+		if (!inode_no)
+			continue;
+
+		finished = changes(&replay->records[i]) ? replay->done : replay->done_changes;
+
+		while (finished[inode_no] < replay->waits[i][j])
+			pthread_cond_wait(&replay->done_cond, &replay->done_lock);
+	}
+
+	pthread_mutex_unlock(&replay->done_lock);
+}
+
+/**
+ * Let the later records on the inodes of a record go (see order)
+ */
+static void finish_turn(struct replay *replay, size_t i) {
+
+	uint64_t inode_no;
+	int j;
+
+	pthread_mutex_lock(&replay->done_lock);
+
+	for (j = 0; j < 2; j++) {
+
+		inode_no = replay->deps[i][j];
+		if (!inode_no)
+			continue;
+
+		replay->done[inode_no]++;
+		if (changes(&replay->records[i]))
+			replay->done_changes[inode_no]++;
+	}
+
+	pthread_cond_broadcast(&replay->done_cond);
+	pthread_mutex_unlock(&replay->done_lock);
+}
+
+/**
+ * Get the open file of a traced inode (opening it on first use)
+ */
+static int get_fd(struct replay *replay, uint64_t inode_no) {
+
+	int fd;
+
+	if (!valid_inode(inode_no) || !replay->paths[inode_no])
+		return -1;
+
+	pthread_mutex_lock(&replay->fd_lock);
+
+	if (replay->fds[inode_no] == -1)
+		replay->fds[inode_no] = open(replay->paths[inode_no], O_RDWR);
+
+	fd = replay->fds[inode_no];
+
+	pthread_mutex_unlock(&replay->fd_lock);
+	return fd;
+}
+
+/**
+ * Run a captured operation (returns 0 if it did the same as when it was captured)
+ */
+static int run(struct replay *replay, const struct assoofs_trace_record *record) {
+
+	static __thread char buffer[ASSOOFS_CLUSTER_SIZE];
+	char target[sizeof(record->name)];
+	struct stat st;
+	struct dirent *entry;
+	char *path;
+	DIR *dir;
+	size_t len;
+	int code;
+	int fd;
+
+	len = record->len < sizeof(buffer) ? record->len : sizeof(buffer);
+
+	switch (record->op) {
+
+		case ASSOOFS_TRACE_CREATE:
+
+			fd = open(replay->paths[record->arg], O_CREAT | O_EXCL | O_RDWR, 0644);
+			if (fd == -1)
+				return -1;
+
+			// keep it open for the writes that follow
+			pthread_mutex_lock(&replay->fd_lock);
+
+			if (replay->fds[record->arg] == -1) {
+
+				replay->fds[record->arg] = fd;
+				fd = -1;
+			}
+
+			pthread_mutex_unlock(&replay->fd_lock);
+
+			if (fd != -1)
+				close(fd);
+			return 0;
+
+		case ASSOOFS_TRACE_MKDIR:
+
+			return mkdir(replay->paths[record->arg], 0755);
+
+		case ASSOOFS_TRACE_SYMLINK:
+
+			// only the length of the target was captured
+			len = record->len < sizeof(target) - 1 ? record->len : sizeof(target) - 1;
+			memset(target, 'x', len);
+			target[len] = '\0';
+
+			return symlink(target, replay->paths[record->arg]);
+
+		case ASSOOFS_TRACE_LOOKUP:
+
+			path = join(replay->paths[record->inode_no], record->name);
+			if (!path)
+				return -1;
+
+			code = lstat(path, &st);
+			free(path);
+
+			// misses are replayed as misses
+			return record->arg ? code : !code;
+
+		case ASSOOFS_TRACE_ITERATE:
+
+			dir = opendir(replay->paths[record->inode_no]);
+			if (!dir)
+				return -1;
+
+			do {
+				entry = readdir(dir);
+			} while (entry);
+
+			closedir(dir);
+			return 0;
+
+		case ASSOOFS_TRACE_READ:
+
+			fd = get_fd(replay, record->inode_no);
+			return fd == -1 || pread(fd, buffer, len, record->arg) == -1 ? -1 : 0;
+
+		case ASSOOFS_TRACE_WRITE:
+
+			fd = get_fd(replay, record->inode_no);
+			return fd == -1 || pwrite(fd, buffer, len, record->arg) != (ssize_t) len ? -1 : 0;
+	}
+
+	return -1;
+}
+
+/**
+ * Replay the records of the tasks assigned to a thread, in order (at the original pace, scaled by the speed, if there is one)
+ * NOTE: the records of other threads on the same inodes are waited for, so each inode sees the captured order
+ */
+static void *replay_thread(void *arg) {
+
+	struct worker *worker = arg;
+	struct replay *replay = worker->replay;
+	const struct assoofs_trace_record *record;
+	struct timespec before, after;
+	uint64_t wait;
+	size_t i;
+
+	for (i = 0; i < replay->count; i++) {
+
+		record = &replay->records[i];
+
+		if ((int) (record->task % replay->threads) != worker->id)
+			continue;
+
+		// records whose inodes are unknown cant be replayed (but still take their turn, so the later ones can count them)
+		if (!valid_inode(record->inode_no) || !replay->paths[record->inode_no] || (record->op <= ASSOOFS_TRACE_SYMLINK && (!valid_inode(record->arg) || !replay->paths[record->arg]))) {
+
+			wait_turn(replay, i);
+			replay->failed[i] = 1;
+			finish_turn(replay, i);
+			continue;
+		}
+
+		if (replay->speed > 0) {
+
+			wait = record->time / replay->speed;
+			before.tv_sec = replay->start.tv_sec + (replay->start.tv_nsec + wait) / 1000000000;
+			before.tv_nsec = (replay->start.tv_nsec + wait) % 1000000000;
+
+			clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &before, NULL);
+		}
+
+		wait_turn(replay, i);
+
+		clock_gettime(CLOCK_MONOTONIC, &before);
+		replay->failed[i] = run(replay, record) ? 1 : 0;
+		clock_gettime(CLOCK_MONOTONIC, &after);
+
+		finish_turn(replay, i);
+
+		replay->latency[i] = elapsed(&before, &after);
+	}
+
+	return NULL;
+}
+
+/**
+ * Compare two latencies (for qsort)
+ */
+static int cmp_latency(const void *a, const void *b) {
+
+	uint64_t x = *(const uint64_t *) a;
+	uint64_t y = *(const uint64_t *) b;
+
+	return (x > y) - (x < y);
+}
+
+/**
+ * Print the throughput and the latency of every operation
+ */
+static void report(struct replay *replay, uint64_t total) {
+
+	uint64_t *latency = malloc((replay->count + 1) * sizeof(uint64_t));
+	uint64_t bytes, sum;
+	size_t count, failed;
+	size_t i;
+	int op;
+
+	printf("Replayed %zu operations in %.3f s (%.0f ops/s)\n", replay->count, total / 1e9, total ? replay->count * 1e9 / total : 0.0);
+	printf("%-8s %8s %8s %10s %10s %10s %10s %10s\n", "op", "count", "failed", "avg(us)", "p50(us)", "p99(us)", "max(us)", "MiB/s");
+
+	if (!latency)
+		return;
+
+	for (op = 1; op < REPLAY_OPS; op++) {
+
+		count = 0;
+		failed = 0;
+		bytes = 0;
+		sum = 0;
+
+		for (i = 0; i < replay->count; i++) {
+
+			if (replay->records[i].op != (uint32_t) op)
+				continue;
+
+			if (replay->failed[i])
+				failed++;
+
+			if (op == ASSOOFS_TRACE_READ || op == ASSOOFS_TRACE_WRITE)
+				bytes += replay->records[i].len;
+
+			latency[count++] = replay->latency[i];
+			sum += replay->latency[i];
+		}
+
+		if (!count)
+			continue;
+
+		qsort(latency, count, sizeof(uint64_t), cmp_latency);
+
+		printf("%-8s %8zu %8zu %10.1f %10.1f %10.1f %10.1f %10.2f\n", op_names[op], count, failed, sum / 1e3 / count, latency[count / 2] / 1e3, latency[count * 99 / 100] / 1e3, latency[count - 1] / 1e3, sum ? bytes / (sum / 1e9) / (1 << 20) : 0.0);
+	}
+
+	free(latency);
+}
+
+/**
+ * Main
+ */
+int main(int argc, char *argv[]) {
+
+	int code = -1;
+	static struct replay replay;
+	struct worker workers[REPLAY_MAX_THREADS];
+	struct timespec end;
+	char *tail;
+	int i;
+
+	// Verify the parameters
+	if (argc < 3 || argc > 5) {
+		printf("Usage: ./replay.assoofs <trace> <mountpoint> [threads] [speed]\n");
+		return code;
+	}
+
+	replay.threads = argc > 3 ? strtol(argv[3], &tail, 10) : 1;
+	if (argc > 3 && (*tail || replay.threads < 1 || replay.threads > REPLAY_MAX_THREADS)) {
+		printf("Invalid number of threads '%s' (1 to %d)\n", argv[3], REPLAY_MAX_THREADS);
+		return code;
+	}
+
+	// Without a speed, the operations run back to back
+	replay.speed = argc > 4 ? strtod(argv[4], &tail) : 0;
+	if (argc > 4 && (*tail || replay.speed < 0)) {
+		printf("Invalid speed '%s'\n", argv[4]);
+		return code;
+	}
+
+	for (i = 0; i <= ASSOOFS_FILESYSTEM_MAX_OBJECTS; i++)
+		replay.fds[i] = -1;
+
+	pthread_mutex_init(&replay.fd_lock, NULL);
+	pthread_mutex_init(&replay.done_lock, NULL);
+	pthread_cond_init(&replay.done_cond, NULL);
+
+	// Read the trace and get the fresh filesystem ready
+	if (load_trace(&replay, argv[1]) || prepare(&replay, argv[2]))
+		return code;
+
+	order(&replay);
+
+	// Replay the trace, spreading the captured tasks over the threads
+	clock_gettime(CLOCK_MONOTONIC, &replay.start);
+
+	for (i = 0; i < replay.threads; i++) {
+
+		workers[i].replay = &replay;
+		workers[i].id = i;
+
+		if (pthread_create(&workers[i].thread, NULL, replay_thread, &workers[i])) {
+			printf("Error creating the threads\n");
+			return code;
+		}
+	}
+
+	for (i = 0; i < replay.threads; i++)
+		pthread_join(workers[i].thread, NULL);
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	report(&replay, elapsed(&replay.start, &end));
+
+	// Close the files and exit
+	for (i = 0; i <= ASSOOFS_FILESYSTEM_MAX_OBJECTS; i++)
+		if (replay.fds[i] != -1)
+			close(replay.fds[i]);
+
+	return 0;
+}
@@ -0,0 +1,65 @@
+/**
+ * Include dependencies
+ */
+#include <unistd.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// workaround for the timespec64
+#define timespec64 timespec
+
+#include "assoofs.h"
+
+/**
+ * Main
+ */
+int main(int argc, char *argv[]) {
+
+	int fd;
+	int code = -1;
+	uint64_t blocks = 0;
+	char *end;
+
+	// Verify the parameters
+	if (argc != 2 && argc != 3) {
+		printf("Usage: ./resize.assoofs <mountpoint> [blocks]\n");
+		return code;
+	}
+
+	// Without a size, grow into the whole device
+	if (argc == 3) {
+
+		blocks = strtoull(argv[2], &end, 10);
+
+		if (*end || !blocks) {
+			printf("Invalid number of blocks '%s'\n", argv[2]);
+			return code;
+		}
+	}
+
+	// Open any file of the mounted filesystem
+	fd = open(argv[1], O_RDONLY);
+	if (fd == -1) {
+		printf("Error opening the mountpoint\n");
+		return code;
+	}
+
+	// Grow the volume
+	if (ioctl(fd, ASSOOFS_IOC_RESIZE, &blocks))
+		perror(argv[1]);
+	else {
+		printf("The filesystem has %llu blocks\n", (unsigned long long) blocks);
+		code = 0;
+	}
+
+	// Close the file and exit
+	close(fd);
+	return code;
+}
@@ -0,0 +1,93 @@
+/**
+ * Include dependencies
+ */
+#include <unistd.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "libassoofs.h"
+
+/**
+ * Upgrade a version 1 image to the current layout (only the metadata is written, the data blocks stay where they are)
+ */
+static int upgrade(struct assoofs_image *img) {
+
+	uint64_t compat, ro_compat, incompat;
+	int code;
+
+	// version 1 lookups read every directory until the kernel rebuilds the bloom filters
+	if (!img->sb.dir_blooms) {
+
+		printf("Building the directory bloom filters\n");
+
+		if (assoofs_build_blooms(img) || assoofs_sync_inode_store(img))
+			return -1;
+	}
+
+	// full images keep using the creation times
+	if (!img->sb.times_block) {
+
+		printf("Creating the timestamps block\n");
+
+		code = assoofs_build_times(img);
+		if (code == -ENOSPC)
+			printf("No free block for the timestamps, skipping them\n");
+		else if (code)
+			return -1;
+	}
+
+	// the superblock goes last, so the image stays a valid version 1 one until then (only flagging the structures it got)
+	assoofs_features(&img->sb, &compat, &ro_compat, &incompat);
+
+	img->sb.version = ASSOOFS_VERSION;
+	img->sb.feature_compat = compat;
+	img->sb.feature_ro_compat = ro_compat;
+	img->sb.feature_incompat = incompat;
+
+	// the counters are recounted when writing, so the next mount can trust them
+	img->sb.state = ASSOOFS_STATE_CLEAN;
+
+	return assoofs_sync_super(img);
+}
+
+/**
+ * Main
+ */
+int main(int argc, char *argv[]) {
+
+	int code = -1;
+	static struct assoofs_image img;
+
+	// Verify the parameters
+	if (argc != 2) {
+		printf("Usage: ./tune.assoofs <device>\n");
+		return code;
+	}
+
+	// Open the (unmounted) image for writing
+	if (assoofs_open_image(&img, argv[1], 0))
+		return code;
+
+	// Upgrade the layout if needed
+	if (img.sb.version == ASSOOFS_VERSION) {
+
+		printf("The filesystem already uses version %d\n", ASSOOFS_VERSION);
+		code = 0;
+
+	} else if (!upgrade(&img)) {
+
+		printf("Upgraded the filesystem to version %d\n", ASSOOFS_VERSION);
+		code = 0;
+	}
+
+	// Close the file and exit
+	assoofs_close_image(&img);
+	return code;
+}